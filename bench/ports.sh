@@ -0,0 +1,49 @@
+#!/bin/sh
+# Creates and deletes ports at scale through the daemon's control socket and prints the time each batch took and the
+# daemon's resident memory with the ports up. Needs a running daemon and nc with -U.
+#
+#   bench/ports.sh [sizes] [veth_queues]    defaults: "64 512 1024 4096" 1
+#
+# XSKNET_SOCK overrides the control socket path, XSKNET_PREFIX the name ports are created under.
+
+set -eu
+
+SOCK=${XSKNET_SOCK:-/run/xsknet/control.sock}
+PREFIX=${XSKNET_PREFIX:-bp}
+SIZES=${1:-"64 512 1024 4096"}
+QUEUES=${2:-1}
+
+now_ns() {
+    date +%s%N
+}
+
+ctl() {
+    echo "$1" | nc -U -q30 "$SOCK"
+}
+
+daemon_rss_kb() {
+    pid=$(pidof daemon 2>/dev/null | cut -d' ' -f1)
+    if [ -n "$pid" ]; then
+        awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status"
+    else
+        echo "-"
+    fi
+}
+
+[ -S "$SOCK" ] || { echo "no daemon socket at $SOCK" >&2; exit 1; }
+
+printf "%6s %10s %10s %12s %12s %10s %10s\n" ports create_ms delete_ms create_us/port delete_us/port ok rss_kb
+for n in $SIZES; do
+    start=$(now_ns)
+    ok=$(ctl "batch create $PREFIX count=$n veth_queues=$QUEUES" | grep -c " OK$" || true)
+    created=$(now_ns)
+    rss=$(daemon_rss_kb)
+
+    ctl "batch delete $PREFIX count=$n" > /dev/null
+    deleted=$(now_ns)
+
+    create_ns=$((created - start))
+    delete_ns=$((deleted - created))
+    printf "%6d %10d %10d %12d %12d %10d %10s\n" "$n" $((create_ns / 1000000)) $((delete_ns / 1000000)) $((create_ns / 1000 / n)) \
+        $((delete_ns / 1000 / n)) "$ok" "$rss"
+done
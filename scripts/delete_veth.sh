@@ -1,3 +0,0 @@
-#!/bin/bash
-
-ip li del "$1" >/dev/null
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -7,16 +8,34 @@
 
 #include "args.h"
 #include "lwlog.h"
+#include "metrics.h"
+#include "phase_prof.h"
 #include "signal_handler.h"
 #include "veth_list.h"
 #include "socket.h"
 #include "socket_handler.h"
+#include "steer_kern_user.h"
 #include "xsk_utils.h"
 #include "xsk_stats.h"
 #include "xsk_receive.h"
 
 #include "uthash.h"
 
+enum { CMD_REPLY_SIZE = 256 };
+
+/* RX loop of one XSK, direct mode runs one per PHY queue */
+struct rx_worker {
+    pthread_t thread;
+    struct xsk_socket_info* xsk;
+    struct egress_sock egress;
+};
+
+static void* rx_worker_thread(void* arg) {
+    struct rx_worker* worker = arg;
+    rx_and_process(worker->xsk, &global_exit_flag, &worker->egress);
+    return NULL;
+}
+
 int main(const int argc, char* argv[]) {
     options_parser(argc, argv, &opts);
 
@@ -25,33 +44,122 @@ int main(const int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    phase_init(opts.dev);
     client_signal_init();
 
     lwlog_info("Starting client");
 
-    request_port(opts.dev);
+    struct phase_clock clock;
+    phase_clock_start(&clock);
 
     char phy_ifname[IFNAMSIZ];
-    request_phy_ifname(phy_ifname);
-    lwlog_info("Phy interface name: %s", phy_ifname);
+    char binding[CMD_REPLY_SIZE];
+    static struct ctl_fds handover;
+    struct xsk_layout layout;
+    if (request_attach(opts.dev, phy_ifname, binding, sizeof(binding), &handover, &layout) < 0) {
+        lwlog_crit("Couldn't attach port %s", opts.dev);
+        exit(EXIT_FAILURE);
+    }
+    phase_clock_mark(&clock, PHASE_ATTACH);
 
-    set_memory_limit();
+    char mode[16], bind_ifname[IFNAMSIZ], queue_list[CMD_REPLY_SIZE];
+    if (sscanf(binding, "%15s %15s %255s", mode, bind_ifname, queue_list) != 3) {
+        lwlog_crit("Unexpected binding from daemon: %s", binding);
+        exit(EXIT_FAILURE);
+    }
+    const bool switched = strcmp(mode, "switch") == 0;
 
     struct egress_sock ingress;
     init_iface(&ingress, phy_ifname);
 
-    struct xsk_socket_info* xsk_socket = init_xsk_socket(opts.dev);
-    if (xsk_socket == NULL) {
-        lwlog_crit("init_xsk_socket: %s", strerror(errno));
+    /* The daemon's XSKs are bound and charged to it already, only binding our own needs the memlock limit lifted */
+    if (handover.nr > 0 && !switched)
+        ingress.sockfd = handover.fds[0];
+    else if (handover.nr == 0)
+        set_memory_limit();
+
+    static struct rx_worker workers[PHY_QUEUES_MAX];
+    static struct xsk_socket_info* switch_xsks[PHY_QUEUES_MAX];
+    int nr_workers = 0;
+    phase_clock_skip(&clock);
+    if (switched) {
+        /* Rings on the daemon's XSKs instead of sockets of our own, it sends our tx out of the PHY too */
+        nr_workers = xsk_switch_attach(&handover, queue_list, &layout, switch_xsks, PHY_QUEUES_MAX);
+        if (nr_workers <= 0) {
+            lwlog_crit("Couldn't attach to the daemon's switch: %s", binding);
+            exit(EXIT_FAILURE);
+        }
+    } else if (handover.nr > 0) {
+        /* Egress socket first, then an XSK and its UMEM per queue in binding order */
+        for (char* queue = strtok(queue_list, ","); queue != NULL && nr_workers < PHY_QUEUES_MAX; queue = strtok(NULL, ",")) {
+            const int fd = 1 + 2 * nr_workers;
+            if (fd + 1 >= handover.nr) {
+                lwlog_crit("Daemon handed over fewer XSKs than queues in %s", binding);
+                exit(EXIT_FAILURE);
+            }
+            workers[nr_workers].xsk = xsk_socket_adopt(handover.fds[fd], handover.fds[fd + 1], atoi(queue), &layout);
+            workers[nr_workers].egress = ingress;
+            if (workers[nr_workers++].xsk == NULL)
+                exit(EXIT_FAILURE);
+        }
+    } else if (strcmp(mode, "direct") == 0) {
+        /* One XSK and RX loop per dedicated PHY queue, no veth in between */
+        for (char* queue = strtok(queue_list, ","); queue != NULL && nr_workers < PHY_QUEUES_MAX; queue = strtok(NULL, ",")) {
+            workers[nr_workers].xsk = init_xsk_socket_direct(bind_ifname, atoi(queue));
+            workers[nr_workers].egress = ingress;
+            if (workers[nr_workers++].xsk == NULL) {
+                lwlog_crit("init_xsk_socket_direct %s queue %s: %s", bind_ifname, queue, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    } else {
+        /* One XSK per queue of the inner veth, the outer end spreads redirected frames over them by CPU */
+        for (char* queue = strtok(queue_list, ","); queue != NULL && nr_workers < PHY_QUEUES_MAX; queue = strtok(NULL, ",")) {
+            workers[nr_workers].xsk = init_xsk_socket(opts.dev, atoi(queue));
+            workers[nr_workers].egress = ingress;
+            if (workers[nr_workers++].xsk == NULL) {
+                lwlog_crit("init_xsk_socket %s queue %s: %s", bind_ifname, queue, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
     }
+    phase_clock_mark(&clock, PHASE_XSK_SETUP);
 
     pthread_t stats_poll_thread;
-    int err = pthread_create(&stats_poll_thread, NULL, stats_poll, xsk_socket);
+    int err = pthread_create(&stats_poll_thread, NULL, stats_poll, NULL);
+    if (err != 0) {
+        lwlog_crit("pthread_create: %s", strerror(err));
+    }
+
+    pthread_t metrics_port_thread_id;
+    err = pthread_create(&metrics_port_thread_id, NULL, metrics_port_thread, opts.dev);
+    if (err != 0) {
+        lwlog_crit("pthread_create: %s", strerror(err));
+    }
+
+    pthread_t stats_shm_thread_id;
+    err = pthread_create(&stats_shm_thread_id, NULL, stats_shm_thread, opts.dev);
     if (err != 0) {
         lwlog_crit("pthread_create: %s", strerror(err));
     }
 
-    rx_and_process(xsk_socket, &global_exit_flag, &ingress);
+    if (switched) {
+        switch_rx_and_process(switch_xsks, nr_workers, handover.fds[1], &global_exit_flag, &ingress);
+        remove_port(opts.dev);
+        return 0;
+    }
+
+    for (int i = 1; i < nr_workers; i++) {
+        err = pthread_create(&workers[i].thread, NULL, rx_worker_thread, &workers[i]);
+        if (err != 0) {
+            lwlog_crit("pthread_create: %s", strerror(err));
+        }
+    }
+
+    rx_and_process(workers[0].xsk, &global_exit_flag, &workers[0].egress);
+
+    for (int i = 1; i < nr_workers; i++)
+        pthread_join(workers[i].thread, NULL);
 
     remove_port(opts.dev);
 
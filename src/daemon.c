@@ -1,14 +1,26 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <linux/limits.h>
 
 #include "args.h"
+#include "daemon_state.h"
 #include "lwlog.h"
+#include "metrics.h"
+#include "phase_prof.h"
+#include "port_prog.h"
+#include "rss.h"
 #include "signal_handler.h"
 #include "veth_list.h"
 #include "socket.h"
 #include "socket_handler.h"
+#include "stats_shm.h"
+#include "steer.h"
+#include "xdp_stats.h"
+#include "xdp_trace.h"
 #include "xdp_utils.h"
+#include "xsk_pool.h"
+#include "xsk_switch.h"
 
 int main(const int argc, char* argv[]) {
     options_parser(argc, argv, &opts);
@@ -18,20 +30,98 @@ int main(const int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    phase_init("daemon");
     daemon_signal_init();
     lwlog_info("Starting Daemon");
     // veths = veth_list_create(10);
 
-    int err = pthread_create(&socket_thread, NULL, socket_server_thread_func, &global_exit_flag);
+    /* The previous daemon's programs and ports are still live, take them over rather than set up again */
+    const bool resume = daemon_state_resumable();
+    if (resume)
+        lwlog_info("Resuming the dataplane left on %s", opts.dev);
+
+    int err = pthread_create(&metrics_thread, NULL, metrics_server_thread, &global_exit_flag);
     if (err != 0) {
         lwlog_crit("pthread_create: %s", strerror(err));
         exit(EXIT_FAILURE);
     }
 
-    err = load_xdp_and_attach_to_ifname(opts.dev, "obj/phy_xdp.o", "xdp_redirect", "xdp_devmap");
+    err = pthread_create(&xdp_stats_thread, NULL, xdp_stats_poll, &global_exit_flag);
+    if (err != 0) {
+        lwlog_crit("pthread_create: %s", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    err = xdp_trace_init();
     if (err != EXIT_OK) {
-        lwlog_crit("load_xdp_and_attach_to_ifname: %s", strerror(err));
+        lwlog_crit("xdp_trace_init failed");
+        exit(EXIT_FAILURE);
+    }
+
+    err = pthread_create(&xdp_trace_thread, NULL, xdp_trace_poll, &global_exit_flag);
+    if (err != 0) {
+        lwlog_crit("pthread_create: %s", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!resume) {
+        char obj[PATH_MAX];
+        xdp_obj_path(obj, sizeof(obj), "phy_xdp");
+        err = load_xdp_and_attach_to_ifname(opts.dev, obj, "xdp_redirect", "xdp_devmap");
+        if (err != EXIT_OK) {
+            lwlog_crit("load_xdp_and_attach_to_ifname: %s", strerror(err));
+            if (opts.xdp_mode == XDP_POLICY_REQUIRE_NATIVE)
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    struct phase_clock clock;
+    phase_clock_start(&clock);
+
+    /* Verify the port programs once, creating a port only attaches them. Interfaces that kept running keep their copies */
+    if (port_prog_init() < 0) {
+        lwlog_crit("Couldn't load the port programs");
+        exit(EXIT_FAILURE);
+    }
+    phase_clock_mark(&clock, PHASE_PORT_PROG_INIT);
+
+    /* Clients get their XSKs from the daemon, falling back to binding their own without it */
+    if (xsk_pool_init() < 0) {
+        lwlog_warning("Couldn't start the XSK pool");
+    }
+    phase_clock_mark(&clock, PHASE_XSK_POOL_INIT);
+
+    /* Ports are rings on the daemon's own XSKs from here on, there is no falling back to veth pairs once clients expect them */
+    if (opts.switch_mode && xsk_switch_init(opts.dev) < 0) {
+        lwlog_crit("Couldn't start the switch on %s", opts.dev);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Without it the daemon still pulls each port's counters over its metrics socket */
+    if (stats_shm_create(resume) < 0) {
+        lwlog_warning("Couldn't share port stats in %s", STATS_SHM_DIR);
+    }
+
+    if (resume) {
+        daemon_state_restore();
+        phase_clock_mark(&clock, PHASE_RESTORE);
+        daemon_state_clear();
+    } else {
+        /* Nothing to steer to until the first port shows up, leave the PHY's traffic to the stack */
+        steer_set_default(STEER_NO_DEFAULT);
+    }
+
+    /* Clients only get in once the port list is complete, a restored port must not be created twice */
+    err = pthread_create(&socket_thread, NULL, socket_server_thread_func, &global_exit_flag);
+    if (err != 0) {
+        lwlog_crit("pthread_create: %s", strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.rss_cpus[0] != '\0' && rss_configure(opts.rss_cpus, opts.rss_qsize) < 0) {
+        lwlog_crit("Couldn't set up software RSS over CPUs %s", opts.rss_cpus);
     }
+    phase_log_summary();
 
     while (!global_exit_flag) {
         sleep(1);
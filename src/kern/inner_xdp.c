@@ -6,24 +6,29 @@
 #include <bpf/bpf_helpers.h>
 #include <arpa/inet.h>
 
-#define OVER(x, d) (x + 1 > (typeof(x))d)
+#include "pkt_meta_kern.h"
+#include "steer_kern_user.h"
+#include "xdp_stats_kern.h"
+#include "xdp_trace_kern.h"
 
-struct {
-    __uint(type, BPF_MAP_TYPE_XSKMAP);
-    __type(key, __u32);
-    __type(value, __u32);
-    __uint(max_entries, 64);
-} xsks_map SEC(".maps");
+#define OVER(x, d) (x + 1 > (typeof(x))d)
 
+/* One program serves every inner veth, each port's xsks_map is found by the ifindex the frame arrived on */
 struct {
-    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(type, BPF_MAP_TYPE_HASH_OF_MAPS);
     __type(key, __u32);
-    __type(value, __u32);
-    __uint(max_entries, 64);
-} xdp_stats_map SEC(".maps");
-
-SEC("xdp")
-int xdp_sock_prog(struct xdp_md* ctx) {
+    __uint(max_entries, DEVMAP_SLOTS);
+    __array(
+        values, struct {
+            __uint(type, BPF_MAP_TYPE_XSKMAP);
+            __type(key, __u32);
+            __type(value, __u32);
+            __uint(max_entries, PORT_XSK_QUEUES);
+        });
+} xsk_ports SEC(".maps");
+
+static __always_inline __u32 xsk_verdict(struct xdp_md* ctx) {
+    const __u32 ifindex = ctx->ingress_ifindex;
     const int index = ctx->rx_queue_index;
 
     void* data_end = (void*)(long)ctx->data_end;
@@ -43,21 +48,28 @@ int xdp_sock_prog(struct xdp_md* ctx) {
 
     if (iph->protocol != IPPROTO_ICMP)
         return XDP_PASS;
-    bpf_printk("AF_XDP socket program-------------");
-
-    bpf_printk("Source MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_source[0], eth->h_source[1], eth->h_source[2], eth->h_source[3], eth->h_source[4], eth->h_source[5]);
 
-    bpf_printk("Dest MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
-
-    bpf_printk("Source IP: %pI4", &iph->saddr);
-    bpf_printk("Dest IP: %pI4", &iph->daddr);
+    void* xsks_map = bpf_map_lookup_elem(&xsk_ports, &ifindex);
+    if (!xsks_map)
+        return XDP_DROP;
 
     /* A set entry here means that the correspnding queue_id
      * has an active AF_XDP socket bound to it. */
-    if (bpf_map_lookup_elem(&xsks_map, &index))
-        return bpf_redirect_map(&xsks_map, index, 0);
+    if (bpf_map_lookup_elem(xsks_map, &index)) {
+        /* Keeps the PHY stamp, only stamps here when it got lost on the way (e.g. generic XDP redirect) */
+        pkt_meta_stamp(ctx, 0);
+        return bpf_redirect_map(xsks_map, index, 0);
+    }
 
     return XDP_DROP;
 }
 
+SEC("xdp")
+int xdp_sock_prog(struct xdp_md* ctx) {
+    const __u32 verdict = xsk_verdict(ctx);
+
+    xdp_trace_sample(ctx, XDP_TRACE_HOOK_XSK, verdict);
+    return xdp_stats_record_action(ctx, verdict);
+}
+
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
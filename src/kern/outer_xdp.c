@@ -4,10 +4,12 @@
 #include <bpf/bpf_helpers.h>
 #include <arpa/inet.h>
 
+#include "xdp_stats_kern.h"
+#include "xdp_trace_kern.h"
+
 #define OVER(x, d) (x + 1 > (typeof(x))d)
 
-SEC("xdp_redirect_dummy")
-int xdp_redirect_dummy_prog(struct xdp_md* ctx) {
+static __always_inline __u32 dummy_verdict(struct xdp_md* ctx) {
     void* data_end = (void*)(long)ctx->data_end;
     void* data = (void*)(long)ctx->data;
 
@@ -26,16 +28,15 @@ int xdp_redirect_dummy_prog(struct xdp_md* ctx) {
     if (iph->protocol != IPPROTO_ICMP)
         return XDP_PASS;
 
-    bpf_printk("Dummy interface------------------");
-
-    bpf_printk("Source MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_source[0], eth->h_source[1], eth->h_source[2], eth->h_source[3], eth->h_source[4], eth->h_source[5]);
-
-    bpf_printk("Dest MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
+    return XDP_PASS;
+}
 
-    bpf_printk("Source IP: %pI4", &iph->saddr);
-    bpf_printk("Dest IP: %pI4\n", &iph->daddr);
+SEC("xdp_redirect_dummy")
+int xdp_redirect_dummy_prog(struct xdp_md* ctx) {
+    const __u32 verdict = dummy_verdict(ctx);
 
-    return XDP_PASS;
+    xdp_trace_sample(ctx, XDP_TRACE_HOOK_DUMMY, verdict);
+    return xdp_stats_record_action(ctx, verdict);
 }
 
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
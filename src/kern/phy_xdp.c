@@ -4,11 +4,23 @@
 #include <linux/if_ether.h>
 #include <arpa/inet.h>
 #include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "pkt_meta_kern.h"
+#include "port_registry_kern_user.h"
+#include "rss_kern_user.h"
+#include "steer_kern_user.h"
+#include "xdp_stats_kern.h"
+#include "xdp_trace_kern.h"
 
 /**
  * Main XDP program entry point.
- * This is the entry point for all XDP packets. It redirects packets depending on the arbitrary port number defined in eth data
- * payload. It will redirect packets to different virtual interfaces depending on the port number.
+ * This is the entry point for all XDP packets. Packets matching a steering rule in steer_map (destination MAC, destination IP
+ * or L4 destination port) are redirected to the port owning the rule's devmap slot, unmatched ICMP goes to the default port.
+ * RX queues taken over by a direct mode port go straight to that port's XSK through phy_xsks_map. With the daemon's switch
+ * enabled, steered frames go to its XSK on the receiving queue through switch_xsks instead of the devmap. With software RSS enabled
+ * the steering runs in xdp_rss_cpumap on one of the configured CPUs instead. On the way into a port xdp_port_egress rewrites
+ * the L2 header as the port's entry in port_registry says.
  */
 
 #ifndef memcpy
@@ -16,67 +28,292 @@
 #endif
 
 #define OVER(x, d) (x + 1 > (typeof(x))d)
-struct pkt_meta {
-    __u32 port;
+
+/* Bits of iphdr.frag_off, only the first fragment carries the L4 header */
+#ifndef IP_MF
+#define IP_MF 0x2000
+#endif
+#ifndef IP_OFFSET
+#define IP_OFFSET 0x1FFF
+#endif
+
+/* Where the L4 header of iph starts, 0 for non-first fragments and header lengths below the minimum */
+static __always_inline void* ip_l4_header(struct iphdr* iph) {
+    if (iph->ihl < 5 || (iph->frag_off & htons(IP_OFFSET)))
+        return 0;
+    return (void*)iph + iph->ihl * 4;
+}
+
+struct vlan_hdr {
+    __be16 tci;
+    __be16 encap_proto;
 };
 
+// devmap, keyed by port slot, every entry runs xdp_port_egress
+struct {
+    __uint(type, BPF_MAP_TYPE_DEVMAP);
+    __uint(key_size, sizeof(int));
+    __uint(value_size, sizeof(struct bpf_devmap_val));
+    __uint(max_entries, DEVMAP_SLOTS);
+} xdp_devmap SEC(".maps");
+
+/* Every port by ifindex, kept by the daemon and pinned with the rest so tools and the port programs see the same ports */
 struct {
-    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct port_key);
+    __type(value, struct port_entry);
+    __uint(max_entries, PORT_REGISTRY_MAX);
+} port_registry SEC(".maps");
+
+/* XSKs of direct mode ports, keyed by the PHY RX queue they took over */
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
     __type(key, __u32);
     __type(value, __u32);
-    __uint(max_entries, 64);
-} xdp_stats_map SEC(".maps");
+    __uint(max_entries, PHY_QUEUES_MAX);
+} phy_xsks_map SEC(".maps");
 
-// devmap
+/* XSKs of the daemon's switch (--switch), keyed by PHY RX queue. The daemon hands frames on by pkt_meta.port */
 struct {
-    __uint(type, BPF_MAP_TYPE_DEVMAP);
-    __uint(key_size, sizeof(int));
-    __uint(value_size, sizeof(int));
-    __uint(max_entries, 64);
-} xdp_devmap SEC(".maps");
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, PHY_QUEUES_MAX);
+} switch_xsks SEC(".maps");
 
-SEC("xdp_redir")
-int xdp_redirect(struct xdp_md* ctx) {
-    void* data_end = (void*)(long)ctx->data_end;
-    void* data = (void*)(long)ctx->data;
+/* Software RSS, frames are spread over rss_cpus[0, rss_cfg.nr_cpus) and steered there by xdp_rss_cpumap */
+struct {
+    __uint(type, BPF_MAP_TYPE_CPUMAP);
+    __type(key, __u32);
+    __type(value, struct bpf_cpumap_val);
+    __uint(max_entries, RSS_CPUS_MAX);
+} cpu_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, RSS_CPUS_MAX);
+} rss_cpus SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct rss_cfg);
+    __uint(max_entries, 1);
+} rss_cfg SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct steer_key);
+    __type(value, __u32);
+    __uint(max_entries, STEER_RULES_MAX);
+} steer_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct steer_cfg);
+    __uint(max_entries, 1);
+} steer_cfg SEC(".maps");
+
+static __always_inline int steer_lookup(struct steer_key* key, __u32* slot) {
+    const __u32* found = bpf_map_lookup_elem(&steer_map, key);
+    if (!found)
+        return 0;
 
+    *slot = *found;
+    return 1;
+}
+
+/* Picks the devmap slot for the frame, returns XDP_REDIRECT when one was found */
+static __always_inline __u32 steer_classify(void* data, void* data_end, __u32* slot) {
+    struct steer_key key = {0};
     struct ethhdr* eth = data;
     struct iphdr* iph = (struct iphdr*)(eth + 1);
 
     if (OVER(eth, data_end))
         return XDP_DROP;
 
+    key.kind = STEER_DST_MAC;
+    memcpy(key.dst_mac, eth->h_dest, ETH_ALEN);
+    if (steer_lookup(&key, slot))
+        return XDP_REDIRECT;
+
     if (eth->h_proto != ntohs(ETH_P_IP))
         return XDP_PASS;
 
     if (OVER(iph, data_end))
         return XDP_DROP;
 
+    __builtin_memset(&key, 0, sizeof(key));
+    key.kind = STEER_DST_IP;
+    key.dst_ip = iph->daddr;
+    if (steer_lookup(&key, slot))
+        return XDP_REDIRECT;
+
+    if (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) {
+        /* dest sits at the same offset in both headers */
+        struct udphdr* l4 = ip_l4_header(iph);
+        if (!l4 || OVER(l4, data_end))
+            return XDP_PASS;
+
+        __builtin_memset(&key, 0, sizeof(key));
+        key.kind = STEER_L4_PORT;
+        key.l4_port = l4->dest;
+        if (steer_lookup(&key, slot))
+            return XDP_REDIRECT;
+    }
+
     if (iph->protocol != IPPROTO_ICMP)
         return XDP_PASS;
 
-    bpf_printk("Physical interface xdp_redirect------------------");
+    const __u32 zero = 0;
+    const struct steer_cfg* cfg = bpf_map_lookup_elem(&steer_cfg, &zero);
+    if (!cfg || cfg->default_slot == STEER_NO_DEFAULT)
+        return XDP_PASS;
+
+    *slot = cfg->default_slot;
+    return XDP_REDIRECT;
+}
 
-    bpf_printk("Source MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_source[0], eth->h_source[1], eth->h_source[2], eth->h_source[3], eth->h_source[4], eth->h_source[5]);
+/* Flow hash over the IPv4 addresses, protocol and L4 ports, -1 for frames that stay on this CPU */
+static __always_inline int rss_pick_cpu(struct xdp_md* ctx) {
+    void* data_end = (void*)(long)ctx->data_end;
+    void* data = (void*)(long)ctx->data;
+    const __u32 zero = 0;
 
-    bpf_printk("Dest MAC: %02x:%02x:%02x:%02x:%02x:%02x", eth->h_dest[0], eth->h_dest[1], eth->h_dest[2], eth->h_dest[3], eth->h_dest[4], eth->h_dest[5]);
+    const struct rss_cfg* cfg = bpf_map_lookup_elem(&rss_cfg, &zero);
+    if (!cfg || cfg->nr_cpus == 0)
+        return -1;
 
-    bpf_printk("Source IP: %pI4", &iph->saddr);
-    bpf_printk("Dest IP: %pI4", &iph->daddr);
+    struct ethhdr* eth = data;
+    struct iphdr* iph = (struct iphdr*)(eth + 1);
+    if (OVER(eth, data_end) || eth->h_proto != ntohs(ETH_P_IP) || OVER(iph, data_end))
+        return -1;
 
-    const __u32 port = 0;
+    /* Every fragment of a datagram hashes alike, the ports are in the first one only */
+    __u32 hash = iph->saddr ^ iph->daddr ^ iph->protocol;
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) && !(iph->frag_off & htons(IP_MF | IP_OFFSET))) {
+        struct udphdr* l4 = ip_l4_header(iph);
+        if (l4 && !OVER(l4, data_end))
+            hash ^= ((__u32)l4->source << 16) | l4->dest;
+    }
+    hash *= 0x9e3779b1;
+    hash ^= hash >> 16;
 
-    const int* ifindex = bpf_map_lookup_elem(&xdp_devmap, &port);
+    const __u32 index = hash % cfg->nr_cpus;
+    const __u32* cpu = bpf_map_lookup_elem(&rss_cpus, &index);
+    return cpu ? (int)*cpu : -1;
+}
 
-    if (!ifindex) {
+/* Steers the frame to a port, runs on the receiving CPU or, with software RSS, on the CPU picked by rss_pick_cpu */
+static __always_inline __u32 phy_verdict(struct xdp_md* ctx) {
+    void* data_end = (void*)(long)ctx->data_end;
+    void* data = (void*)(long)ctx->data;
+    __u32 slot = 0;
+
+    const __u32 action = steer_classify(data, data_end, &slot);
+    if (action != XDP_REDIRECT)
+        return action;
+
+    /* Stamp ingress time as close to the wire as we get, the veth redirect carries it to the XSK */
+    pkt_meta_stamp(ctx, slot);
+    pkt_meta_set_port(ctx, slot);
+
+    /* Goes through the devmap bulk queue, flushed once per NAPI poll. An empty slot drops, like a missing port did before */
+    return bpf_redirect_map(&xdp_devmap, slot, XDP_DROP);
+}
+
+/* Steers the frame like phy_verdict, into the switch XSK of its queue instead of the port's devmap slot */
+static __always_inline __u32 switch_verdict(struct xdp_md* ctx, const __u32 queue) {
+    void* data_end = (void*)(long)ctx->data_end;
+    void* data = (void*)(long)ctx->data;
+    __u32 slot = 0;
+
+    const __u32 action = steer_classify(data, data_end, &slot);
+    if (action != XDP_REDIRECT)
+        return action;
+
+    /* The daemon reads the slot back out of the metadata, a frame without it has no port to go to */
+    if (pkt_meta_stamp(ctx, slot) < 0)
+        return XDP_DROP;
+    pkt_meta_set_port(ctx, slot);
+    return bpf_redirect_map(&switch_xsks, queue, XDP_DROP);
+}
+
+SEC("xdp_redir")
+int xdp_redirect(struct xdp_md* ctx) {
+    const __u32 queue = ctx->rx_queue_index;
+    __u32 verdict;
+
+    if (bpf_map_lookup_elem(&phy_xsks_map, &queue)) {
+        /* A dedicated queue skips steering and both veth hops, the frame lands in the port's XSK as is. Stays on this CPU,
+         * the XSK only accepts frames from the queue it is bound to */
+        pkt_meta_stamp(ctx, PKT_META_DIRECT);
+        verdict = bpf_redirect_map(&phy_xsks_map, queue, XDP_PASS);
+    } else if (bpf_map_lookup_elem(&switch_xsks, &queue)) {
+        /* Switch mode, the daemon's XSK on this queue fans frames out to the ports. Ahead of RSS, it is bound to this queue */
+        verdict = switch_verdict(ctx, queue);
+    } else {
+        const int cpu = rss_pick_cpu(ctx);
+        if (cpu >= 0) {
+            /* Counted and traced by xdp_rss_cpumap once it has a verdict. A CPU without an entry keeps the frame in the stack */
+            pkt_meta_stamp(ctx, 0);
+            return bpf_redirect_map(&cpu_map, cpu, XDP_PASS);
+        }
+        verdict = phy_verdict(ctx);
+    }
+
+    xdp_trace_sample(ctx, XDP_TRACE_HOOK_PHY, verdict);
+    return xdp_stats_record_action(ctx, verdict);
+}
+
+SEC("xdp/cpumap")
+int xdp_rss_cpumap(struct xdp_md* ctx) {
+    const __u32 verdict = phy_verdict(ctx);
+
+    xdp_trace_sample(ctx, XDP_TRACE_HOOK_PHY, verdict);
+    return xdp_stats_record_action(ctx, verdict);
+}
+
+/* Runs on the devmap bulk queue of each port right before the frame is handed to it */
+SEC("xdp/devmap")
+int xdp_port_egress(struct xdp_md* ctx) {
+    const struct port_key key = {.ifindex = ctx->egress_ifindex, .queue = PORT_KEY_ANY_QUEUE};
+
+    const struct port_entry* port = bpf_map_lookup_elem(&port_registry, &key);
+    if (!port || port->l2.flags == 0)
+        return XDP_PASS;
+    const struct port_l2* l2 = &port->l2;
+
+    /* Moves the metadata along with the head, pkt_meta stays in front of the frame */
+    if ((l2->flags & PORT_L2_VLAN) && bpf_xdp_adjust_head(ctx, -(int)sizeof(struct vlan_hdr)))
+        return XDP_DROP;
+
+    void* data_end = (void*)(long)ctx->data_end;
+    void* data = (void*)(long)ctx->data;
+    struct ethhdr* eth = data;
+
+    if (l2->flags & PORT_L2_VLAN) {
+        struct vlan_hdr* vlan = (struct vlan_hdr*)(eth + 1);
+        if (OVER(vlan, data_end))
+            return XDP_DROP;
+
+        /* Slide the MACs back into place, the old EtherType now sits in vlan->encap_proto */
+        __builtin_memmove(data, data + sizeof(*vlan), 2 * ETH_ALEN);
+        eth->h_proto = htons(ETH_P_8021Q);
+        vlan->tci = l2->vlan_tci;
+    } else if (OVER(eth, data_end)) {
         return XDP_DROP;
     }
 
-    return bpf_redirect(*ifindex, 0);
+    if (l2->flags & PORT_L2_DST_MAC)
+        memcpy(eth->h_dest, l2->dst_mac, ETH_ALEN);
+    if (l2->flags & PORT_L2_SRC_MAC)
+        memcpy(eth->h_source, l2->src_mac, ETH_ALEN);
 
-    // if (bpf_map_lookup_elem(&xdp_devmap, &port)) {
-    //     bpf_printk("xdp_redirect: port=%d\n", port);
-    //     return bpf_redirect_map(&xdp_devmap, port, 0);
-    // }
+    return XDP_PASS;
 }
+
 char _license[] SEC("license") = "GPL";
\ No newline at end of file
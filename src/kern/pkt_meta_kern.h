@@ -0,0 +1,40 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "pkt_meta.h"
+
+/*
+ * Stamps the frame with the ingress time unless an earlier hook already did. Adjusting the metadata invalidates every packet
+ * pointer the caller derived from ctx, so call this after parsing is done. port is the devmap slot the frame was steered to.
+ */
+static __always_inline int pkt_meta_stamp(struct xdp_md* ctx, __u32 port) {
+    void* data = (void*)(long)ctx->data;
+    struct pkt_meta* meta = (void*)(long)ctx->data_meta;
+
+    if ((void*)(meta + 1) <= data && meta->magic == PKT_META_MAGIC)
+        return 0;
+
+    if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+        return -1;
+
+    data = (void*)(long)ctx->data;
+    meta = (void*)(long)ctx->data_meta;
+    if ((void*)(meta + 1) > data)
+        return -1;
+
+    meta->rx_timestamp = bpf_ktime_get_ns();
+    meta->port = port;
+    meta->magic = PKT_META_MAGIC;
+    return 0;
+}
+
+/* Records the port on a frame an earlier hook already stamped */
+static __always_inline void pkt_meta_set_port(struct xdp_md* ctx, __u32 port) {
+    void* data = (void*)(long)ctx->data;
+    struct pkt_meta* meta = (void*)(long)ctx->data_meta;
+
+    if ((void*)(meta + 1) <= data && meta->magic == PKT_META_MAGIC)
+        meta->port = port;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "xdp_stats_kern_user.h"
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __type(key, struct xdp_stats_key);
+    __type(value, struct datarec);
+    __uint(max_entries, XDP_STATS_IFACES_MAX * XDP_ACTION_MAX);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} xdp_stats_map SEC(".maps");
+
+/* Counts the verdict and the frame size of the receiving interface on this CPU and passes the verdict through */
+static __always_inline __u32 xdp_stats_record_action(struct xdp_md* ctx, __u32 action) {
+    if (action >= XDP_ACTION_MAX)
+        return XDP_ABORTED;
+
+    const struct xdp_stats_key key = {.ifindex = ctx->ingress_ifindex, .action = action};
+    struct datarec* rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
+    if (!rec) {
+        /* First frame of this interface and verdict. Losing the race to another CPU is fine, the lookup finds its entry */
+        const struct datarec zero = {0};
+        bpf_map_update_elem(&xdp_stats_map, &key, &zero, BPF_NOEXIST);
+        rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
+        /* A full map loses the count, not the frame */
+        if (!rec)
+            return action;
+    }
+
+    rec->rx_packets++;
+    rec->rx_bytes += ctx->data_end - ctx->data;
+
+    return action;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "xdp_trace_kern_user.h"
+
+#ifdef XSKNET_TRACE
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, XDP_TRACE_RINGBUF_SIZE);
+} trace_events SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct xdp_trace_cfg);
+    __uint(max_entries, 1);
+} trace_cfg SEC(".maps");
+
+/* Emits one event for every sample_rate-th packet, safe to call after the verdict has been decided */
+static __always_inline void xdp_trace_sample(struct xdp_md* ctx, __u8 hook, __u32 verdict) {
+    const __u32 key = 0;
+    struct xdp_trace_cfg* cfg = bpf_map_lookup_elem(&trace_cfg, &key);
+    if (!cfg || cfg->sample_rate == 0)
+        return;
+
+    if (cfg->sample_rate > 1 && bpf_get_prandom_u32() % cfg->sample_rate)
+        return;
+
+    struct xdp_trace_event* ev = bpf_ringbuf_reserve(&trace_events, sizeof(*ev), 0);
+    if (!ev) {
+        __sync_fetch_and_add(&cfg->dropped, 1);
+        return;
+    }
+    __builtin_memset(ev, 0, sizeof(*ev));
+
+    void* data_end = (void*)(long)ctx->data_end;
+    void* data = (void*)(long)ctx->data;
+
+    ev->timestamp = bpf_ktime_get_ns();
+    ev->ifindex = ctx->ingress_ifindex;
+    ev->rx_queue = ctx->rx_queue_index;
+    ev->pkt_len = data_end - data;
+    ev->verdict = verdict;
+    ev->hook = hook;
+
+    struct ethhdr* eth = data;
+    if ((void*)(eth + 1) <= data_end) {
+        __builtin_memcpy(ev->h_source, eth->h_source, ETH_ALEN);
+        __builtin_memcpy(ev->h_dest, eth->h_dest, ETH_ALEN);
+        ev->h_proto = eth->h_proto;
+
+        struct iphdr* iph = (struct iphdr*)(eth + 1);
+        if (eth->h_proto == bpf_htons(ETH_P_IP) && (void*)(iph + 1) <= data_end) {
+            ev->saddr = iph->saddr;
+            ev->daddr = iph->daddr;
+            ev->protocol = iph->protocol;
+        }
+    }
+
+    bpf_ringbuf_submit(ev, 0);
+}
+
+#else
+
+/* Production objects carry no tracing at all */
+static __always_inline void xdp_trace_sample(struct xdp_md* ctx, __u8 hook, __u32 verdict) {}
+
+#endif
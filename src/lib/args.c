@@ -20,6 +20,10 @@
 #include <getopt.h>
 
 #include "messages.h"
+#include "metrics.h"
+#include "rss_kern_user.h"
+#include "xsk_pool.h"
+#include "xsk_utils.h"
 #include "args.h"
 
 /*
@@ -31,6 +35,58 @@ static void set_default_options(options_t* options) {
     options->use_colors = true;
     strncpy(options->file_name, "-", FILE_NAME_SIZE);
     strncpy(options->dev, "/dev/stdout", DEV_NAME_SIZE);
+    options->metrics_port = METRICS_DEFAULT_PORT;
+    options->steer[0] = '\0';
+    options->queues[0] = '\0';
+    options->rss_cpus[0] = '\0';
+    options->rss_qsize = RSS_DEFAULT_QSIZE;
+    options->xdp_mode = XDP_POLICY_PREFER_NATIVE;
+    options->switch_mode = false;
+    options->ctl_group[0] = '\0';
+    options->pool_frames = XSK_POOL_FRAMES_DEFAULT;
+}
+
+/*
+ * Maps the --xdp-mode argument to its policy, exits on anything else
+ */
+static enum xdp_mode_policy parse_xdp_mode(const char* mode) {
+    if (strcmp(mode, "native") == 0)
+        return XDP_POLICY_REQUIRE_NATIVE;
+    if (strcmp(mode, "prefer-native") == 0)
+        return XDP_POLICY_PREFER_NATIVE;
+    if (strcmp(mode, "generic") == 0)
+        return XDP_POLICY_GENERIC;
+
+    usage();
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads --pool-frames, a power of two the client's frame bookkeeping can hold. Exits on anything else
+ */
+static unsigned int parse_pool_frames(const char* arg) {
+    char* end;
+    const unsigned long frames = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || frames < XSK_POOL_FRAMES_MIN || frames > NUM_FRAMES || (frames & (frames - 1)) != 0) {
+        fprintf(stderr, "--pool-frames takes a power of two from %d to %d\n", XSK_POOL_FRAMES_MIN, NUM_FRAMES);
+        exit(EXIT_FAILURE);
+    }
+    return frames;
+}
+
+/*
+ * Reads --metrics-port, a TCP port number. Exits on anything else
+ */
+static int parse_metrics_port(const char* arg) {
+    char* end;
+    const unsigned long port = strtoul(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || port < 1 || port > 65535) {
+        fprintf(stderr, "--metrics-port takes a port from 1 to 65535\n");
+        exit(EXIT_FAILURE);
+    }
+    return port;
 }
 
 /*
@@ -50,6 +106,33 @@ void switch_options(int arg, options_t* options) {
         case 'd':
             strncpy(options->dev, optarg, DEV_NAME_SIZE);
             break;
+        case 'm':
+            options->metrics_port = parse_metrics_port(optarg);
+            break;
+        case 's':
+            strncpy(options->steer, optarg, STEER_SPEC_SIZE - 1);
+            break;
+        case 'q':
+            strncpy(options->queues, optarg, DEV_NAME_SIZE - 1);
+            break;
+        case 'r':
+            strncpy(options->rss_cpus, optarg, DEV_NAME_SIZE - 1);
+            break;
+        case 'R':
+            options->rss_qsize = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            options->xdp_mode = parse_xdp_mode(optarg);
+            break;
+        case 'S':
+            options->switch_mode = true;
+            break;
+        case 'g':
+            strncpy(options->ctl_group, optarg, DEV_NAME_SIZE - 1);
+            break;
+        case 'F':
+            options->pool_frames = parse_pool_frames(optarg);
+            break;
         case 0:
             options->use_colors = false;
             break;
@@ -89,12 +172,21 @@ void options_parser(int argc, char* argv[], options_t* options) {
         {"help", no_argument, 0, 'h'},
         {"version", no_argument, 0, 'v'},
         {"dev", required_argument, 0, 'd'},
+        {"metrics-port", required_argument, 0, 'm'},
+        {"steer", required_argument, 0, 's'},
+        {"queues", required_argument, 0, 'q'},
+        {"rss-cpus", required_argument, 0, 'r'},
+        {"rss-qsize", required_argument, 0, 'R'},
+        {"xdp-mode", required_argument, 0, 'x'},
+        {"switch", no_argument, 0, 'S'},
+        {"ctl-group", required_argument, 0, 'g'},
+        {"pool-frames", required_argument, 0, 'F'},
         {"no-colors", no_argument, 0, 0},
     };
 
     while (true) {
         int option_index = 0;
-        const int arg = getopt_long(argc, argv, "hvd:t:", long_options, &option_index);
+        const int arg = getopt_long(argc, argv, "hvd:t:m:s:q:r:R:x:Sg:F:", long_options, &option_index);
         /* End of the options? */
         if (arg == -1) {
             break;
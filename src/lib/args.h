@@ -23,6 +23,15 @@
 #define FILE_NAME_SIZE 512
 /* Max size of a device name */
 #define DEV_NAME_SIZE 128
+/* Max size of the steering rules a client asks for */
+#define STEER_SPEC_SIZE 512
+
+/* --xdp-mode, how hard to insist on driver mode when attaching XDP programs */
+enum xdp_mode_policy {
+    XDP_POLICY_PREFER_NATIVE = 0, /* Native, generic when the driver can't */
+    XDP_POLICY_REQUIRE_NATIVE,    /* Native or nothing */
+    XDP_POLICY_GENERIC,           /* Always generic (SKB) mode */
+};
 
 /* Defines the command line allowed options struct */
 struct options {
@@ -31,6 +40,15 @@ struct options {
     bool use_colors;
     char file_name[FILE_NAME_SIZE];
     char dev[DEV_NAME_SIZE];
+    int metrics_port;
+    char steer[STEER_SPEC_SIZE];
+    char queues[DEV_NAME_SIZE];
+    char rss_cpus[DEV_NAME_SIZE];
+    unsigned int rss_qsize;
+    enum xdp_mode_policy xdp_mode;
+    bool switch_mode; /* Daemon: ports are rings on its own XSKs instead of veth pairs */
+    char ctl_group[DEV_NAME_SIZE]; /* Daemon: group allowed on the control socket, empty for root only */
+    unsigned int pool_frames;      /* Daemon: UMEM frames of each XSK it binds for a port */
 };
 
 /* Exports options as a global type */
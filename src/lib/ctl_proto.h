@@ -0,0 +1,79 @@
+#pragma once
+
+#include <linux/types.h>
+
+/*
+ * Binary control protocol spoken on the daemon socket. Every request and reply is a struct ctl_hdr followed by len bytes of
+ * payload, in host byte order since both ends share the machine. Request payloads carry the same arguments as the text
+ * commands, replies carry the answer or an error message. Replies echo the request id, so a client can pipeline requests
+ * on one connection and match the answers, which come back in request order.
+ *
+ * A connection whose first byte isn't CTL_MAGIC speaks the line protocol instead, one "<command> <args>" per line.
+ */
+#define CTL_MAGIC 0xc7
+#define CTL_VERSION 1
+
+/* Largest request payload the daemon takes, replies can be up to CTL_REPLY_MAX */
+#define CTL_REQ_MAX 4096
+#define CTL_REPLY_MAX (256 * 1024)
+
+/* Descriptors passed with SCM_RIGHTS alongside a reply: an egress socket plus an XSK and a UMEM memfd per queue, then the stats region */
+#define CTL_FDS_MAX (2 + 2 * 64)
+
+struct ctl_fds {
+    int nr;
+    int fds[CTL_FDS_MAX];
+};
+
+enum ctl_op {
+    CTL_OP_HELLO = 1, /* Payload is empty, reply is the daemon's protocol version as text */
+    CTL_OP_CREATE_PORT,
+    CTL_OP_DELETE_PORT,
+    CTL_OP_TRACE,
+    CTL_OP_STEER,
+    CTL_OP_RSS,
+    CTL_OP_L2,
+    CTL_OP_GET_PHY_IF,
+    CTL_OP_GET_BINDING,
+    CTL_OP_BATCH,
+    CTL_OP_ATTACH, /* create_port, then "<phy ifname> <binding>" in the reply, with the port's XSKs when the daemon made them */
+    CTL_OP_UPGRADE, /* Reply has "<ifname> verify_ms=.. swap_ms=.." per interface */
+    CTL_OP_MAX,
+};
+
+enum ctl_status {
+    CTL_OK = 0,
+    CTL_ERR_PROTO,   /* Malformed frame or unsupported version */
+    CTL_ERR_OP,      /* Unknown operation */
+    CTL_ERR_INVAL,   /* Bad arguments */
+    CTL_ERR_NOENT,   /* No such port */
+    CTL_ERR_EXIST,   /* Port already exists */
+    CTL_ERR_BUSY,    /* Out of devmap slots or PHY queues */
+    CTL_ERR_SYS,     /* Netlink, BPF or another kernel call failed */
+    CTL_ERR_PARTIAL, /* Part of a batch failed, the reply says which ports */
+    CTL_STATUS_MAX,
+};
+
+struct ctl_hdr {
+    __u8 magic;
+    __u8 version;
+    __u16 op;     /* enum ctl_op */
+    __u32 id;     /* Chosen by the client, echoed in the reply */
+    __u32 status; /* enum ctl_status, 0 in requests */
+    __u32 len;    /* Payload bytes following the header */
+};
+
+static inline const char* ctl_strerror(const unsigned int status) {
+    static const char* const names[CTL_STATUS_MAX] = {
+        [CTL_OK] = "ok",
+        [CTL_ERR_PROTO] = "protocol error",
+        [CTL_ERR_OP] = "unknown operation",
+        [CTL_ERR_INVAL] = "invalid arguments",
+        [CTL_ERR_NOENT] = "no such port",
+        [CTL_ERR_EXIST] = "port exists",
+        [CTL_ERR_BUSY] = "out of resources",
+        [CTL_ERR_SYS] = "system error",
+        [CTL_ERR_PARTIAL] = "partially failed",
+    };
+    return status < CTL_STATUS_MAX ? names[status] : "unknown status";
+}
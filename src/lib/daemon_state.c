@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include <bpf/bpf.h>
+
+#include "args.h"
+#include "daemon_state.h"
+#include "lwlog.h"
+#include "port_registry_kern_user.h"
+#include "steer.h"
+#include "veth_list.h"
+#include "xdp_utils.h"
+#include "xsk_pool.h"
+
+/* Pinned maps a resumed daemon can't do without */
+static const char* resume_maps[] = {"port_registry", "xdp_devmap", "steer_map", "xsk_ports"};
+
+int daemon_state_save(void) {
+    char tmp[PATH_MAX];
+    static char prefixes[DEVMAP_SLOTS][IFNAMSIZ];
+
+    if (mkdir(XSKNET_RUN_DIR, 0755) < 0 && errno != EEXIST) {
+        lwlog_err("mkdir %s: %s", XSKNET_RUN_DIR, strerror(errno));
+        return -1;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", DAEMON_STATE_PATH);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        lwlog_err("Couldn't write %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    const int nr_ports = veth_list_prefixes(&veths, prefixes, DEVMAP_SLOTS);
+    fprintf(f, "xsknet-state %d\n", DAEMON_STATE_VERSION);
+    fprintf(f, "phy %s %u\n", opts.dev, if_nametoindex(opts.dev));
+    fprintf(f, "ports %d\n", nr_ports);
+    for (int i = 0; i < nr_ports; i++)
+        fprintf(f, "port %s %d\n", prefixes[i], veth_list_slot(&veths, prefixes[i]));
+
+    /* Renamed into place, a daemon starting meanwhile sees the old file or the new one */
+    if (fclose(f) != 0 || rename(tmp, DAEMON_STATE_PATH) < 0) {
+        lwlog_err("Couldn't write %s: %s", DAEMON_STATE_PATH, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    lwlog_info("Left %d ports running, state in %s", nr_ports, DAEMON_STATE_PATH);
+    return 0;
+}
+
+bool daemon_state_resumable(void) {
+    char path[PATH_MAX];
+
+    const unsigned int phy_ifindex = if_nametoindex(opts.dev);
+    if (phy_ifindex == 0)
+        return false;
+
+    FILE* f = fopen(DAEMON_STATE_PATH, "r");
+    if (f != NULL) {
+        char phy[IFNAMSIZ] = "";
+        unsigned int ifindex = 0;
+        int version = 0, nr_ports = 0;
+
+        const int n = fscanf(f, "xsknet-state %d phy %15s %u ports %d", &version, phy, &ifindex, &nr_ports);
+        fclose(f);
+        if (n != 4 || version != DAEMON_STATE_VERSION || strcmp(phy, opts.dev) != 0 || ifindex != phy_ifindex) {
+            lwlog_warning("%s describes another setup, starting from scratch", DAEMON_STATE_PATH);
+            daemon_state_clear();
+            return false;
+        }
+        lwlog_info("Previous daemon left %d ports on %s", nr_ports, phy);
+    }
+
+    if (strcmp(xdp_attached_mode(opts.dev), "none") == 0)
+        return false;
+
+    for (size_t i = 0; i < sizeof(resume_maps) / sizeof(resume_maps[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", pin_basedir, opts.dev, resume_maps[i]);
+        if (access(path, F_OK) < 0)
+            return false;
+    }
+
+    if (f == NULL)
+        lwlog_info("No state file, resuming from the maps pinned for %s", opts.dev);
+    return true;
+}
+
+/* The port's interfaces are still the ones it was registered with */
+static bool port_entry_live(const struct port_key* key, const struct port_entry* entry, const unsigned int phy_ifindex) {
+    char name[IF_NAMESIZE];
+    char want[IF_NAMESIZE + 8];
+
+    if (entry->flags & PORT_F_DIRECT)
+        return key->ifindex == phy_ifindex;
+
+    snprintf(want, sizeof(want), "%s_inner", entry->prefix);
+    if (if_indextoname(entry->inner_ifindex, name) == NULL || strcmp(name, want) != 0)
+        return false;
+    snprintf(want, sizeof(want), "%s_outer", entry->prefix);
+    return if_indextoname(entry->outer_ifindex, name) != NULL && strcmp(name, want) == 0;
+}
+
+/*
+ * The pool XSKs closed with the previous daemon and left the port's queues unbound. Binding fails with EBUSY on a queue
+ * whose client still holds its XSK, that client keeps its traffic and only ports without one get the pool's.
+ */
+static bool restore_pool(const char* prefix) {
+    char ifname[IFNAMSIZ];
+    char pin_dir[PATH_MAX];
+
+    /* Direct mode ports bind the PHY queues they own, the others every queue of their inner veth */
+    uint64_t queues = veth_list_queues(&veths, prefix);
+    const bool direct = queues != 0;
+    if (direct) {
+        snprintf(ifname, sizeof(ifname), "%s", opts.dev);
+    } else {
+        const unsigned int veth_queues = veth_list_veth_queues(&veths, prefix);
+        queues = veth_queues >= 64 ? ~0ULL : (1ULL << veth_queues) - 1;
+        snprintf(ifname, sizeof(ifname), "%s_inner", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    }
+
+    snprintf(pin_dir, sizeof(pin_dir), "%s/%s", pin_basedir, ifname);
+    const int map_fd = open_bpf_map_file(pin_dir, direct ? "phy_xsks_map" : "xsks_map", NULL);
+    if (map_fd < 0)
+        return false;
+    const int err = xsk_pool_bind(prefix, ifname, queues, map_fd);
+    close(map_fd);
+    return err == 0;
+}
+
+int daemon_state_restore(void) {
+    static struct port_key keys[PORT_REGISTRY_MAX];
+    static char prefixes[DEVMAP_SLOTS][IFNAMSIZ];
+    __u64 kept[DEVMAP_SLOTS / 64] = {0};
+    struct port_entry entry;
+    int nr_keys = 0, stale = 0;
+
+    const unsigned int phy_ifindex = if_nametoindex(opts.dev);
+    const int fd = open_phy_map("port_registry");
+    if (fd < 0)
+        return -1;
+
+    /* Keys first, deleting stale entries while walking would make get_next_key start over */
+    const struct port_key* prev = NULL;
+    while (nr_keys < PORT_REGISTRY_MAX && bpf_map_get_next_key(fd, prev, &keys[nr_keys]) == 0) {
+        prev = &keys[nr_keys];
+        nr_keys++;
+    }
+
+    for (int i = 0; i < nr_keys; i++) {
+        if (bpf_map_lookup_elem(fd, &keys[i], &entry))
+            continue;
+        entry.prefix[sizeof(entry.prefix) - 1] = '\0';
+
+        if (!port_entry_live(&keys[i], &entry, phy_ifindex)) {
+            lwlog_warning("Dropping %s from port_registry, its interfaces are gone", entry.prefix);
+            bpf_map_delete_elem(fd, &keys[i]);
+            steer_port_flush(entry.slot);
+            clear_devmap(entry.slot);
+            if (steer_get_default() == entry.slot)
+                steer_set_default(STEER_NO_DEFAULT);
+            stale++;
+            continue;
+        }
+        if (veth_list_restore(&veths, &entry, phy_ifindex) < 0)
+            lwlog_err("Couldn't restore port %s", entry.prefix);
+    }
+    close(fd);
+
+    /* Switch ports aren't in port_registry, their rules would go to the next port given the slot */
+    int pooled = 0;
+    const int nr_ports = veth_list_prefixes(&veths, prefixes, DEVMAP_SLOTS);
+    for (int i = 0; i < nr_ports; i++) {
+        const int slot = veth_list_slot(&veths, prefixes[i]);
+        if (slot >= 0)
+            kept[slot / 64] |= 1ULL << (slot % 64);
+        if (restore_pool(prefixes[i]))
+            pooled++;
+    }
+    const int orphaned = steer_flush_except(kept);
+    if (orphaned > 0)
+        lwlog_warning("Dropped %d steering rules of ports that weren't restored", orphaned);
+    const __u32 def = steer_get_default();
+    if (def != STEER_NO_DEFAULT && (def >= DEVMAP_SLOTS || !(kept[def / 64] & (1ULL << (def % 64)))))
+        steer_set_default(STEER_NO_DEFAULT);
+
+    lwlog_info("Restored %d ports from port_registry, %d stale entries dropped, default slot %d, %d with pool XSKs", nr_ports, stale,
+               (int)steer_get_default(), pooled);
+    return nr_ports;
+}
+
+void daemon_state_clear(void) {
+    unlink(DAEMON_STATE_PATH);
+}
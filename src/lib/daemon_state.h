@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "metrics.h"
+
+/*
+ * Hitless restart. A daemon stopped with SIGUSR2 leaves the PHY program, the port interfaces with their programs, the pinned
+ * maps and the clients' XSKs in place and writes DAEMON_STATE_PATH. The next daemon finds them, skips loading the PHY program
+ * and rebuilds its port list from port_registry, so traffic never stops flowing. A daemon that crashed resumes the same way
+ * from the pinned maps alone.
+ */
+#define DAEMON_STATE_PATH XSKNET_RUN_DIR "/daemon.state"
+#define DAEMON_STATE_VERSION 1
+
+/* Records what the next daemon has to match to take over */
+int daemon_state_save(void);
+
+/* True when --dev still runs the program and maps of a previous daemon and its state file, if any, describes the same PHY */
+bool daemon_state_resumable(void);
+
+/* Adds the live ports of port_registry to veths and drops the entries of ports whose interfaces are gone, returns the ports restored */
+int daemon_state_restore(void);
+
+/* Removes the state file once it was acted on */
+void daemon_state_clear(void);
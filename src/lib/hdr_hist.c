@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "hdr_hist.h"
+
+/* Highest value that falls into bucket i, so reported percentiles never understate */
+static uint64_t hdr_hist_bucket_value(const unsigned int i) {
+    if (i < HDR_SUB_BUCKETS)
+        return i;
+
+    const unsigned int shift = i / HDR_SUB_BUCKETS - 1;
+    const uint64_t mantissa = i - shift * HDR_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void hdr_hist_snapshot(const struct hdr_hist* h, struct hdr_hist* out) {
+    out->total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < HDR_BUCKETS; i++)
+        out->counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+}
+
+void hdr_hist_delta(const struct hdr_hist* cur, const struct hdr_hist* prev, struct hdr_hist* out) {
+    out->total = 0;
+    out->sum = cur->sum - prev->sum;
+    for (unsigned int i = 0; i < HDR_BUCKETS; i++) {
+        out->counts[i] = cur->counts[i] - prev->counts[i];
+        out->total += out->counts[i];
+    }
+}
+
+uint64_t hdr_hist_percentile(const struct hdr_hist* h, const double percentile) {
+    if (h->total == 0)
+        return 0;
+
+    uint64_t wanted = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (wanted == 0)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HDR_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= wanted)
+            return hdr_hist_bucket_value(i);
+    }
+    return hdr_hist_max(h);
+}
+
+uint64_t hdr_hist_max(const struct hdr_hist* h) {
+    for (unsigned int i = HDR_BUCKETS; i > 0; i--) {
+        if (h->counts[i - 1])
+            return hdr_hist_bucket_value(i - 1);
+    }
+    return 0;
+}
+
+/* Samples <= value, to bucket precision: the bucket holding value counts as a whole */
+uint64_t hdr_hist_count_le(const struct hdr_hist* h, const uint64_t value) {
+    const unsigned int last = hdr_hist_index(value);
+    uint64_t count = 0;
+
+    for (unsigned int i = 0; i <= last; i++)
+        count += h->counts[i];
+    return count;
+}
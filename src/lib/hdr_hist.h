@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR style) histogram for nanosecond latencies. Values below 2^HDR_SUB_BUCKET_BITS are exact, above that every
+ * power of two is split into HDR_SUB_BUCKETS linear buckets, which keeps the relative error around 3%. Values are clamped to
+ * 2^HDR_MAX_BITS - 1 ns (~18 minutes).
+ *
+ * A histogram has exactly one writer. hdr_hist_record() does plain relaxed stores so the fast path never locks or uses
+ * atomic RMW instructions, readers take a relaxed copy with hdr_hist_snapshot() and work on deltas between two snapshots to
+ * get interval figures without ever resetting the live histogram.
+ */
+#define HDR_SUB_BUCKET_BITS 5
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BUCKET_BITS)
+#define HDR_MAX_BITS 40
+#define HDR_BUCKETS ((HDR_MAX_BITS - HDR_SUB_BUCKET_BITS + 1) * HDR_SUB_BUCKETS)
+
+struct hdr_hist {
+    uint64_t total;
+    uint64_t sum;
+    uint64_t counts[HDR_BUCKETS];
+};
+
+static inline unsigned int hdr_hist_index(uint64_t value) {
+    if (value >= (1ULL << HDR_MAX_BITS))
+        value = (1ULL << HDR_MAX_BITS) - 1;
+
+    if (value < HDR_SUB_BUCKETS)
+        return value;
+
+    const unsigned int shift = 63 - __builtin_clzll(value) - HDR_SUB_BUCKET_BITS;
+    return shift * HDR_SUB_BUCKETS + (value >> shift);
+}
+
+static inline void hdr_hist_record(struct hdr_hist* h, const uint64_t value) {
+    const unsigned int i = hdr_hist_index(value);
+
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+}
+
+void hdr_hist_snapshot(const struct hdr_hist* h, struct hdr_hist* out);
+void hdr_hist_delta(const struct hdr_hist* cur, const struct hdr_hist* prev, struct hdr_hist* out);
+uint64_t hdr_hist_percentile(const struct hdr_hist* h, double percentile);
+uint64_t hdr_hist_max(const struct hdr_hist* h);
+uint64_t hdr_hist_count_le(const struct hdr_hist* h, uint64_t value);
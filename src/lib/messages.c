@@ -18,6 +18,8 @@
 
 #include "lwlog.h"
 #include "messages.h"
+#include "rss_kern_user.h"
+#include "xsk_pool.h"
 
 /*
  * Help message
@@ -57,6 +59,15 @@ void options() {
     fprintf(stdout, GRAY "\t-v|--version\n" NONE "\t\tPrints %s version\n\n", __PROGRAM_NAME__);
     fprintf(stdout, GRAY "\t-h|--help\n" NONE "\t\tPrints this help message\n\n");
     fprintf(stdout, GRAY "\t--no-color\n" NONE "\t\tDoes not use colors for printing\n\n");
+    fprintf(stdout, GRAY "\t-m|--metrics-port\n" NONE "\t\tLoopback port the daemon serves OpenMetrics on\n\n");
+    fprintf(stdout, GRAY "\t-q|--queues\n" NONE "\t\tComma separated PHY RX queues to bind to directly, skipping the veth pair\n\n");
+    fprintf(stdout, GRAY "\t-r|--rss-cpus\n" NONE "\t\tCPUs the daemon spreads PHY traffic over through a cpumap, e.g. 0-3,6\n\n");
+    fprintf(stdout, GRAY "\t-R|--rss-qsize\n" NONE "\t\tFrames queued per software RSS CPU (default %d)\n\n", RSS_DEFAULT_QSIZE);
+    fprintf(stdout, GRAY "\t-x|--xdp-mode\n" NONE "\t\tnative, prefer-native (default) or generic, whether XDP may fall back to the slower generic mode\n\n");
+    fprintf(stdout, GRAY "\t-S|--switch\n" NONE "\t\tDaemon: ports get rings on the daemon's own PHY XSKs instead of veth pairs\n\n");
+    fprintf(stdout, GRAY "\t-g|--ctl-group\n" NONE "\t\tDaemon: group whose members may use the control socket and run clients without root\n\n");
+    fprintf(stdout, GRAY "\t-F|--pool-frames\n" NONE "\t\tDaemon: UMEM frames of each XSK it binds for a port, a power of two (default %d)\n\n", XSK_POOL_FRAMES_DEFAULT);
+    fprintf(stdout, GRAY "\t-s|--steer\n" NONE "\t\tSpace separated steering rules for this port: mac=<dst mac> ip=<dst ip> port=<l4 dst port>\n\n");
 }
 
 /*
@@ -0,0 +1,466 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "args.h"
+#include "lwlog.h"
+#include "metrics.h"
+#include "signal_handler.h"
+#include "stats_shm.h"
+#include "veth_list.h"
+#include "xdp_stats.h"
+#include "xsk_stats.h"
+
+/* Ports fall back to their socket one after the other, SCRAPE_FETCH_BUDGET_MS caps the wait for all of them in a scrape */
+enum { MAX_SCRAPE_PORTS = DEVMAP_SLOTS, HTTP_REQUEST_SIZE = 4096, PORT_FETCH_TIMEOUT_MS = 200, SCRAPE_FETCH_BUDGET_MS = 1000 };
+
+pthread_t metrics_thread = 0;
+
+const char* metrics_lat_stage_names[LAT_STAGE_MAX] = {"burst", "service", "wake", "rx_to_process", "rx_to_tx"};
+
+uint64_t metrics_lat_bound(const unsigned int i) {
+    return i + 1 < METRICS_LAT_BUCKETS ? 1000ULL << i : UINT64_MAX;
+}
+
+void metrics_buf_printf(struct metrics_buf* buf, const char* fmt, ...) {
+    va_list ap;
+
+    for (;;) {
+        const size_t room = buf->cap - buf->len;
+
+        va_start(ap, fmt);
+        const int n = vsnprintf(buf->data + buf->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+
+        if ((size_t)n < room) {
+            buf->len += n;
+            return;
+        }
+
+        size_t cap = buf->cap ? buf->cap * 2 : 16384;
+        while (cap - buf->len <= (size_t)n)
+            cap *= 2;
+
+        char* data = realloc(buf->data, cap);
+        if (data == NULL) {
+            lwlog_err("realloc: %s", strerror(errno));
+            return;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+void metrics_family(struct metrics_buf* buf, const char* name, const char* type, const char* help) {
+    metrics_buf_printf(buf, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static int metrics_port_socket_path(char* path, const size_t size, const char* prefix) {
+    const int len = snprintf(path, size, "%s/%s.metrics", XSKNET_METRICS_DIR, prefix);
+    if (len < 0 || (size_t)len >= size) {
+        lwlog_err("Metrics socket path too long for %s", prefix);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_all(const int fd, const void* data, size_t len) {
+    const char* p = data;
+
+    while (len > 0) {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void set_timeout(const int fd, const int optname, const long msec) {
+    struct timeval tv;
+    tv.tv_sec = msec / 1000;
+    tv.tv_usec = (msec % 1000) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv)) < 0)
+        lwlog_err("setsockopt(SO_RCVTIMEO/SO_SNDTIMEO): %s", strerror(errno));
+}
+
+void metrics_port_unlink(const char* prefix) {
+    struct sockaddr_un addr;
+
+    if (metrics_port_socket_path(addr.sun_path, sizeof(addr.sun_path), prefix) == 0)
+        unlink(addr.sun_path);
+}
+
+/*
+ * Client side: publishes a snapshot into the port's stats slot every STATS_SHM_INTERVAL_MS, this thread is the slot's only
+ * writer. Apart from metrics_port_thread() so publishing goes on whether or not the metrics socket could be bound.
+ */
+void* stats_shm_thread(void* prefix) {
+    static struct port_metrics snap;
+
+    while (!global_exit_flag) {
+        usleep(STATS_SHM_INTERVAL_MS * 1000);
+        xsk_stats_collect(&snap);
+        snprintf(snap.prefix, sizeof(snap.prefix), "%s", (const char*)prefix);
+        stats_shm_publish(&snap);
+    }
+    return NULL;
+}
+
+/*
+ * Client side of the exporter. Every connection gets one struct port_metrics and is closed, the snapshot is built on this
+ * thread from what the workers already published, so a scrape never reaches into the RX loop. The daemon creates the
+ * directory, a client outside --ctl-group goes without the socket and the daemon reads its stats slot alone.
+ */
+void* metrics_port_thread(void* prefix) {
+    static struct port_metrics snap;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (metrics_port_socket_path(addr.sun_path, sizeof(addr.sun_path), prefix))
+        return NULL;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        lwlog_err("socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        lwlog_warning("No metrics socket at %s, the daemon reads the stats slot only: %s", addr.sun_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    set_timeout(fd, SO_RCVTIMEO, STATS_SHM_INTERVAL_MS);
+    lwlog_info("Serving port metrics on %s", addr.sun_path);
+
+    while (!global_exit_flag) {
+        /* Times out after STATS_SHM_INTERVAL_MS to check for exit */
+        const int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                lwlog_err("accept: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        xsk_stats_collect(&snap);
+        snprintf(snap.prefix, sizeof(snap.prefix), "%s", (const char*)prefix);
+        set_timeout(conn, SO_SNDTIMEO, PORT_FETCH_TIMEOUT_MS);
+        if (write_all(conn, &snap, sizeof(snap)) < 0)
+            lwlog_warning("Sending port metrics: %s", strerror(errno));
+        close(conn);
+    }
+
+    close(fd);
+    unlink(addr.sun_path);
+    return NULL;
+}
+
+/* Pulls one snapshot from a client within timeout_ms, ports without a running client or with another layout version are skipped */
+static int metrics_fetch_port(const char* prefix, struct port_metrics* out, const long timeout_ms) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (metrics_port_socket_path(addr.sun_path, sizeof(addr.sun_path), prefix))
+        return -1;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    set_timeout(fd, SO_RCVTIMEO, timeout_ms);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t got = 0;
+    while (got < sizeof(*out)) {
+        const ssize_t n = read(fd, (char*)out + got, sizeof(*out) - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+
+    if (got != sizeof(*out) || out->version != PORT_METRICS_VERSION) {
+        lwlog_warning("Ignoring metrics from port %s (%zu bytes, version %u)", prefix, got, got >= sizeof(out->version) ? out->version : 0);
+        return -1;
+    }
+    if (out->nr_queues > METRICS_MAX_QUEUES)
+        out->nr_queues = METRICS_MAX_QUEUES;
+    return 0;
+}
+
+static const struct {
+    const char* name;
+    const char* help;
+    size_t offset;
+} queue_counters[] = {
+    {"xsknet_rx_packets", "Packets received on the AF_XDP socket", offsetof(struct queue_metrics, rx_packets)},
+    {"xsknet_rx_bytes", "Bytes received on the AF_XDP socket", offsetof(struct queue_metrics, rx_bytes)},
+    {"xsknet_tx_packets", "Packets transmitted by the port", offsetof(struct queue_metrics, tx_packets)},
+    {"xsknet_tx_bytes", "Bytes transmitted by the port", offsetof(struct queue_metrics, tx_bytes)},
+    {"xsknet_fill_reserve_failures", "Short fill ring reservations", offsetof(struct queue_metrics, fq_reserve_fail)},
+    {"xsknet_tx_reserve_failures", "Short TX ring reservations", offsetof(struct queue_metrics, tx_reserve_fail)},
+    {"xsknet_tx_send_failures", "Frames the egress socket refused", offsetof(struct queue_metrics, tx_send_fail)},
+    {"xsknet_xsk_rx_dropped", "XDP_STATISTICS rx_dropped", offsetof(struct queue_metrics, kernel.rx_dropped)},
+    {"xsknet_xsk_rx_invalid_descs", "XDP_STATISTICS rx_invalid_descs", offsetof(struct queue_metrics, kernel.rx_invalid_descs)},
+    {"xsknet_xsk_tx_invalid_descs", "XDP_STATISTICS tx_invalid_descs", offsetof(struct queue_metrics, kernel.tx_invalid_descs)},
+    {"xsknet_xsk_rx_ring_full", "XDP_STATISTICS rx_ring_full", offsetof(struct queue_metrics, kernel.rx_ring_full)},
+    {"xsknet_xsk_rx_fill_ring_empty_descs", "XDP_STATISTICS rx_fill_ring_empty_descs", offsetof(struct queue_metrics, kernel.rx_fill_ring_empty_descs)},
+    {"xsknet_xsk_tx_ring_empty_descs", "XDP_STATISTICS tx_ring_empty_descs", offsetof(struct queue_metrics, kernel.tx_ring_empty_descs)},
+};
+
+static const struct {
+    const char* ring;
+    size_t offset;
+} queue_rings[] = {
+    {"rx", offsetof(struct queue_metrics, rx_occupancy)},
+    {"fill", offsetof(struct queue_metrics, fill_occupancy)},
+    {"tx", offsetof(struct queue_metrics, tx_occupancy)},
+    {"comp", offsetof(struct queue_metrics, comp_occupancy)},
+};
+
+#define QUEUE_FIELD(q, type, offset) (*(const type*)((const char*)(q) + (offset)))
+
+static void metrics_render_counters(struct metrics_buf* buf, const struct port_metrics* ports, const int n) {
+    char family[128];
+
+    for (size_t c = 0; c < sizeof(queue_counters) / sizeof(queue_counters[0]); c++) {
+        uint64_t all = 0;
+
+        metrics_family(buf, queue_counters[c].name, "counter", queue_counters[c].help);
+        for (int p = 0; p < n; p++) {
+            for (uint32_t q = 0; q < ports[p].nr_queues; q++) {
+                const uint64_t value = QUEUE_FIELD(&ports[p].queues[q], uint64_t, queue_counters[c].offset);
+                metrics_buf_printf(buf, "%s_total{port=\"%s\",queue=\"%u\"} %llu\n", queue_counters[c].name, ports[p].prefix,
+                                   ports[p].queues[q].queue_id, (unsigned long long)value);
+                all += value;
+            }
+        }
+
+        /* The daemon's own roll-up over every port, a separate family so sums over the per-port one stay correct */
+        snprintf(family, sizeof(family), "xsknet_daemon_%s", queue_counters[c].name + strlen("xsknet_"));
+        metrics_family(buf, family, "counter", queue_counters[c].help);
+        metrics_buf_printf(buf, "%s_total %llu\n", family, (unsigned long long)all);
+    }
+
+    metrics_family(buf, "xsknet_ring_occupancy", "gauge", "Sampled number of entries sitting in an XSK ring");
+    for (int p = 0; p < n; p++) {
+        for (uint32_t q = 0; q < ports[p].nr_queues; q++) {
+            for (size_t r = 0; r < sizeof(queue_rings) / sizeof(queue_rings[0]); r++) {
+                metrics_buf_printf(buf, "xsknet_ring_occupancy{port=\"%s\",queue=\"%u\",ring=\"%s\"} %u\n", ports[p].prefix,
+                                   ports[p].queues[q].queue_id, queue_rings[r].ring,
+                                   QUEUE_FIELD(&ports[p].queues[q], uint32_t, queue_rings[r].offset));
+            }
+        }
+    }
+}
+
+static void metrics_render_lat(struct metrics_buf* buf, const char* name, const char* labels, const struct metrics_lat* lat) {
+    for (unsigned int i = 0; i < METRICS_LAT_BUCKETS; i++) {
+        if (i + 1 < METRICS_LAT_BUCKETS)
+            metrics_buf_printf(buf, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, metrics_lat_bound(i) / 1e9, (unsigned long long)lat->le[i]);
+        else
+            metrics_buf_printf(buf, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)lat->le[i]);
+    }
+    metrics_buf_printf(buf, "%s_count{%s} %llu\n", name, labels, (unsigned long long)lat->count);
+    metrics_buf_printf(buf, "%s_sum{%s} %.9f\n", name, labels, lat->sum_ns / 1e9);
+}
+
+static void metrics_render_latency(struct metrics_buf* buf, const struct port_metrics* ports, const int n) {
+    struct metrics_lat all[LAT_STAGE_MAX];
+    char labels[128];
+
+    memset(all, 0, sizeof(all));
+
+    metrics_family(buf, "xsknet_latency_seconds", "histogram", "RX path latency per stage");
+    for (int p = 0; p < n; p++) {
+        for (int s = 0; s < LAT_STAGE_MAX; s++) {
+            const struct metrics_lat* lat = &ports[p].lat[s];
+
+            snprintf(labels, sizeof(labels), "port=\"%s\",stage=\"%s\"", ports[p].prefix, metrics_lat_stage_names[s]);
+            metrics_render_lat(buf, "xsknet_latency_seconds", labels, lat);
+
+            all[s].count += lat->count;
+            all[s].sum_ns += lat->sum_ns;
+            for (unsigned int i = 0; i < METRICS_LAT_BUCKETS; i++)
+                all[s].le[i] += lat->le[i];
+        }
+    }
+
+    metrics_family(buf, "xsknet_daemon_latency_seconds", "histogram", "RX path latency per stage over all ports");
+    for (int s = 0; s < LAT_STAGE_MAX; s++) {
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", metrics_lat_stage_names[s]);
+        metrics_render_lat(buf, "xsknet_daemon_latency_seconds", labels, &all[s]);
+    }
+}
+
+/* Daemon phases from its own table, client phases from each port's snapshot, only the phases that ran */
+static void metrics_render_phases(struct metrics_buf* buf, const struct port_metrics* ports, const int n) {
+    struct phase_stat daemon[PHASE_MAX];
+
+    phase_snapshot(daemon);
+
+    metrics_family(buf, "xsknet_phase_seconds", "summary", "Time spent in each startup and provisioning phase");
+    for (int i = 0; i < PHASE_MAX; i++) {
+        if (daemon[i].count == 0)
+            continue;
+        metrics_buf_printf(buf, "xsknet_phase_seconds_count{binary=\"daemon\",phase=\"%s\"} %llu\n", phase_names[i], (unsigned long long)daemon[i].count);
+        metrics_buf_printf(buf, "xsknet_phase_seconds_sum{binary=\"daemon\",phase=\"%s\"} %.9f\n", phase_names[i], daemon[i].sum_ns / 1e9);
+    }
+    for (int p = 0; p < n; p++) {
+        for (int i = 0; i < PHASE_MAX; i++) {
+            const struct phase_stat* ph = &ports[p].phases[i];
+            if (ph->count == 0)
+                continue;
+            metrics_buf_printf(buf, "xsknet_phase_seconds_count{port=\"%s\",phase=\"%s\"} %llu\n", ports[p].prefix, phase_names[i], (unsigned long long)ph->count);
+            metrics_buf_printf(buf, "xsknet_phase_seconds_sum{port=\"%s\",phase=\"%s\"} %.9f\n", ports[p].prefix, phase_names[i], ph->sum_ns / 1e9);
+        }
+    }
+
+    metrics_family(buf, "xsknet_phase_last_seconds", "gauge", "Duration of the last run of each phase");
+    for (int i = 0; i < PHASE_MAX; i++) {
+        if (daemon[i].count != 0)
+            metrics_buf_printf(buf, "xsknet_phase_last_seconds{binary=\"daemon\",phase=\"%s\"} %.9f\n", phase_names[i], daemon[i].last_ns / 1e9);
+    }
+    for (int p = 0; p < n; p++) {
+        for (int i = 0; i < PHASE_MAX; i++) {
+            if (ports[p].phases[i].count != 0)
+                metrics_buf_printf(buf, "xsknet_phase_last_seconds{port=\"%s\",phase=\"%s\"} %.9f\n", ports[p].prefix, phase_names[i], ports[p].phases[i].last_ns / 1e9);
+        }
+    }
+}
+
+static void metrics_render(struct metrics_buf* buf) {
+    static char prefixes[MAX_SCRAPE_PORTS][IFNAMSIZ];
+    static struct port_metrics ports[MAX_SCRAPE_PORTS];
+    int n = 0, skipped = 0;
+
+    const uint64_t deadline = phase_now() + SCRAPE_FETCH_BUDGET_MS * 1000000ULL;
+    const int nr_prefixes = veth_list_prefixes(&veths, prefixes, MAX_SCRAPE_PORTS);
+    for (int i = 0; i < nr_prefixes; i++) {
+        /* Straight from the shared region, asking the client itself only when it publishes nothing there */
+        const int slot = veth_list_slot(&veths, prefixes[i]);
+        if (stats_shm_read(slot, &ports[n]) == 0 && strcmp(ports[n].prefix, prefixes[i]) == 0) {
+            n++;
+            continue;
+        }
+
+        /* A few stuck clients mustn't hold the scrape past the scraper's own timeout */
+        const uint64_t now = phase_now();
+        const long left_ms = now < deadline ? (long)((deadline - now) / 1000000) : 0;
+        if (left_ms <= 0)
+            skipped++;
+        else if (metrics_fetch_port(prefixes[i], &ports[n], left_ms < PORT_FETCH_TIMEOUT_MS ? left_ms : PORT_FETCH_TIMEOUT_MS) == 0)
+            n++;
+    }
+    if (skipped > 0)
+        lwlog_warning("Scrape out of time, %d ports without a stats slot left out", skipped);
+
+    metrics_family(buf, "xsknet_ports", "gauge", "Ports known to the daemon");
+    metrics_buf_printf(buf, "xsknet_ports %d\n", nr_prefixes);
+    metrics_family(buf, "xsknet_ports_reporting", "gauge", "Ports whose client answered the last scrape");
+    metrics_buf_printf(buf, "xsknet_ports_reporting %d\n", n);
+
+    metrics_render_counters(buf, ports, n);
+    metrics_render_latency(buf, ports, n);
+    metrics_render_phases(buf, ports, n);
+    xdp_stats_render_metrics(buf);
+
+    metrics_buf_printf(buf, "# EOF\n");
+}
+
+static void metrics_handle_scrape(const int fd) {
+    char request[HTTP_REQUEST_SIZE];
+    struct metrics_buf body = {0};
+    char header[256];
+    size_t got = 0;
+
+    /* Whatever the request is, it gets the exposition, we only wait for the end of the headers */
+    set_timeout(fd, SO_RCVTIMEO, 1000);
+    while (got < sizeof(request) - 1) {
+        const ssize_t n = read(fd, request + got, sizeof(request) - 1 - got);
+        if (n <= 0)
+            break;
+        got += n;
+        request[got] = '\0';
+        if (strstr(request, "\r\n\r\n"))
+            break;
+    }
+
+    metrics_render(&body);
+
+    const int len = snprintf(header, sizeof(header),
+                             "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Connection: close\r\n\r\n",
+                             body.len);
+
+    set_timeout(fd, SO_SNDTIMEO, 1000);
+    if (write_all(fd, header, len) < 0 || write_all(fd, body.data, body.len) < 0)
+        lwlog_warning("Sending metrics: %s", strerror(errno));
+
+    free(body.data);
+    close(fd);
+}
+
+/*
+ * Daemon side of the exporter, a plain HTTP endpoint on loopback that Prometheus can scrape. Scrapes are served on this
+ * thread only, clients answer them from their own metrics thread.
+ */
+void* metrics_server_thread(void* exit_flag) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(opts.metrics_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        lwlog_err("socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
+        lwlog_err("setsockopt(SO_REUSEADDR) failed");
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        lwlog_err("Binding metrics endpoint 127.0.0.1:%d: %s", opts.metrics_port, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    set_timeout(fd, SO_RCVTIMEO, 1000);
+    lwlog_info("Serving OpenMetrics on http://127.0.0.1:%d/metrics", opts.metrics_port);
+
+    while (*(int*)exit_flag == 0) {
+        const int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+                continue;
+            lwlog_err("accept: %s", strerror(errno));
+            break;
+        }
+        metrics_handle_scrape(conn);
+    }
+
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+
+#include "phase_prof.h"
+
+#define XSKNET_RUN_DIR "/run/xsknet"
+/* Clients' metrics sockets, writable by the --ctl-group group so clients don't need root */
+#define XSKNET_METRICS_DIR XSKNET_RUN_DIR "/metrics"
+#define METRICS_DEFAULT_PORT 9469
+#define METRICS_MAX_QUEUES 16
+
+/* Bumped whenever struct port_metrics changes, the daemon ignores snapshots it does not understand */
+#define PORT_METRICS_VERSION 3
+
+/* Latency histogram buckets exported to Prometheus: 1us, 2us, 4us ... ~1s, the last one is +Inf */
+#define METRICS_LAT_BUCKETS 22
+
+enum metrics_lat_stage {
+    LAT_STAGE_BURST,
+    LAT_STAGE_SERVICE,
+    LAT_STAGE_WAKE,
+    LAT_STAGE_RX_TO_PROCESS,
+    LAT_STAGE_RX_TO_TX,
+    LAT_STAGE_MAX,
+};
+
+struct metrics_lat {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t le[METRICS_LAT_BUCKETS]; /* cumulative, le[i] counts samples <= metrics_lat_bound(i) */
+};
+
+struct queue_metrics {
+    uint32_t queue_id;
+    uint32_t rx_occupancy;
+    uint32_t fill_occupancy;
+    uint32_t tx_occupancy;
+    uint32_t comp_occupancy;
+    uint32_t pad;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t fq_reserve_fail;
+    uint64_t tx_reserve_fail;
+    uint64_t tx_send_fail;
+    struct xdp_statistics kernel;
+};
+
+/* What a client hands the daemon over its metrics socket, one per port */
+struct port_metrics {
+    uint32_t version;
+    uint32_t nr_queues;
+    char prefix[IFNAMSIZ];
+    struct queue_metrics queues[METRICS_MAX_QUEUES];
+    struct metrics_lat lat[LAT_STAGE_MAX];
+    struct phase_stat phases[PHASE_MAX]; /* Client phases, see phase_prof.h */
+};
+
+/* Growable text buffer the OpenMetrics exposition is rendered into */
+struct metrics_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+extern pthread_t metrics_thread;
+extern const char* metrics_lat_stage_names[LAT_STAGE_MAX];
+
+uint64_t metrics_lat_bound(unsigned int i);
+void metrics_buf_printf(struct metrics_buf* buf, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void metrics_family(struct metrics_buf* buf, const char* name, const char* type, const char* help);
+
+/* Client side: serves struct port_metrics snapshots on XSKNET_METRICS_DIR/<prefix>.metrics */
+void* metrics_port_thread(void* prefix);
+/* Client side: publishes into the port's stats slot, a no-op loop when the daemon handed none over */
+void* stats_shm_thread(void* prefix);
+void metrics_port_unlink(const char* prefix);
+
+/* Daemon side: OpenMetrics over HTTP on 127.0.0.1:opts.metrics_port */
+void* metrics_server_thread(void* exit_flag);
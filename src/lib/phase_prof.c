@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <net/if.h>
+
+#include "lwlog.h"
+#include "phase_prof.h"
+
+enum { PHASE_LINE_SIZE = 1024 };
+
+const char* phase_names[PHASE_MAX] = {
+    [PHASE_XDP_LOAD] = "xdp_load",
+    [PHASE_PIN_MAPS] = "pin_maps",
+    [PHASE_PORT_PROG_INIT] = "port_prog_init",
+    [PHASE_XSK_POOL_INIT] = "xsk_pool_init",
+    [PHASE_VETH_CREATE] = "veth_create",
+    [PHASE_PROG_ATTACH] = "prog_attach",
+    [PHASE_XSK_BIND] = "xsk_bind",
+    [PHASE_DEVMAP] = "devmap",
+    [PHASE_RESTORE] = "restore",
+    [PHASE_ATTACH] = "attach",
+    [PHASE_XSK_SETUP] = "xsk_setup",
+    [PHASE_FIRST_PACKET] = "first_packet",
+};
+
+static struct phase_stat phase_table[PHASE_MAX];
+static uint64_t phase_epoch;
+static char phase_name[IFNAMSIZ] = "";
+static bool phase_seen_packet;
+
+uint64_t phase_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void phase_init(const char* name) {
+    phase_epoch = phase_now();
+    snprintf(phase_name, sizeof(phase_name), "%s", name);
+}
+
+void phase_record(const enum phase_id id, const uint64_t ns) {
+    struct phase_stat* stat = &phase_table[id];
+
+    __atomic_fetch_add(&stat->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&stat->last_ns, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stat->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Appends "<phase>_ms=.." for every nonzero entry of ns, then total_ms */
+static void phase_log_line(const uint64_t* ns, const char* what, const char* name, const uint64_t total) {
+    char line[PHASE_LINE_SIZE];
+    int len = snprintf(line, sizeof(line), "phases op=%s name=%s", what, name);
+
+    for (int i = 0; i < PHASE_MAX && len > 0 && (size_t)len < sizeof(line); i++) {
+        if (ns[i] != 0)
+            len += snprintf(line + len, sizeof(line) - len, " %s_ms=%.3f", phase_names[i], ns[i] / 1e6);
+    }
+    if (len > 0 && (size_t)len < sizeof(line))
+        snprintf(line + len, sizeof(line) - len, " total_ms=%.3f", total / 1e6);
+
+    lwlog_info("%s", line);
+}
+
+void phase_log_summary(void) {
+    uint64_t ns[PHASE_MAX];
+
+    for (int i = 0; i < PHASE_MAX; i++)
+        ns[i] = __atomic_load_n(&phase_table[i].last_ns, __ATOMIC_RELAXED);
+    phase_log_line(ns, "startup", phase_name, phase_now() - phase_epoch);
+}
+
+void phase_clock_start(struct phase_clock* clock) {
+    memset(clock, 0, sizeof(*clock));
+    clock->start = clock->last = phase_now();
+}
+
+void phase_clock_skip(struct phase_clock* clock) {
+    clock->last = phase_now();
+}
+
+void phase_clock_mark(struct phase_clock* clock, const enum phase_id id) {
+    const uint64_t now = phase_now();
+
+    clock->ns[id] += now - clock->last;
+    phase_record(id, now - clock->last);
+    clock->last = now;
+}
+
+void phase_clock_log(const struct phase_clock* clock, const char* what, const char* name) {
+    phase_log_line(clock->ns, what, name, clock->last - clock->start);
+}
+
+void phase_first_packet(void) {
+    if (__atomic_exchange_n(&phase_seen_packet, true, __ATOMIC_RELAXED))
+        return;
+
+    phase_record(PHASE_FIRST_PACKET, phase_now() - phase_epoch);
+    phase_log_summary();
+}
+
+void phase_snapshot(struct phase_stat* out) {
+    for (int i = 0; i < PHASE_MAX; i++) {
+        out[i].count = __atomic_load_n(&phase_table[i].count, __ATOMIC_RELAXED);
+        out[i].sum_ns = __atomic_load_n(&phase_table[i].sum_ns, __ATOMIC_RELAXED);
+        out[i].last_ns = __atomic_load_n(&phase_table[i].last_ns, __ATOMIC_RELAXED);
+        out[i].max_ns = __atomic_load_n(&phase_table[i].max_ns, __ATOMIC_RELAXED);
+    }
+}
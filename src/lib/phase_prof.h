@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Wall time of the startup and provisioning steps, so a slow attach can be pinned on one of them. Every step recorded lands
+ * in a process wide table exported as metrics and summed up in one log line once the process is up; struct phase_clock
+ * additionally collects the steps of one operation, like creating a port, for a line of its own.
+ */
+enum phase_id {
+    /* Daemon */
+    PHASE_XDP_LOAD,       /* Opening and attaching an XDP object, load_xdp_and_attach_to_ifname() and reloads */
+    PHASE_PIN_MAPS,       /* pin_maps_in_bpf_object() */
+    PHASE_PORT_PROG_INIT, /* Loading and verifying the port programs */
+    PHASE_XSK_POOL_INIT,
+    PHASE_VETH_CREATE, /* rtnetlink veth pair */
+    PHASE_PROG_ATTACH, /* port_prog_attach() */
+    PHASE_XSK_BIND,    /* Daemon side XSKs of a port */
+    PHASE_DEVMAP,      /* update_devmap() */
+    PHASE_RESTORE,     /* Taking over the ports of a previous daemon */
+    /* Client */
+    PHASE_ATTACH,       /* attach round trip to the daemon */
+    PHASE_XSK_SETUP,    /* Adopting or binding the XSKs */
+    PHASE_FIRST_PACKET, /* Process start to the first frame received */
+    PHASE_MAX,
+};
+
+/* Process wide totals of one phase, updated atomically since ports are provisioned on several workers */
+struct phase_stat {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t last_ns;
+    uint64_t max_ns;
+};
+
+/* Steps of one operation, each mark charges the time since the previous mark or skip */
+struct phase_clock {
+    uint64_t start;
+    uint64_t last;
+    uint64_t ns[PHASE_MAX];
+};
+
+extern const char* phase_names[PHASE_MAX];
+
+uint64_t phase_now(void);
+
+/* Start of the process, name labels its summary line */
+void phase_init(const char* name);
+
+void phase_record(enum phase_id id, uint64_t ns);
+
+/* "phases op=startup name=<name> <phase>_ms=.. total_ms=.." with the last run of every phase seen so far */
+void phase_log_summary(void);
+
+void phase_clock_start(struct phase_clock* clock);
+/* Restarts the running step without charging it, for work between phases */
+void phase_clock_skip(struct phase_clock* clock);
+void phase_clock_mark(struct phase_clock* clock, enum phase_id id);
+/* "phases op=<what> name=<name> <phase>_ms=.. total_ms=.." for the marked phases */
+void phase_clock_log(const struct phase_clock* clock, const char* what, const char* name);
+
+/* Called by every RX loop on its first frame, the first call in the process records PHASE_FIRST_PACKET and logs the summary */
+void phase_first_packet(void);
+
+/* Copy of the process wide table */
+void phase_snapshot(struct phase_stat* out);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <linux/types.h>
+
+/* "XSKM", marks a metadata area written by one of our XDP programs */
+#define PKT_META_MAGIC 0x58534b4d
+
+/* pkt_meta.port of frames the PHY program handed straight to a direct mode XSK */
+#define PKT_META_DIRECT 0xffffffff
+
+/*
+ * Per-packet metadata placed in front of the frame with bpf_xdp_adjust_meta(). It travels with the frame through the
+ * PHY -> veth redirect and is copied into the UMEM headroom right before the descriptor address, so user space finds it at
+ * xsk_umem__get_data(buffer, addr) - sizeof(struct pkt_meta). Size must stay a multiple of 4 and at most 32 bytes.
+ */
+struct pkt_meta {
+    __u64 rx_timestamp; /* bpf_ktime_get_ns() at the first XDP hook, same clock as CLOCK_MONOTONIC */
+    __u32 port; /* devmap slot the PHY program steered the frame to, or PKT_META_DIRECT */
+    __u32 magic;
+};
@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+
+#include "lwlog.h"
+#include "port_l2.h"
+#include "port_registry_kern_user.h"
+#include "xdp_utils.h"
+
+static int parse_mac(const char* spec, __u8* mac) {
+    unsigned int bytes[6];
+    char extra;
+
+    if (sscanf(spec, "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5], &extra) != 6)
+        return -1;
+    for (int i = 0; i < 6; i++) {
+        if (bytes[i] > 0xff)
+            return -1;
+        mac[i] = bytes[i];
+    }
+    return 0;
+}
+
+int port_l2_parse(const char* arg, struct port_l2* l2) {
+    if (strncmp(arg, "smac=", 5) == 0) {
+        if (parse_mac(arg + 5, l2->src_mac))
+            return -1;
+        l2->flags |= PORT_L2_SRC_MAC;
+        return 1;
+    }
+
+    if (strncmp(arg, "dmac=", 5) == 0) {
+        if (parse_mac(arg + 5, l2->dst_mac))
+            return -1;
+        l2->flags |= PORT_L2_DST_MAC;
+        return 1;
+    }
+
+    if (strncmp(arg, "vlan=", 5) == 0) {
+        char* end;
+        const unsigned long vid = strtoul(arg + 5, &end, 10);
+        if (*end != '\0' || vid == 0 || vid >= 4095)
+            return -1;
+        l2->vlan_tci = htons(vid);
+        l2->flags |= PORT_L2_VLAN;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Rewrites the l2 part of the registry entry ifindex redirects to, the rest of the entry belongs to veth_list */
+static int port_l2_store(const __u32 ifindex, const struct port_l2* l2) {
+    const struct port_key key = {.ifindex = ifindex, .queue = PORT_KEY_ANY_QUEUE};
+    struct port_entry entry;
+
+    const int fd = open_phy_map("port_registry");
+    if (fd < 0)
+        return -1;
+
+    int err = bpf_map_lookup_elem(fd, &key, &entry);
+    if (err) {
+        /* Nothing to rewrite for a port that is gone */
+        err = l2->flags != 0 ? -1 : 0;
+        if (err)
+            lwlog_err("ifindex %u is not a registered port", ifindex);
+    } else {
+        entry.l2 = *l2;
+        err = bpf_map_update_elem(fd, &key, &entry, BPF_EXIST);
+        if (err)
+            lwlog_err("Couldn't set the L2 rewrite of ifindex %u: %s", ifindex, strerror(errno));
+    }
+
+    close(fd);
+    return err ? -1 : 0;
+}
+
+int port_l2_set(const __u32 ifindex, const struct port_l2* l2) {
+    return port_l2_store(ifindex, l2);
+}
+
+int port_l2_clear(const __u32 ifindex) {
+    const struct port_l2 none = {0};
+
+    return port_l2_store(ifindex, &none);
+}
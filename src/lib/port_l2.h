@@ -0,0 +1,16 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "port_l2_kern_user.h"
+
+/*
+ * Folds one "smac=aa:bb:cc:dd:ee:ff", "dmac=.." or "vlan=<id>" option into l2. Returns 1 when arg was one of them, 0 when it
+ * is something else and -1 when it is malformed.
+ */
+int port_l2_parse(const char* arg, struct port_l2* l2);
+
+/* Makes xdp_port_egress rewrite frames redirected to ifindex, an l2 without flags turns rewriting off */
+int port_l2_set(__u32 ifindex, const struct port_l2* l2);
+
+int port_l2_clear(__u32 ifindex);
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <linux/types.h>
+
+/* port_l2.flags, which rewrites xdp_port_egress applies */
+#define PORT_L2_SRC_MAC (1 << 0)
+#define PORT_L2_DST_MAC (1 << 1)
+#define PORT_L2_VLAN (1 << 2) /* Pushes an 802.1Q tag carrying vlan_tci */
+
+/* L2 rewrite of a port, part of its port_registry entry */
+struct port_l2 {
+    __u8 flags;
+    __u8 pad;
+    __u16 vlan_tci; /* Network byte order */
+    __u8 src_mac[6];
+    __u8 dst_mac[6];
+};
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "args.h"
+#include "lwlog.h"
+#include "port_prog.h"
+#include "steer_kern_user.h"
+#include "xdp_stats.h"
+#include "xdp_utils.h"
+
+struct port_prog {
+    const char* obj_name;
+    const char* progname;
+    struct bpf_object* obj;
+    int fd;
+};
+
+enum { PROG_INNER, PROG_OUTER, PROG_EGRESS, PROG_COUNT };
+
+static struct port_prog progs[PROG_COUNT] = {
+    [PROG_INNER] = {"inner_xdp", "xdp_sock_prog", NULL, -1},
+    [PROG_OUTER] = {"outer_xdp", "xdp_redirect_dummy_prog", NULL, -1},
+    [PROG_EGRESS] = {"phy_xdp", "xdp_port_egress", NULL, -1},
+};
+
+/* xsk_ports comes from the inner object, the PHY doesn't have it */
+static int pin_xsk_ports(struct bpf_object* obj) {
+    char path[PATH_MAX];
+
+    struct bpf_map* map = bpf_object__find_map_by_name(obj, "xsk_ports");
+    if (map == NULL) {
+        lwlog_err("inner_xdp has no xsk_ports");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/xsk_ports", pin_basedir, opts.dev);
+    /* Same map when it was reused, a stale one from an older daemon otherwise */
+    if (unlink(path) && errno != ENOENT) {
+        lwlog_err("Couldn't unpin %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (bpf_obj_pin(bpf_map__fd(map), path)) {
+        lwlog_err("Couldn't pin %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int port_prog_init(void) {
+    struct port_prog loaded[PROG_COUNT];
+
+    for (int i = 0; i < PROG_COUNT; i++) {
+        loaded[i] = progs[i];
+        loaded[i].fd = load_shared_prog(progs[i].obj_name, progs[i].progname, &loaded[i].obj);
+        if (loaded[i].fd < 0 || (i == PROG_INNER && pin_xsk_ports(loaded[i].obj))) {
+            for (int j = 0; j <= i; j++) {
+                if (loaded[j].fd >= 0)
+                    bpf_object__close(loaded[j].obj);
+            }
+            return -1;
+        }
+    }
+
+    /* Interfaces and devmap entries hold their own references on the programs they run */
+    for (int i = 0; i < PROG_COUNT; i++) {
+        if (progs[i].obj != NULL)
+            bpf_object__close(progs[i].obj);
+        progs[i] = loaded[i];
+    }
+
+    lwlog_info("Port programs loaded");
+    return 0;
+}
+
+/* Creates and pins the port's xsks_map where the client looks for it, then hands it to xsk_ports */
+static int port_xsks_map_add(const char* inner, const __u32 ifindex, const int ports_fd) {
+    char path[PATH_MAX];
+    __u32 inner_id;
+
+    /* Already there when the programs are only swapped */
+    if (bpf_map_lookup_elem(ports_fd, &ifindex, &inner_id) == 0)
+        return 0;
+
+    const int fd = bpf_map_create(BPF_MAP_TYPE_XSKMAP, "xsks_map", sizeof(__u32), sizeof(__u32), PORT_XSK_QUEUES, NULL);
+    if (fd < 0) {
+        lwlog_err("Couldn't create the xsks_map of %s: %s", inner, strerror(errno));
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", pin_basedir, inner);
+    if (mkdir(path, 0700) && errno != EEXIST) {
+        lwlog_err("Couldn't create %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/xsks_map", pin_basedir, inner);
+    unlink(path);
+    int err = bpf_obj_pin(fd, path);
+    if (err)
+        lwlog_err("Couldn't pin %s: %s", path, strerror(errno));
+    else if ((err = bpf_map_update_elem(ports_fd, &ifindex, &fd, BPF_ANY)))
+        lwlog_err("Couldn't add %s to xsk_ports: %s", inner, strerror(errno));
+
+    close(fd);
+    return err ? -1 : 0;
+}
+
+static void port_xsks_map_del(const char* inner, const __u32 ifindex) {
+    char path[PATH_MAX];
+
+    const int ports_fd = open_phy_map("xsk_ports");
+    if (ports_fd >= 0) {
+        bpf_map_delete_elem(ports_fd, &ifindex);
+        close(ports_fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/xsks_map", pin_basedir, inner);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", pin_basedir, inner);
+    rmdir(path);
+}
+
+int port_prog_attach(const char* inner, const char* outer) {
+    const __u32 ifindex = if_nametoindex(inner);
+    if (ifindex == 0 || progs[PROG_INNER].fd < 0) {
+        lwlog_err("Can't attach port programs to %s", inner);
+        return -1;
+    }
+
+    const int ports_fd = open_phy_map("xsk_ports");
+    if (ports_fd < 0)
+        return -1;
+
+    int err = port_xsks_map_add(inner, ifindex, ports_fd);
+    close(ports_fd);
+    if (err)
+        return -1;
+
+    err = attach_xdp_fd(progs[PROG_OUTER].fd, outer);
+    if (!err)
+        err = attach_xdp_fd(progs[PROG_INNER].fd, inner);
+    return err ? -1 : 0;
+}
+
+void port_prog_detach(const char* inner, const char* outer) {
+    xdp_stats_forget(outer);
+    xdp_stats_forget(inner);
+    detach_xdp_fd(outer);
+    detach_xdp_fd(inner);
+    port_xsks_map_del(inner, if_nametoindex(inner));
+}
+
+int port_prog_egress_fd(void) {
+    return progs[PROG_EGRESS].fd;
+}
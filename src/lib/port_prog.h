@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * The daemon loads the port programs once and attaches the same verified fds to every veth pair. The maps are shared with the
+ * PHY program: xdp_stats_map is keyed by ifindex, and each port's xsks_map hangs off xsk_ports keyed by its inner ifindex.
+ */
+
+/* (Re)loads xdp_sock_prog, xdp_redirect_dummy_prog and xdp_port_egress in the current variant. Needs the PHY program loaded */
+int port_prog_init(void);
+
+/* Attaches the cached programs to both ends of a port, giving it an xsks_map pinned under its inner veth first if it has none */
+int port_prog_attach(const char* inner, const char* outer);
+
+/* Detaches both ends and drops the port's xsks_map and counters */
+void port_prog_detach(const char* inner, const char* outer);
+
+/* xdp_port_egress for the port's devmap entry, -1 before port_prog_init() */
+int port_prog_egress_fd(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "port_l2_kern_user.h"
+#include "steer_kern_user.h"
+
+/* port_key.queue of veth ports, they are found by either of their interfaces */
+#define PORT_KEY_ANY_QUEUE 0xffffffff
+
+/* port_registry holds a veth port under its inner and outer ifindex, a direct mode port under each PHY queue it owns */
+#define PORT_REGISTRY_MAX (2 * DEVMAP_SLOTS + PHY_QUEUES_MAX)
+
+/* port_entry.flags */
+#define PORT_F_DIRECT (1 << 0) /* Owns PHY queues, has no veth pair */
+
+/* Key of port_registry: the ifindex a frame arrives on or is redirected to, plus the PHY queue for direct mode ports */
+struct port_key {
+    __u32 ifindex;
+    __u32 queue;
+};
+
+/* Value of port_registry, one copy per key of the port */
+struct port_entry {
+    char prefix[16];
+    __u32 slot; /* xdp_devmap slot */
+    __u32 flags;
+    __u32 inner_ifindex;
+    __u32 outer_ifindex;
+    __u32 veth_queues;
+    __u32 pad;
+    __u64 phy_queues;
+    struct port_l2 l2; /* Rewrite xdp_port_egress applies on the way into the port */
+};
@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "lwlog.h"
+#include "rss.h"
+#include "xdp_utils.h"
+
+enum { RSS_SPEC_SIZE = 256 };
+
+/* Last configuration, replayed by rss_reapply() */
+static char rss_spec[RSS_SPEC_SIZE];
+static __u32 rss_qsize = RSS_DEFAULT_QSIZE;
+
+/* "0-3,6" -> list of CPU ids, -1 when malformed or out of range */
+static int rss_parse_cpus(const char* spec, __u32* cpus, const int max) {
+    const int possible = libbpf_num_possible_cpus();
+    int n = 0;
+    char* end;
+
+    while (*spec != '\0') {
+        const long first = strtol(spec, &end, 10);
+        long last = first;
+        if (end == spec)
+            return -1;
+        if (*end == '-') {
+            spec = end + 1;
+            last = strtol(spec, &end, 10);
+            if (end == spec)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= possible || last >= RSS_CPUS_MAX || (*end != ',' && *end != '\0'))
+            return -1;
+
+        for (long cpu = first; cpu <= last && n < max; cpu++)
+            cpus[n++] = cpu;
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static void rss_disable(const int cfg_fd, const int cpu_map_fd) {
+    const struct rss_cfg cfg = {.nr_cpus = 0};
+    const __u32 zero = 0;
+
+    /* Stop handing out CPUs before their queues go away */
+    bpf_map_update_elem(cfg_fd, &zero, &cfg, BPF_ANY);
+    for (__u32 cpu = 0; cpu < RSS_CPUS_MAX; cpu++)
+        bpf_map_delete_elem(cpu_map_fd, &cpu);
+}
+
+int rss_configure(const char* spec, const __u32 qsize) {
+    __u32 cpus[RSS_CPUS_MAX];
+    bool in_use[RSS_CPUS_MAX] = {false};
+    struct bpf_object* obj = NULL;
+    int nr_cpus = 0;
+    int err = -1;
+
+    const bool off = spec == NULL || spec[0] == '\0' || strcmp(spec, "off") == 0;
+    if (!off) {
+        nr_cpus = rss_parse_cpus(spec, cpus, RSS_CPUS_MAX);
+        if (nr_cpus <= 0 || qsize == 0) {
+            lwlog_err("Invalid RSS CPU set %s or queue size %u", spec, qsize);
+            return -1;
+        }
+    }
+
+    const int cfg_fd = open_phy_map("rss_cfg");
+    const int cpus_fd = open_phy_map("rss_cpus");
+    const int cpu_map_fd = open_phy_map("cpu_map");
+    if (cfg_fd < 0 || cpus_fd < 0 || cpu_map_fd < 0)
+        goto out;
+
+    if (off) {
+        rss_disable(cfg_fd, cpu_map_fd);
+        rss_spec[0] = '\0';
+        lwlog_info("Software RSS off");
+        err = 0;
+        goto out;
+    }
+
+    const int prog_fd = load_shared_prog("phy_xdp", "xdp_rss_cpumap", &obj);
+    if (prog_fd < 0)
+        goto out;
+
+    for (int i = 0; i < nr_cpus; i++) {
+        struct bpf_cpumap_val val = {.qsize = qsize, .bpf_prog.fd = prog_fd};
+        if (bpf_map_update_elem(cpu_map_fd, &cpus[i], &val, BPF_ANY)) {
+            lwlog_err("Couldn't add CPU %u to cpu_map: %s", cpus[i], strerror(errno));
+            rss_disable(cfg_fd, cpu_map_fd);
+            goto out;
+        }
+        in_use[cpus[i]] = true;
+
+        const __u32 index = i;
+        bpf_map_update_elem(cpus_fd, &index, &cpus[i], BPF_ANY);
+    }
+
+    /* Publish the count last, the PHY program never indexes past it */
+    const struct rss_cfg cfg = {.nr_cpus = nr_cpus};
+    const __u32 zero = 0;
+    if (bpf_map_update_elem(cfg_fd, &zero, &cfg, BPF_ANY)) {
+        lwlog_err("Couldn't update rss_cfg: %s", strerror(errno));
+        goto out;
+    }
+
+    for (__u32 cpu = 0; cpu < RSS_CPUS_MAX; cpu++) {
+        if (!in_use[cpu])
+            bpf_map_delete_elem(cpu_map_fd, &cpu);
+    }
+
+    if (spec != rss_spec)
+        snprintf(rss_spec, sizeof(rss_spec), "%s", spec);
+    rss_qsize = qsize;
+    lwlog_info("Software RSS over CPUs %s, %u frames per CPU queue", spec, qsize);
+    err = 0;
+
+out:
+    /* cpu_map entries hold their own reference on the program */
+    if (obj != NULL)
+        bpf_object__close(obj);
+    if (cfg_fd >= 0)
+        close(cfg_fd);
+    if (cpus_fd >= 0)
+        close(cpus_fd);
+    if (cpu_map_fd >= 0)
+        close(cpu_map_fd);
+    return err;
+}
+
+int rss_reapply(void) {
+    if (rss_spec[0] == '\0')
+        return 0;
+    return rss_configure(rss_spec, rss_qsize);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "rss_kern_user.h"
+
+/*
+ * Spreads PHY traffic over the CPUs in spec ("0-3,6"), each with a cpumap queue of qsize frames. "off" or an empty spec hands
+ * everything back to the receiving CPU. Needs the PHY program loaded and its maps pinned.
+ */
+int rss_configure(const char* spec, __u32 qsize);
+
+/* Re-installs the last configuration, after the PHY program was swapped */
+int rss_reapply(void);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <linux/types.h>
+
+/* max_entries of cpu_map and rss_cpus, CPU ids past it can't take part in software RSS */
+#define RSS_CPUS_MAX 128
+
+/* Per-CPU cpumap queue size when --rss-qsize isn't given */
+#define RSS_DEFAULT_QSIZE 2048
+
+/* Single entry of rss_cfg */
+struct rss_cfg {
+    __u32 nr_cpus; /* Valid entries of rss_cpus, 0 keeps every frame on the CPU that received it */
+};
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <linux/ethtool.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <linux/veth.h>
+
+#include "lwlog.h"
+#include "rtnl.h"
+
+/* RTNL_BATCH requests go out in one datagram */
+enum { RTNL_BUF_SIZE = 1024, RTNL_BATCH = 64 };
+
+struct rtnl_req {
+    struct nlmsghdr nh;
+    struct ifinfomsg ifi;
+    char attrs[RTNL_BUF_SIZE];
+};
+
+#define NLMSG_TAIL(nh) ((struct rtattr*)((char*)(nh) + NLMSG_ALIGN((nh)->nlmsg_len)))
+
+static struct rtattr* rtnl_attr_add(struct nlmsghdr* nh, const unsigned short type, const void* data, const size_t len) {
+    struct rtattr* rta = NLMSG_TAIL(nh);
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len > 0)
+        memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+/* Nested attributes are added empty and closed once everything inside them is in */
+static void rtnl_attr_end(struct nlmsghdr* nh, struct rtattr* nest) {
+    nest->rta_len = (char*)NLMSG_TAIL(nh) - (char*)nest;
+}
+
+/*
+ * Sends nr requests laid out back to back in buf as one datagram and collects the kernel's ack for each, errs[i] is 0 or a
+ * negative errno for the i-th request. Returns 0, or a negative errno when the exchange itself failed.
+ */
+static int rtnl_talk_batch(void* buf, const size_t len, const int nr, int* errs) {
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    char reply[RTNL_BUF_SIZE * 4];
+    int err = 0;
+
+    const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return -errno;
+
+    /* Acks of failed requests would otherwise quote the whole request back */
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &(int){1}, sizeof(int));
+
+    struct nlmsghdr* nh = buf;
+    for (int i = 0; i < nr; i++, nh = (struct nlmsghdr*)((char*)nh + NLMSG_ALIGN(nh->nlmsg_len))) {
+        nh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+        nh->nlmsg_seq = i + 1;
+        errs[i] = -ETIMEDOUT;
+    }
+
+    if (sendto(fd, buf, len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    for (int acked = 0; acked < nr;) {
+        ssize_t n = recv(fd, reply, sizeof(reply), 0);
+        if (n < 0) {
+            err = -errno;
+            goto out;
+        }
+
+        for (struct nlmsghdr* ack = (struct nlmsghdr*)reply; NLMSG_OK(ack, (size_t)n); ack = NLMSG_NEXT(ack, n)) {
+            if (ack->nlmsg_type != NLMSG_ERROR || ack->nlmsg_seq == 0 || ack->nlmsg_seq > (__u32)nr)
+                continue;
+            errs[ack->nlmsg_seq - 1] = ((struct nlmsgerr*)NLMSG_DATA(ack))->error;
+            acked++;
+        }
+    }
+
+out:
+    close(fd);
+    return err;
+}
+
+static int rtnl_talk(struct nlmsghdr* nh) {
+    int ack;
+    const int err = rtnl_talk_batch(nh, nh->nlmsg_len, 1, &ack);
+    return err ? err : ack;
+}
+
+/* Lays out a RTM_NEWLINK for the pair at nh, returns its aligned length */
+static size_t rtnl_veth_msg(struct nlmsghdr* nh, const char* ifname, const char* peer, const unsigned int queues) {
+    struct rtnl_req* req = (struct rtnl_req*)nh;
+    const uint32_t nr_queues = queues > 0 ? queues : 1;
+
+    memset(req, 0, sizeof(*req));
+    req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(req->ifi));
+    req->nh.nlmsg_type = RTM_NEWLINK;
+    req->nh.nlmsg_flags = NLM_F_CREATE | NLM_F_EXCL;
+    req->ifi.ifi_family = AF_UNSPEC;
+    req->ifi.ifi_flags = IFF_UP;
+    req->ifi.ifi_change = IFF_UP;
+
+    rtnl_attr_add(&req->nh, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+    rtnl_attr_add(&req->nh, IFLA_NUM_TX_QUEUES, &nr_queues, sizeof(nr_queues));
+    rtnl_attr_add(&req->nh, IFLA_NUM_RX_QUEUES, &nr_queues, sizeof(nr_queues));
+
+    struct rtattr* linkinfo = rtnl_attr_add(&req->nh, IFLA_LINKINFO, NULL, 0);
+    rtnl_attr_add(&req->nh, IFLA_INFO_KIND, "veth", strlen("veth"));
+    struct rtattr* data = rtnl_attr_add(&req->nh, IFLA_INFO_DATA, NULL, 0);
+
+    /* The peer is described by its own ifinfomsg followed by its attributes */
+    struct rtattr* peer_info = rtnl_attr_add(&req->nh, VETH_INFO_PEER, NULL, 0);
+    struct ifinfomsg* peer_ifi = RTA_DATA(peer_info);
+    memset(peer_ifi, 0, sizeof(*peer_ifi));
+    peer_ifi->ifi_family = AF_UNSPEC;
+    peer_ifi->ifi_flags = IFF_UP;
+    peer_ifi->ifi_change = IFF_UP;
+    req->nh.nlmsg_len += NLMSG_ALIGN(sizeof(*peer_ifi));
+    rtnl_attr_add(&req->nh, IFLA_IFNAME, peer, strlen(peer) + 1);
+    rtnl_attr_add(&req->nh, IFLA_NUM_TX_QUEUES, &nr_queues, sizeof(nr_queues));
+    rtnl_attr_add(&req->nh, IFLA_NUM_RX_QUEUES, &nr_queues, sizeof(nr_queues));
+
+    rtnl_attr_end(&req->nh, peer_info);
+    rtnl_attr_end(&req->nh, data);
+    rtnl_attr_end(&req->nh, linkinfo);
+    return NLMSG_ALIGN(req->nh.nlmsg_len);
+}
+
+/* Lays out a RTM_DELLINK for ifindex at nh, returns its aligned length */
+static size_t rtnl_del_msg(struct nlmsghdr* nh, const int ifindex) {
+    struct rtnl_req* req = (struct rtnl_req*)nh;
+
+    memset(req, 0, sizeof(*req));
+    req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(req->ifi));
+    req->nh.nlmsg_type = RTM_DELLINK;
+    req->ifi.ifi_family = AF_UNSPEC;
+    req->ifi.ifi_index = ifindex;
+    return NLMSG_ALIGN(req->nh.nlmsg_len);
+}
+
+int rtnl_veth_create(const char* ifname, const char* peer, const unsigned int queues) {
+    struct rtnl_req req;
+
+    rtnl_veth_msg(&req.nh, ifname, peer, queues);
+    const int err = rtnl_talk(&req.nh);
+    if (err)
+        lwlog_err("Couldn't create veth pair [%s, %s]: %s", ifname, peer, strerror(-err));
+    return err;
+}
+
+int rtnl_link_delete(const char* ifname) {
+    struct rtnl_req req;
+
+    const int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        const int err = -errno;
+        lwlog_err("Couldn't delete %s: %s", ifname, strerror(-err));
+        return err;
+    }
+
+    rtnl_del_msg(&req.nh, ifindex);
+    const int err = rtnl_talk(&req.nh);
+    if (err)
+        lwlog_err("Couldn't delete %s: %s", ifname, strerror(-err));
+    return err;
+}
+
+/* Runs the requests build() lays out in chunks of RTNL_BATCH, one datagram and one round of acks per chunk */
+static void rtnl_batch(const int nr, size_t (*build)(struct nlmsghdr* nh, int i, const void* arg), const void* arg, int* errs) {
+    struct rtnl_req* reqs = malloc(sizeof(*reqs) * RTNL_BATCH);
+    if (reqs == NULL) {
+        for (int i = 0; i < nr; i++)
+            errs[i] = -ENOMEM;
+        return;
+    }
+
+    for (int first = 0; first < nr; first += RTNL_BATCH) {
+        const int chunk = nr - first < RTNL_BATCH ? nr - first : RTNL_BATCH;
+        char* buf = (char*)reqs;
+        size_t len = 0;
+
+        for (int i = 0; i < chunk; i++)
+            len += build((struct nlmsghdr*)(buf + len), first + i, arg);
+
+        const int err = rtnl_talk_batch(buf, len, chunk, errs + first);
+        for (int i = 0; err && i < chunk; i++)
+            errs[first + i] = err;
+    }
+    free(reqs);
+}
+
+static size_t rtnl_batch_veth_msg(struct nlmsghdr* nh, const int i, const void* arg) {
+    const struct rtnl_veth* veths = arg;
+    return rtnl_veth_msg(nh, veths[i].ifname, veths[i].peer, veths[i].queues);
+}
+
+static size_t rtnl_batch_del_msg(struct nlmsghdr* nh, const int i, const void* arg) {
+    const struct rtnl_veth* veths = arg;
+    return rtnl_del_msg(nh, if_nametoindex(veths[i].ifname));
+}
+
+void rtnl_veth_create_batch(const struct rtnl_veth* veths, const int nr, int* errs) {
+    rtnl_batch(nr, rtnl_batch_veth_msg, veths, errs);
+}
+
+void rtnl_link_delete_batch(const struct rtnl_veth* veths, const int nr, int* errs) {
+    rtnl_batch(nr, rtnl_batch_del_msg, veths, errs);
+}
+
+int rtnl_set_csum_offload(const char* ifname, const bool on) {
+    const __u32 cmds[] = {ETHTOOL_SRXCSUM, ETHTOOL_STXCSUM};
+    struct ifreq ifr = {0};
+    int err = 0;
+
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]) && err == 0; i++) {
+        struct ethtool_value val = {.cmd = cmds[i], .data = on};
+        ifr.ifr_data = (void*)&val;
+        if (ioctl(fd, SIOCETHTOOL, &ifr))
+            err = -errno;
+    }
+
+    close(fd);
+    if (err)
+        lwlog_err("Couldn't turn checksum offload %s on %s: %s", on ? "on" : "off", ifname, strerror(-err));
+    return err;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <net/if.h>
+
+/*
+ * veth provisioning over rtnetlink, in-process and without forking ip(8). Every call returns 0 or a negative errno, which the
+ * kernel's netlink ack carries back.
+ */
+
+/* Creates ifname with its peer, both up and with queues RX/TX queues each */
+int rtnl_veth_create(const char* ifname, const char* peer, unsigned int queues);
+
+/* Deletes ifname, a veth takes its peer along */
+int rtnl_link_delete(const char* ifname);
+
+struct rtnl_veth {
+    char ifname[IFNAMSIZ];
+    char peer[IFNAMSIZ];
+    unsigned int queues;
+};
+
+/* Batched variants, a few datagrams for the lot and errs[i] for the i-th pair. Deleting only looks at ifname */
+void rtnl_veth_create_batch(const struct rtnl_veth* veths, int nr, int* errs);
+void rtnl_link_delete_batch(const struct rtnl_veth* veths, int nr, int* errs);
+
+/* Turns RX/TX checksum offload of ifname on or off, through the ethtool ioctl rtnetlink has no message for */
+int rtnl_set_csum_offload(const char* ifname, bool on);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Single-writer sequence lock. The writer makes the sequence odd, does plain stores and makes it even again, it never
+ * waits. Readers copy the protected data and retry if the sequence was odd or moved while they were copying.
+ */
+static inline void seqlock_write_begin(uint32_t* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(uint32_t* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t seqlock_read_begin(const uint32_t* seq) {
+    uint32_t start;
+
+    while ((start = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return start;
+}
+
+static inline bool seqlock_read_retry(const uint32_t* seq, const uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
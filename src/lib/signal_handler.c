@@ -4,30 +4,69 @@
 #include <pthread.h>
 
 #include "args.h"
+#include "daemon_state.h"
 #include "signal_handler.h"
 #include "lwlog.h"
+#include "metrics.h"
 #include "socket.h"
 #include "socket_cmds.h"
+#include "stats_shm.h"
+#include "xdp_stats.h"
+#include "xdp_trace.h"
 #include "xdp_utils.h"
+#include "xsk_switch.h"
 #include "veth_list.h"
 
 int global_exit_flag = 0;
 
 options_t opts;
 
-void exit_daemon() {
+/* A signal may come before every thread is up, restoring thousands of ports takes a while, and 0 is no thread to join */
+static void join_daemon_thread(const pthread_t thread, const char* name) {
+    if (thread == 0)
+        return;
+
+    lwlog_info("Waiting for %s thread to exit", name);
+    pthread_join(thread, NULL);
+}
+
+static void stop_daemon_threads() {
     global_exit_flag = 1;
 
-    lwlog_info("Waiting for socket thread to exit");
-    pthread_join(socket_thread, NULL);  // its running socket_server_thread_func
+    join_daemon_thread(socket_thread, "socket");  // its running socket_server_thread_func
+    join_daemon_thread(metrics_thread, "metrics");
+    join_daemon_thread(xdp_stats_thread, "XDP stats");
+    join_daemon_thread(xdp_trace_thread, "XDP trace");
+}
 
-    lwlog_info("Unloading XDP from wlan0");
+void exit_daemon() {
+    stop_daemon_threads();
+
+    lwlog_info("Unloading XDP from %s", opts.dev);
     int err = unload_xdp_from_ifname(opts.dev);
     if (err != EXIT_OK) {
         lwlog_crit("unload_xdp_from_ifname: %s", strerror(err));
     }
 
     unload_list();
+    xsk_switch_destroy();
+    stats_shm_destroy(false);
+    daemon_state_clear();
+
+    exit(EXIT_SUCCESS);
+}
+
+void exit_daemon_keep() {
+    stop_daemon_threads();
+
+    /* Switch ports live on this process's XSKs, their steering rules would point the next daemon at nothing */
+    unload_switch_ports();
+    xsk_switch_destroy();
+
+    /* Programs, pinned maps, interfaces and the clients' XSKs stay, only this process goes */
+    if (daemon_state_save() < 0)
+        lwlog_warning("No state file written, the next daemon resumes from the pinned maps alone");
+    stats_shm_destroy(true);
 
     exit(EXIT_SUCCESS);
 }
@@ -50,18 +89,29 @@ static void daemon_sigterm_handler() {
     exit_daemon();
 }
 
+/*
+ * Signal handler for SIGUSR2, exits for a restart
+ */
+static void daemon_sigusr2_handler() {
+    fprintf(stderr, "\n");
+    fprintf(stderr, RED "Restarting, ports stay up\n" NONE);
+    exit_daemon_keep();
+}
+
 /*
  * Initializes the signal handlers
  */
 void daemon_signal_init() {
     signal(SIGINT, daemon_sigint_handler);
     signal(SIGTERM, daemon_sigterm_handler);
+    signal(SIGUSR2, daemon_sigusr2_handler);
 }
 
 void exit_client() {
     global_exit_flag = 1;
 
     remove_port(opts.dev);
+    metrics_port_unlink(opts.dev);
 
     exit(EXIT_SUCCESS);
 }
@@ -3,6 +3,8 @@
 void daemon_signal_init();
 void client_signal_init();
 void exit_daemon();
+/* Stops the daemon leaving every port running for the next one to take over, see daemon_state.h */
+void exit_daemon_keep();
 void exit_client();
 
 extern int global_exit_flag;
\ No newline at end of file
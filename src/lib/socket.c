@@ -1,55 +1,138 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <net/if.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/time.h>
 
+#include "args.h"
+#include "ctl_proto.h"
 #include "socket.h"
 #include "lwlog.h"
+#include "metrics.h"
 #include "socket_handler.h"
+#include "stats_shm.h"
 #include "veth_list.h"
+#include "xsk_utils.h"
 
 pthread_t socket_thread = 0;
-int client_socket_fd;
-int server_socket_fd;
-enum { TIMEOUT_SECONDS = 5, MAX_CLIENTS = 10 };
+/* Listen backlog, every port's client may attach at once after a restart. The kernel caps it at net.core.somaxconn */
+enum { TIMEOUT_SECONDS = 5, MAX_CLIENTS = DEVMAP_SLOTS };
+
+/* Workers running control requests, a slow create_port only holds up its own connection */
+enum { CTL_WORKERS = 4, CTL_MAX_EVENTS = 64 };
+
+enum ctl_mode {
+    CTL_MODE_UNKNOWN, /* Nothing received yet, the first byte decides */
+    CTL_MODE_TEXT,
+    CTL_MODE_BINARY,
+};
 
 /*
- * Creates a socket
+ * Per-connection state of the control server. Requests are answered in order, so a connection has at most one request with
+ * the workers and pipelined ones wait in its input buffer.
+ */
+struct ctl_conn {
+    int fd;
+    enum ctl_mode mode;
+    char in[sizeof(struct ctl_hdr) + CTL_REQ_MAX];
+    size_t in_len;
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    bool busy;   /* A request of this connection is with the workers */
+    bool eof;    /* Peer is done sending, close once everything is answered */
+    bool armed;  /* fd is in the epoll set */
+    bool dead;   /* Closed, later events of the same epoll batch and ctl_complete() skip it */
+    bool reaped; /* On ctl_reaped, freed once the current epoll batch is done */
+    struct ctl_hdr req;          /* Header of the binary request with the workers */
+    char line[CTL_REQ_MAX + 1];  /* Its arguments, or the text line */
+    char* reply;
+    int reply_len;
+    struct ctl_fds fds; /* Go out with the reply starting at fds_off of out */
+    size_t fds_off;
+    struct ctl_conn* next; /* Job or completion queue */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ctl_conn *jobs, *jobs_tail;
+    struct ctl_conn* done;
+    int done_fd; /* eventfd waking the event loop when workers finish a line */
+    bool stop;
+} ctl = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .done_fd = -1};
+
+/* Markers for epoll_event.data.ptr that are not connections */
+static char ctl_listen_tag, ctl_done_tag;
+
+/* Connections closed during the current epoll batch, event loop only */
+static struct ctl_conn* ctl_reaped;
+
+/*
+ * Creates the daemon's control socket, a Unix stream socket at XSKNET_CTL_PATH
  */
 int socket_create() {
     lwlog_info("Creating socket");
-    const int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (socket_fd < 0) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
+    return socket_fd;
+}
+
+/*
+ * Hands path to --ctl-group with the given mode, root keeps it to itself without one
+ */
+static void socket_grant(const char* path, const mode_t group_mode, const mode_t root_mode) {
+    gid_t gid = 0;
+
+    if (opts.ctl_group[0] != '\0') {
+        const struct group* grp = getgrnam(opts.ctl_group);
+        if (grp == NULL) {
+            lwlog_crit("Unknown --ctl-group %s", opts.ctl_group);
+            exit(EXIT_FAILURE);
+        }
+        gid = grp->gr_gid;
+    }
 
-    int opt = 1;
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
+    if (chown(path, 0, gid) < 0 || chmod(path, opts.ctl_group[0] != '\0' ? group_mode : root_mode) < 0) {
+        lwlog_crit("Couldn't set the owner of %s: %s", path, strerror(errno));
         exit(EXIT_FAILURE);
     }
-
-    return socket_fd;
 }
 
 /*
- * Binds a socket to a port
+ * Binds a socket to the control path, replacing what a previous daemon left behind. Members of --ctl-group may connect
+ * and bind their metrics sockets, the sticky bit keeps them from removing each other's.
  */
-void socket_bind(int socket_fd, const int port) {
-    lwlog_info("Binding socket to port %d", port);
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    if (bind(socket_fd, (struct sockaddr*)&server_address, sizeof(server_address)) < 0) {
+void socket_bind(int socket_fd, const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    lwlog_info("Binding socket to %s", path);
+    if ((mkdir(XSKNET_RUN_DIR, 0755) < 0 && errno != EEXIST) || (mkdir(XSKNET_METRICS_DIR, 0755) < 0 && errno != EEXIST)) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    socket_grant(XSKNET_METRICS_DIR, S_ISVTX | 0770, 0755);
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(addr.sun_path);
+    if (bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
         exit(EXIT_FAILURE);
     }
+    socket_grant(addr.sun_path, 0660, 0600);
 }
 
 /*
@@ -64,172 +147,569 @@ void socket_listen(const int socket_fd) {
 }
 
 /*
- * Accepts a connection on a socket
+ * Connects a socket to the daemon
  */
-int socket_accept(const int socket_fd) {
-    struct sockaddr_in client_address;
-    socklen_t client_address_len = sizeof(client_address);
-    const int fd = accept(socket_fd, (struct sockaddr*)&client_address, &client_address_len);
-    if (fd < 0) {
-        return -1;
+void socket_connect(const int socket_fd, const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
     }
-    return fd;
 }
 
 /*
- * Connects a socket to a server
+ * Closes a socket
  */
-void socket_connect(const int socket_fd, const char* server_address, const int port) {
-    struct sockaddr_in server;
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_address, &server.sin_addr) < 0) {
-        perror("inet_pton");
+void socket_close(const int socket_fd) {
+    if (close(socket_fd) < 0) {
+        perror("close");
         exit(EXIT_FAILURE);
     }
-    if (connect(socket_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
-        perror("connect");
-        exit(EXIT_FAILURE);
+}
+
+/* Answers the request of conn, a newline terminated reply for text clients and a framed one for binary clients */
+static void ctl_run(struct ctl_conn* conn) {
+    conn->reply_len = 0;
+
+    if (conn->mode == CTL_MODE_TEXT) {
+        conn->reply = malloc(CTL_REPLY_MAX + 1);
+        if (conn->reply == NULL)
+            return;
+        const int len = handle_line(conn->line, conn->reply, CTL_REPLY_MAX);
+        conn->reply_len = len < 0 ? 0 : len < CTL_REPLY_MAX ? len : CTL_REPLY_MAX - 1;
+        conn->reply[conn->reply_len++] = '\n';
+        return;
+    }
+
+    struct ctl_hdr hdr = {.magic = CTL_MAGIC, .version = CTL_VERSION, .op = conn->req.op, .id = conn->req.id};
+    conn->reply = malloc(sizeof(hdr) + CTL_REPLY_MAX);
+    if (conn->reply == NULL)
+        return;
+
+    char* payload = conn->reply + sizeof(hdr);
+    if (conn->req.version != CTL_VERSION) {
+        hdr.status = CTL_ERR_PROTO;
+        snprintf(payload, CTL_REPLY_MAX, "version %u unsupported, daemon speaks %d", conn->req.version, CTL_VERSION);
+    } else {
+        hdr.status = handle_request(conn->req.op, conn->line, payload, CTL_REPLY_MAX, &conn->fds);
     }
+    hdr.len = strnlen(payload, CTL_REPLY_MAX - 1);
+
+    memcpy(conn->reply, &hdr, sizeof(hdr));
+    conn->reply_len = sizeof(hdr) + hdr.len;
 }
 
-/*
- * Reads data from a socket
- */
-long socket_read(const int socket_fd, void* buffer, const int buffer_size) {
-    const long bytes_read = read(socket_fd, buffer, buffer_size);
-    if (bytes_read < 0) {
-        perror("read");
-        exit(EXIT_FAILURE);
+static void* ctl_worker(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&ctl.lock);
+    while (!ctl.stop) {
+        struct ctl_conn* conn = ctl.jobs;
+        if (conn == NULL) {
+            pthread_cond_wait(&ctl.cond, &ctl.lock);
+            continue;
+        }
+        ctl.jobs = conn->next;
+        if (ctl.jobs == NULL)
+            ctl.jobs_tail = NULL;
+        pthread_mutex_unlock(&ctl.lock);
+
+        ctl_run(conn);
+
+        pthread_mutex_lock(&ctl.lock);
+        conn->next = ctl.done;
+        ctl.done = conn;
+        eventfd_write(ctl.done_fd, 1);
     }
-    return bytes_read;
+    pthread_mutex_unlock(&ctl.lock);
+    return NULL;
+}
+
+static void ctl_fds_close(struct ctl_fds* fds) {
+    for (int i = 0; i < fds->nr; i++)
+        close(fds->fds[i]);
+    fds->nr = 0;
 }
 
 /*
- * Writes data to a socket
+ * Takes the connection out of the loop. The memory stays until ctl_conn_reap(), the batch may still hold an event for it,
+ * and while busy a worker holds it and ctl_complete() closes it again once it is back.
  */
-void socket_write(const int socket_fd, const void* buffer, const int buffer_size) {
-    if (write(socket_fd, buffer, buffer_size) < 0) {
-        perror("write");
-        exit(EXIT_FAILURE);
+static void ctl_conn_close(const int epfd, struct ctl_conn* conn) {
+    if (conn->armed)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->armed = false;
+    conn->dead = true;
+
+    if (conn->busy || conn->reaped)
+        return;
+    conn->reaped = true;
+    conn->next = ctl_reaped;
+    ctl_reaped = conn;
+}
+
+/* Frees the connections closed during the last epoll batch */
+static void ctl_conn_reap(void) {
+    while (ctl_reaped != NULL) {
+        struct ctl_conn* conn = ctl_reaped;
+        ctl_reaped = conn->next;
+        ctl_fds_close(&conn->fds);
+        close(conn->fd);
+        free(conn->out);
+        free(conn);
     }
 }
 
 /*
- * Closes a socket
+ * Watches only for what the connection can act on. Input waits while the buffer is full or after EOF, and a connection with
+ * nothing to watch leaves the set so a hung up peer doesn't spin the loop while its line is with the workers.
  */
-void socket_close(const int socket_fd) {
-    if (close(socket_fd) < 0) {
-        perror("close");
-        exit(EXIT_FAILURE);
+static void ctl_conn_arm(const int epfd, struct ctl_conn* conn) {
+    struct epoll_event ev = {.events = 0, .data.ptr = conn};
+
+    if (!conn->eof && conn->in_len < sizeof(conn->in))
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (conn->out_len > 0)
+        ev.events |= EPOLLOUT;
+
+    if (ev.events == 0) {
+        if (conn->armed)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->armed = false;
+        return;
+    }
+    epoll_ctl(epfd, conn->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev);
+    conn->armed = true;
+}
+
+/* Writes what the socket takes now, the rest waits for EPOLLOUT. Returns -1 once the connection is gone */
+static int ctl_conn_flush(const int epfd, struct ctl_conn* conn) {
+    while (conn->out_off < conn->out_len) {
+        struct iovec iov = {.iov_base = conn->out + conn->out_off, .iov_len = conn->out_len - conn->out_off};
+        char cmsg_buf[CMSG_SPACE(sizeof(conn->fds.fds))];
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+        /* Descriptors ride on the first byte of their reply, anything queued before it goes out on its own */
+        const bool with_fds = conn->fds.nr > 0 && conn->out_off == conn->fds_off;
+        if (conn->fds.nr > 0 && conn->out_off < conn->fds_off)
+            iov.iov_len = conn->fds_off - conn->out_off;
+        if (with_fds) {
+            const size_t fds_len = conn->fds.nr * sizeof(int);
+            msg.msg_control = cmsg_buf;
+            msg.msg_controllen = CMSG_SPACE(fds_len);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(fds_len);
+            memcpy(CMSG_DATA(cmsg), conn->fds.fds, fds_len);
+        }
+
+        const ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            ctl_conn_close(epfd, conn);
+            return -1;
+        }
+        /* The peer holds its own copies now */
+        if (with_fds)
+            ctl_fds_close(&conn->fds);
+        conn->out_off += n;
+    }
+
+    if (conn->out_off == conn->out_len)
+        conn->out_off = conn->out_len = 0;
+    return 0;
+}
+
+/* Takes the next complete request off the input buffer, 0 when none is complete yet and -1 when the peer sent garbage */
+static int ctl_conn_next(struct ctl_conn* conn) {
+    size_t len, skip;
+
+    if (conn->in_len == 0)
+        return 0;
+    if (conn->mode == CTL_MODE_UNKNOWN)
+        conn->mode = (__u8)conn->in[0] == CTL_MAGIC ? CTL_MODE_BINARY : CTL_MODE_TEXT;
+
+    if (conn->mode == CTL_MODE_TEXT) {
+        const char* nl = memchr(conn->in, '\n', conn->in_len);
+        if (nl == NULL)
+            return conn->in_len == sizeof(conn->in) ? -1 : 0;
+        len = nl - conn->in;
+        memcpy(conn->line, conn->in, len);
+        skip = len + 1;
+    } else {
+        if (conn->in_len < sizeof(struct ctl_hdr))
+            return 0;
+        memcpy(&conn->req, conn->in, sizeof(conn->req));
+        /* Framing is lost after a bad header, there is nothing to resync on */
+        if (conn->req.magic != CTL_MAGIC || conn->req.len > CTL_REQ_MAX)
+            return -1;
+        len = conn->req.len;
+        if (conn->in_len < sizeof(struct ctl_hdr) + len)
+            return 0;
+        memcpy(conn->line, conn->in + sizeof(struct ctl_hdr), len);
+        skip = sizeof(struct ctl_hdr) + len;
+    }
+
+    conn->line[len] = '\0';
+    conn->in_len -= skip;
+    memmove(conn->in, conn->in + skip, conn->in_len);
+    return 1;
+}
+
+/* Hands the next complete request to the workers, or closes a connection with nothing left to do */
+static void ctl_conn_pump(const int epfd, struct ctl_conn* conn) {
+    /* The next request waits until descriptors of the last reply went out, out carries one set at a time */
+    if (conn->busy || conn->fds.nr > 0) {
+        ctl_conn_arm(epfd, conn);
+        return;
+    }
+
+    const int next = ctl_conn_next(conn);
+    if (next < 0) {
+        lwlog_err("Malformed control request, dropping the connection");
+        ctl_conn_close(epfd, conn);
+        return;
+    }
+    if (next == 0) {
+        if (conn->eof && conn->out_len == 0)
+            ctl_conn_close(epfd, conn);
+        else
+            ctl_conn_arm(epfd, conn);
+        return;
+    }
+
+    conn->busy = true;
+    conn->next = NULL;
+    pthread_mutex_lock(&ctl.lock);
+    if (ctl.jobs_tail != NULL)
+        ctl.jobs_tail->next = conn;
+    else
+        ctl.jobs = conn;
+    ctl.jobs_tail = conn;
+    pthread_cond_signal(&ctl.cond);
+    pthread_mutex_unlock(&ctl.lock);
+
+    ctl_conn_arm(epfd, conn);
+}
+
+static void ctl_conn_read(const int epfd, struct ctl_conn* conn) {
+    while (conn->in_len < sizeof(conn->in)) {
+        const ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn->eof = true;
+            break;
+        }
+        conn->in_len += n;
+    }
+    ctl_conn_pump(epfd, conn);
+}
+
+static void ctl_accept(const int epfd, const int listen_fd) {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct ctl_conn* conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        ctl_conn_arm(epfd, conn);
+    }
+}
+
+/* Appends the replies the workers finished to their connections */
+static void ctl_complete(const int epfd) {
+    eventfd_t count;
+    eventfd_read(ctl.done_fd, &count);
+
+    pthread_mutex_lock(&ctl.lock);
+    struct ctl_conn* done = ctl.done;
+    ctl.done = NULL;
+    pthread_mutex_unlock(&ctl.lock);
+
+    while (done != NULL) {
+        struct ctl_conn* conn = done;
+        done = conn->next;
+        conn->busy = false;
+
+        if (conn->dead) {
+            ctl_fds_close(&conn->fds);
+            free(conn->reply);
+            ctl_conn_close(epfd, conn);
+            continue;
+        }
+
+        char* out = conn->reply_len > 0 ? realloc(conn->out, conn->out_len + conn->reply_len) : NULL;
+        if (out != NULL) {
+            conn->fds_off = conn->out_len;
+            memcpy(out + conn->out_len, conn->reply, conn->reply_len);
+            conn->out = out;
+            conn->out_len += conn->reply_len;
+        } else {
+            ctl_fds_close(&conn->fds);
+        }
+        free(conn->reply);
+        conn->reply = NULL;
+
+        if (ctl_conn_flush(epfd, conn) == 0)
+            ctl_conn_pump(epfd, conn);
     }
 }
 
 /*
- * Wrapper for socket_create, socket_bind, and socket_listen, used by the server, passed to the server's pthread_create will run
- * programs whole lifetime
+ * Control server thread, one epoll loop for every client connection plus a pool of workers running the commands. Lives for
+ * the daemon's whole lifetime.
  */
 void* socket_server_thread_func(void* exit_flag) {
+    struct epoll_event events[CTL_MAX_EVENTS];
+    pthread_t workers[CTL_WORKERS];
+
     lwlog_info("Starting socket server thread");
     const int socket_fd = socket_create();
-    socket_bind(socket_fd, 8080);
+    socket_bind(socket_fd, XSKNET_CTL_PATH);
     socket_listen(socket_fd);
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+
+    const int epfd = epoll_create1(EPOLL_CLOEXEC);
+    ctl.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || ctl.done_fd < 0) {
+        lwlog_crit("Couldn't set up the control event loop: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
-        lwlog_err("setsockopt(SO_REUSEADDR) failed");
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
-        lwlog_err("setsockopt(SO_REUSEPORT) failed");
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &ctl_listen_tag};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, socket_fd, &ev);
+    ev.data.ptr = &ctl_done_tag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ctl.done_fd, &ev);
+
+    for (int i = 0; i < CTL_WORKERS; i++)
+        pthread_create(&workers[i], NULL, ctl_worker, NULL);
 
     while (*(int*)exit_flag == 0) {
-        const int fd = socket_accept(socket_fd);
-        if (fd < 0) {
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                continue;
+        /* Wakes up once a second to notice the exit flag */
+        const int n = epoll_wait(epfd, events, CTL_MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &ctl_listen_tag) {
+                ctl_accept(epfd, socket_fd);
+            } else if (ptr == &ctl_done_tag) {
+                ctl_complete(epfd);
             } else {
-                lwlog_crit("Accept failed");
-                break;
+                struct ctl_conn* conn = ptr;
+                /* Closed earlier in this batch while its request was with the workers */
+                if (conn->dead)
+                    continue;
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    conn->eof = true;
+                if ((events[i].events & EPOLLOUT) && ctl_conn_flush(epfd, conn) < 0)
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    ctl_conn_read(epfd, conn);
+                else
+                    ctl_conn_pump(epfd, conn);
             }
         }
-        handle_client(fd);
+        ctl_conn_reap();
     }
+
+    pthread_mutex_lock(&ctl.lock);
+    ctl.stop = true;
+    pthread_cond_broadcast(&ctl.cond);
+    pthread_mutex_unlock(&ctl.lock);
+    for (int i = 0; i < CTL_WORKERS; i++)
+        pthread_join(workers[i], NULL);
+
+    close(epfd);
     socket_close(socket_fd);
+    unlink(XSKNET_CTL_PATH);
     return NULL;
 }
 
-void socket_write_with_timeout(const int socket_fd, void* buffer, const unsigned long buffer_size) {
-    fd_set write_fds;
-    FD_ZERO(&write_fds);
-    FD_SET(socket_fd, &write_fds);
+/* Persistent session of the client, opened by the first request and kept until the process exits */
+static int ctl_fd = -1;
+static __u32 ctl_next_id = 1;
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
+/* Writes or reads exactly len bytes, giving up after TIMEOUT_SECONDS without progress */
+static void ctl_io(const int fd, void* buf, size_t len, const bool reading) {
+    char* p = buf;
+    bool wait = len == 0; /* Only waits for the socket to become ready */
 
-    int result = select(socket_fd + 1, NULL, &write_fds, NULL, &timeout);
+    while (len > 0 || wait) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval timeout = {.tv_sec = TIMEOUT_SECONDS};
 
-    if (result == -1) {
-        perror("select");
-        exit(EXIT_FAILURE);
-    } else if (result == 0) {
-        lwlog_err("Timeout while waiting for server connection");
-        exit(EXIT_FAILURE);
+        const int result = reading ? select(fd + 1, &fds, NULL, NULL, &timeout) : select(fd + 1, NULL, &fds, NULL, &timeout);
+        if (result == -1) {
+            perror("select");
+            exit(EXIT_FAILURE);
+        } else if (result == 0) {
+            lwlog_err("Timeout while waiting for the daemon");
+            exit(EXIT_FAILURE);
+        }
+        if (wait)
+            return;
+
+        const ssize_t n = reading ? read(fd, p, len) : send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            lwlog_err("Lost the daemon connection: %s", n < 0 ? strerror(errno) : "closed");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
     }
+}
+
+__u32 ctl_send(const unsigned int op, const char* args) {
+    const size_t len = args != NULL ? strnlen(args, CTL_REQ_MAX) : 0;
+    const struct ctl_hdr hdr = {.magic = CTL_MAGIC, .version = CTL_VERSION, .op = op, .id = ctl_next_id++, .len = len};
+
+    if (ctl_fd < 0) {
+        ctl_fd = socket_create();
+        lwlog_info("Connecting to server on %s", XSKNET_CTL_PATH);
+        socket_connect(ctl_fd, XSKNET_CTL_PATH);
+    }
+
+    lwlog_debug("Request %u: op %u %s", hdr.id, op, len > 0 ? args : "");
+    ctl_io(ctl_fd, (void*)&hdr, sizeof(hdr), false);
+    ctl_io(ctl_fd, (void*)args, len, false);
+    return hdr.id;
+}
+
+/* Reads the header of the next reply, collecting the descriptors riding on it */
+static void ctl_recv_hdr(struct ctl_hdr* hdr, struct ctl_fds* fds) {
+    char cmsg_buf[CMSG_SPACE(sizeof(fds->fds))];
+    struct iovec iov = {.iov_base = hdr, .iov_len = sizeof(*hdr)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cmsg_buf, .msg_controllen = sizeof(cmsg_buf)};
 
-    if (write(socket_fd, buffer, buffer_size) < 0) {
-        perror("write");
+    /* Waits like ctl_io(), the rest of a short header is plain data */
+    ctl_io(ctl_fd, NULL, 0, true);
+    const ssize_t n = recvmsg(ctl_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        lwlog_err("Lost the daemon connection: %s", n < 0 ? strerror(errno) : "closed");
         exit(EXIT_FAILURE);
     }
+    ctl_io(ctl_fd, (char*)hdr + n, sizeof(*hdr) - n, true);
 
-    char response[1024];
-    const long bytes_read = read(socket_fd, response, sizeof(response));
-    if (bytes_read < 0) {
-        perror("read");
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const int nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < nr; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+            if (fds != NULL && fds->nr < CTL_FDS_MAX)
+                fds->fds[fds->nr++] = fd;
+            else
+                close(fd);
+        }
+    }
+}
+
+int ctl_recv(__u32* id, char* reply, const size_t size, struct ctl_fds* fds) {
+    struct ctl_hdr hdr;
+    char discard[256];
+
+    if (fds != NULL)
+        fds->nr = 0;
+    ctl_recv_hdr(&hdr, fds);
+    if (hdr.magic != CTL_MAGIC || hdr.version != CTL_VERSION) {
+        lwlog_crit("Daemon speaks another control protocol (version %u)", hdr.version);
         exit(EXIT_FAILURE);
     }
-    lwlog_info("Server response: %s", response);
 
-    // Copy response string to buffer
-    strncpy(buffer, response, buffer_size);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    /* Whatever doesn't fit is read and dropped, the next reply starts right behind it */
+    const size_t keep = hdr.len < size ? hdr.len : size - 1;
+    ctl_io(ctl_fd, reply, keep, true);
+    reply[keep] = '\0';
+    for (size_t left = hdr.len - keep; left > 0;) {
+        const size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        ctl_io(ctl_fd, discard, chunk, true);
+        left -= chunk;
+    }
+
+    *id = hdr.id;
+    return hdr.status;
 }
 
-/*
- * Function for sending data to the server, used by the client, separate process so it will use port as parameter
- */
-void socket_send_to_port(char* cmd, int port) {
-    const int socket_fd = socket_create();
-    lwlog_info("Connecting to server on port %d", port);
-    socket_connect(socket_fd, "127.0.0.1", port);
+int ctl_call(const unsigned int op, const char* args, char* reply, const size_t size, struct ctl_fds* fds) {
+    const __u32 id = ctl_send(op, args);
+    __u32 reply_id;
+    int status;
 
-    lwlog_info("Sending command to server: %s", cmd);
-    socket_write_with_timeout(socket_fd, cmd, strlen(cmd));
+    /* Replies come back in request order, older ones still in flight are skipped along with their descriptors */
+    for (;;) {
+        status = ctl_recv(&reply_id, reply, size, fds);
+        if (reply_id == id)
+            break;
+        for (int i = 0; fds != NULL && i < fds->nr; i++)
+            close(fds->fds[i]);
+    }
 
-    lwlog_info("Closing socket");
-    socket_close(socket_fd);
+    if (status != CTL_OK)
+        lwlog_err("Daemon: %s%s%s", ctl_strerror(status), reply[0] != '\0' ? ": " : "", reply);
+    return status;
 }
 
-void request_port(const char* veth_name) {
-    lwlog_info("Requesting port %s", veth_name);
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer), "create_port %s", veth_name);
-    socket_send_to_port(buffer, 8080);
+int request_attach(const char* veth_name, char* phy_ifname, char* binding, const size_t size, struct ctl_fds* fds, struct xsk_layout* layout) {
+    char args[CTL_REQ_MAX];
+    char reply[CTL_REQ_MAX];
+
+    lwlog_info("Attaching port %s", veth_name);
+    if (opts.queues[0] != '\0')
+        snprintf(args, sizeof(args), "%s mode=direct queues=%s %s", veth_name, opts.queues, opts.steer);
+    else
+        snprintf(args, sizeof(args), "%s %s", veth_name, opts.steer);
+
+    const int status = ctl_call(CTL_OP_ATTACH, args, reply, sizeof(reply), fds);
+    if (status != CTL_OK)
+        return -1;
+
+    /* "xsk .." and "stats .." lines after the first, the stats region's descriptor is the last one */
+    char* layout_line = NULL;
+    char* stats_line = NULL;
+    for (char* line = strchr(reply, '\n'); line != NULL; line = strchr(line, '\n')) {
+        *line++ = '\0';
+        if (strncmp(line, "xsk ", 4) == 0)
+            layout_line = line;
+        else if (strncmp(line, "stats ", 6) == 0)
+            stats_line = line;
+    }
+    if (stats_line != NULL && fds->nr > 0)
+        stats_shm_attach(fds->fds[--fds->nr], stats_line);
+
+    /* Descriptors are only any use together with their layout */
+    if (fds->nr > 0 && (layout_line == NULL || xsk_layout_parse(layout_line, layout) < 0)) {
+        for (int i = 0; i < fds->nr; i++)
+            close(fds->fds[i]);
+        fds->nr = 0;
+    }
+
+    /* "<phy ifname> <binding>" */
+    char* sep = strchr(reply, ' ');
+    if (sep == NULL || sep - reply >= IFNAMSIZ) {
+        lwlog_err("Unexpected attach reply from daemon: %s", reply);
+        return -1;
+    }
+    *sep = '\0';
+    snprintf(phy_ifname, IFNAMSIZ, "%s", reply);
+    snprintf(binding, size, "%s", sep + 1);
+    lwlog_info("Phy interface %s, binding %s", phy_ifname, binding);
+    return 0;
 }
 
 void remove_port(const char* veth_name) {
+    char reply[CTL_REQ_MAX];
+
     lwlog_info("Deleting port %s", veth_name);
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer), "delete_port %s", veth_name);
-    socket_send_to_port(buffer, 8080);
-}
-
-void request_phy_ifname(char* veth_name) {
-    lwlog_info("Requesting phy_ifname for %s", veth_name);
-    char buffer[1024];
-    snprintf(buffer, sizeof(buffer), "get_phy_if %s", veth_name);
-    socket_send_to_port(buffer, 8080);
-    lwlog_info("phy_ifname: %s", buffer);
-    strncpy(veth_name, buffer, IFNAMSIZ);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
-}
\ No newline at end of file
+    ctl_call(CTL_OP_DELETE_PORT, veth_name, reply, sizeof(reply), NULL);
+}
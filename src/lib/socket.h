@@ -1,14 +1,31 @@
 #pragma once
 
 #include <pthread.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "ctl_proto.h"
+#include "xsk_utils.h"
 
-extern int client_socket_fd;
-extern int server_socket_fd;
 
 extern pthread_t socket_thread;
 
+/* Control socket of the daemon, see ctl_proto.h for what it speaks */
+#define XSKNET_CTL_PATH "/run/xsknet/control.sock"
+
 void* socket_server_thread_func(void* exit_flag);
-void socket_send_to_port(char* cmd, int port);
-void request_port(const char* veth_name);
+
+/* Queues a binary request on the client's session, opened on first use. Returns the request id */
+__u32 ctl_send(unsigned int op, const char* args);
+/* Reads the next reply into reply, sets its request id and returns its enum ctl_status. fds gets what came along, NULL closes it */
+int ctl_recv(__u32* id, char* reply, size_t size, struct ctl_fds* fds);
+/* One request and its reply */
+int ctl_call(unsigned int op, const char* args, char* reply, size_t size, struct ctl_fds* fds);
+
+/*
+ * Creates the port and learns the PHY interface and where to bind in one round trip, binding is "veth <ifname> <queue,..>" or
+ * "direct <phy ifname> <queue,..>". When the daemon bound the XSKs itself, fds has the egress socket and an XSK and UMEM
+ * memfd per queue, laid out as described by layout. Otherwise fds->nr is 0 and the client binds its own.
+ */
+int request_attach(const char* veth_name, char* phy_ifname, char* binding, size_t size, struct ctl_fds* fds, struct xsk_layout* layout);
 void remove_port(const char* veth_name);
-void request_phy_ifname(char* veth_name);
\ No newline at end of file
@@ -1,85 +1,352 @@
+#include <errno.h>
 #include <stdio.h>
+#include <linux/limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <net/if.h>
 
+#include "ctl_proto.h"
 #include "lwlog.h"
+#include "phase_prof.h"
+#include "port_l2.h"
+#include "port_prog.h"
 #include "socket_handler.h"
 #include "socket_cmds.h"
+#include "stats_shm.h"
 #include "veth_list.h"
+#include "rss.h"
+#include "rtnl.h"
 #include "socket.h"
+#include "steer.h"
+#include "xdp_trace.h"
 #include "xdp_utils.h"
+#include "xsk_pool.h"
+#include "xsk_switch.h"
 #include "args.h"
 
-enum { CMD_SIZE = 1024 };
+enum { CMD_SIZE = 1024, MAX_PORTS = DEVMAP_SLOTS, MAX_PORT_RULES = 32 };
 
-// creates veth pair with the given prefix i.e. "test" -> "test_inner" and "test_outer"
-void create_port(char* prefix) {
-    if (veth_list_add(&veths, prefix) < 0) {
+/* "0,2,5" -> bit mask of PHY RX queues, 0 when malformed or out of range */
+static uint64_t parse_queues(const char* list) {
+    const int nr_queues = phy_rx_queue_count(opts.dev);
+    const int max = nr_queues > 0 && nr_queues < PHY_QUEUES_MAX ? nr_queues : PHY_QUEUES_MAX;
+    uint64_t queues = 0;
+    char* end;
+
+    while (*list != '\0') {
+        const long queue = strtol(list, &end, 10);
+        if (end == list || queue < 0 || queue >= max || (*end != ',' && *end != '\0'))
+            return 0;
+        queues |= 1ULL << queue;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return queues;
+}
+
+/* Direct mode: the client binds its XSKs to the PHY queues itself, the PHY program already redirects them to phy_xsks_map */
+static int create_direct_port(const char* prefix, const char* queue_list, struct phase_clock* clock) {
+    const uint64_t queues = parse_queues(queue_list);
+    if (queues == 0) {
+        lwlog_err("Invalid PHY queues for %s: %s", prefix, queue_list);
+        return -1;
+    }
+
+    if (veth_list_claim_queues(&veths, prefix, queues) < 0) {
+        lwlog_err("PHY queues %s already taken, %s falls back to a veth pair", queue_list, prefix);
+        return -1;
+    }
+
+    lwlog_info("Port %s owns %s queues 0x%llx directly", prefix, opts.dev, (unsigned long long)queues);
+    if (veth_list_publish(&veths, prefix) < 0)
+        lwlog_warning("Port %s missing from port_registry", prefix);
+
+    phase_clock_skip(clock);
+    const int map_fd = open_phy_map("phy_xsks_map");
+    if (map_fd < 0 || xsk_pool_bind(prefix, opts.dev, queues, map_fd) < 0)
+        lwlog_warning("No XSKs prepared for %s, its client binds its own", prefix);
+    if (map_fd >= 0)
+        close(map_fd);
+    phase_clock_mark(clock, PHASE_XSK_BIND);
+    return 0;
+}
+
+/* One pool XSK per queue of the port's inner veth, without them the client binds its own */
+static void veth_port_pool_bind(const char* prefix, const char* inner, const unsigned int veth_queues) {
+    char pin_dir[PATH_MAX];
+
+    snprintf(pin_dir, sizeof(pin_dir), "%s/%s", pin_basedir, inner);
+    const int map_fd = open_bpf_map_file(pin_dir, "xsks_map", NULL);
+    const uint64_t veth_mask = veth_queues >= 64 ? ~0ULL : (1ULL << veth_queues) - 1;
+    if (map_fd < 0 || xsk_pool_bind(prefix, inner, veth_mask, map_fd) < 0)
+        lwlog_warning("No XSKs prepared for %s, its client binds its own", prefix);
+    if (map_fd >= 0)
+        close(map_fd);
+}
+
+/* Steering rules of a new port, and the default route if nobody has it yet */
+static int port_steer_setup(char** rules, const int nr_rules, const int slot) {
+    /* Parsed by create_port already, what fails here is steer_map. The caller rolls the port back */
+    for (int i = 0; i < nr_rules; i++) {
+        if (steer_rule_add(rules[i], slot) < 0) {
+            steer_port_flush(slot);
+            return CTL_ERR_SYS;
+        }
+    }
+
+    /* The first port takes the ICMP no rule matched, like the single port setup always did */
+    if (steer_get_default() == STEER_NO_DEFAULT)
+        steer_set_default(slot);
+    return CTL_OK;
+}
+
+/* Switch mode: rings on the daemon's XSKs instead of a veth pair, the PHY program still steers by slot */
+static int create_switch_port(const char* prefix, const int slot, char** rules, const int nr_rules, struct phase_clock* clock) {
+    phase_clock_skip(clock);
+    if (xsk_switch_add(slot, prefix) < 0) {
+        lwlog_err("Failed to add %s to the switch", prefix);
+        veth_list_remove(&veths, prefix);
+        return CTL_ERR_SYS;
+    }
+    phase_clock_mark(clock, PHASE_XSK_BIND);
+    phase_clock_log(clock, "create_port", prefix);
+
+    const int status = port_steer_setup(rules, nr_rules, slot);
+    if (status != CTL_OK) {
+        xsk_switch_del(slot);
+        veth_list_remove(&veths, prefix);
+    }
+    return status;
+}
+
+// creates veth pair with the given prefix i.e. "test" -> "test_inner" and "test_outer", followed by optional steering rules
+// "mode=direct queues=0,1" hands PHY RX queues to the port instead, the veth pair stays the fallback
+// "smac=..", "dmac=.." and "vlan=<id>" rewrite the L2 header of frames redirected to the port
+// "veth_queues=<n>" gives both veths n queues, "offload=off" turns their checksum offload off
+int create_port(char* args) {
+    char* rules[MAX_PORT_RULES];
+    struct steer_key key;
+    struct port_l2 l2 = {0};
+    unsigned int veth_queues = 1;
+    bool offload = true;
+    const char* queue_list = NULL;
+    bool direct = false;
+    int nr_rules = 0;
+
+    char* saveptr = NULL;
+    char* prefix = strtok_r(args, " ", &saveptr);
+    if (prefix == NULL) {
+        lwlog_err("Usage: create_port <prefix> [mode=direct queues=<n,..>] [smac=..] [dmac=..] [vlan=..] [mac=..|ip=..|port=..]...");
+        return CTL_ERR_INVAL;
+    }
+
+    for (char* arg = strtok_r(NULL, " ", &saveptr); arg != NULL; arg = strtok_r(NULL, " ", &saveptr)) {
+        const int is_l2 = port_l2_parse(arg, &l2);
+        if (is_l2 < 0) {
+            /* Refused before anything exists, a port without the rewrite it asked for would pass frames unchanged */
+            lwlog_err("Invalid L2 rewrite for %s: %s", prefix, arg);
+            return CTL_ERR_INVAL;
+        }
+        if (is_l2 > 0)
+            continue;
+        if (strcmp(arg, "mode=direct") == 0)
+            direct = true;
+        else if (strcmp(arg, "mode=veth") == 0)
+            direct = false;
+        else if (strncmp(arg, "queues=", 7) == 0)
+            queue_list = arg + 7;
+        else if (strncmp(arg, "veth_queues=", 12) == 0)
+            veth_queues = strtoul(arg + 12, NULL, 10);
+        else if (strcmp(arg, "offload=off") == 0)
+            offload = false;
+        else if (nr_rules < MAX_PORT_RULES && steer_rule_parse(arg, &key) == 0)
+            rules[nr_rules++] = arg;
+        else {
+            /* Anything else is taken for a rule, a typo in an option fails here instead of after the port went live */
+            lwlog_err("Invalid option or steering rule for %s: %s", prefix, arg);
+            return CTL_ERR_INVAL;
+        }
+    }
+
+    if (veth_list_slot(&veths, prefix) >= 0) {
+        lwlog_err("Port %s already exists", prefix);
+        return CTL_ERR_EXIST;
+    }
+
+    const int slot = veth_list_add(&veths, prefix);
+    if (slot < 0) {
         lwlog_err("Failed to add veth pair: [%s]", prefix);
+        return CTL_ERR_BUSY;
+    }
+    stats_shm_reset(slot);
+
+    struct phase_clock clock;
+    phase_clock_start(&clock);
+
+    if (xsk_switch_enabled()) {
+        if (direct || l2.flags != 0)
+            lwlog_warning("Dedicated queues and L2 rewrite of %s ignored, it is a switch port", prefix);
+        return create_switch_port(prefix, slot, rules, nr_rules, &clock);
+    }
+
+    if (direct && queue_list != NULL && create_direct_port(prefix, queue_list, &clock) == 0) {
+        if (nr_rules > 0 || l2.flags != 0)
+            lwlog_warning("Steering rules and L2 rewrite of %s ignored, its queues are dedicated", prefix);
+        phase_clock_log(&clock, "create_port", prefix);
+        return CTL_OK;
     }
-    veth_list_print(veths);
 
     char inner[IFNAMSIZ];
     char outer[IFNAMSIZ];
     snprintf(inner, IFNAMSIZ, "%s_inner", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
     snprintf(outer, IFNAMSIZ, "%s_outer", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
 
-    char cmd[CMD_SIZE];
-    snprintf(cmd, CMD_SIZE, "./scripts/create_veth.sh %s %s", inner, outer);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    if (veth_queues == 0 || veth_queues > PORT_XSK_QUEUES) {
+        lwlog_warning("veth_queues of %s out of range, using 1", prefix);
+        veth_queues = 1;
+    }
 
     lwlog_info("Creating veth pair: [%s, %s]", inner, outer);
-    int err = system(cmd);
+    phase_clock_skip(&clock);
+    int err = rtnl_veth_create(inner, outer, veth_queues);
     if (err != 0) {
         lwlog_err("Failed to create veth pair: [%s, %s]", inner, outer);
+        veth_list_remove(&veths, prefix);
+        return CTL_ERR_SYS;
     }
+    phase_clock_mark(&clock, PHASE_VETH_CREATE);
 
-    err = load_xdp_and_attach_to_ifname(outer, "obj/outer_xdp.o", "xdp_redirect_dummy_prog", NULL);
-    if (err != EXIT_OK) {
-        lwlog_err("load_xdp_and_attach_to_ifname: %s", strerror(err));
+    veth_list_set_veth_queues(&veths, prefix, veth_queues);
+    if (veth_list_publish(&veths, prefix) < 0)
+        goto rollback;
+
+    if (!offload) {
+        rtnl_set_csum_offload(inner, false);
+        rtnl_set_csum_offload(outer, false);
     }
 
-    err = load_xdp_and_attach_to_ifname(inner, "obj/inner_xdp.o", "xdp_sock_prog", "xsks_map");
+    /* Verified once at startup, attaching is all that's left per port */
+    phase_clock_skip(&clock);
+    err = port_prog_attach(inner, outer);
     if (err != EXIT_OK) {
-        lwlog_err("load_xdp_and_attach_to_ifname: %s", strerror(err));
+        lwlog_err("Failed to attach the port programs to [%s, %s]", inner, outer);
+        goto rollback;
+    }
+    phase_clock_mark(&clock, PHASE_PROG_ATTACH);
+
+    /* Bound before the slot goes live, the client only has to map them */
+    veth_port_pool_bind(prefix, inner, veth_queues);
+    phase_clock_mark(&clock, PHASE_XSK_BIND);
+
+    /* In place before the slot goes live, so the first redirected frame is already rewritten */
+    const __u32 outer_ifindex = if_nametoindex(outer);
+    if (l2.flags != 0 && port_l2_set(outer_ifindex, &l2) < 0) {
+        lwlog_err("Failed to set the L2 rewrite of %s", prefix);
+        goto rollback;
     }
 
-    lwlog_info("Redirecting traffic from %s to %s", opts.dev, outer);
-    err = update_devmap(if_nametoindex(outer), outer);
+    lwlog_info("Redirecting traffic from %s to %s through slot %d", opts.dev, outer, slot);
+    phase_clock_skip(&clock);
+    err = update_devmap(slot, outer_ifindex, port_prog_egress_fd(), outer);
     if (err != EXIT_OK) {
         lwlog_err("Failed updating devmap: %s", strerror(err));
+        goto rollback;
+    }
+    phase_clock_mark(&clock, PHASE_DEVMAP);
+    phase_clock_log(&clock, "create_port", prefix);
+
+    if (port_steer_setup(rules, nr_rules, slot) == CTL_OK)
+        return CTL_OK;
+
+rollback:
+    /* As batch_rollback, a half made port would only answer the client's retry with EXIST */
+    clear_devmap(slot);
+    xsk_pool_release(prefix);
+    port_prog_detach(inner, outer);
+    port_l2_clear(if_nametoindex(outer));
+    veth_list_remove(&veths, prefix);
+    if (rtnl_link_delete(inner) != 0)
+        lwlog_err("Failed to delete veth pair: [%s, %s]", inner, outer);
+    return CTL_ERR_SYS;
+}
+
+/* Hands the default route to another port, or to nobody once the last port is gone */
+static void steer_default_reassign(void) {
+    /* Per call, deletes run on several workers at once */
+    char (*prefixes)[IFNAMSIZ] = calloc(MAX_PORTS, IFNAMSIZ);
+    __u32 slot = STEER_NO_DEFAULT;
+
+    const int nr_prefixes = prefixes != NULL ? veth_list_prefixes(&veths, prefixes, MAX_PORTS) : 0;
+    for (int i = 0; i < nr_prefixes && slot == STEER_NO_DEFAULT; i++) {
+        const int found = veth_list_slot(&veths, prefixes[i]);
+        if (found >= 0 && veth_list_queues(&veths, prefixes[i]) == 0)
+            slot = found;
     }
+    steer_set_default(slot);
+    free(prefixes);
 }
 
-void delete_port(char* prefix) {
+int delete_port(char* args) {
+    char* saveptr = NULL;
+    char* prefix = strtok_r(args, " ", &saveptr);
+    if (prefix == NULL) {
+        lwlog_err("Usage: delete_port <prefix>");
+        return CTL_ERR_INVAL;
+    }
+
+    const uint64_t queues = veth_list_queues(&veths, prefix);
+    if (queues) {
+        lwlog_info("Releasing %s queues 0x%llx of %s", opts.dev, (unsigned long long)queues, prefix);
+        clear_phy_xsks(queues);
+        xsk_pool_release(prefix);
+        if (veth_list_remove(&veths, prefix) < 0)
+            lwlog_err("Failed to remove %s from veth_map", prefix);
+        return CTL_OK;
+    }
+
+    const int slot = veth_list_slot(&veths, prefix);
+    if (slot < 0) {
+        lwlog_err("Unknown port %s", prefix);
+        return CTL_ERR_NOENT;
+    }
+
+    /* Rules first, the switch drops frames for the slot once its rings are gone */
+    if (xsk_switch_queues(slot)) {
+        steer_port_flush(slot);
+        xsk_switch_del(slot);
+        if (veth_list_remove(&veths, prefix) < 0)
+            lwlog_err("Failed to remove %s from veth_map", prefix);
+        if (steer_get_default() == (__u32)slot)
+            steer_default_reassign();
+        return CTL_OK;
+    }
+
     char inner[IFNAMSIZ];
     char outer[IFNAMSIZ];
     snprintf(inner, IFNAMSIZ, "%s_inner", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
     snprintf(outer, IFNAMSIZ, "%s_outer", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
 
+    steer_port_flush(slot);
+    clear_devmap(slot);
+    port_l2_clear(if_nametoindex(outer));
+
     lwlog_info("Removing %s from veth_map", prefix);
     if (veth_list_remove(&veths, prefix) < 0) {
         lwlog_err("Failed to remove %s from veth_map", prefix);
     }
 
-    int err = unload_xdp_from_ifname(outer);
-    if (err != EXIT_OK) {
-        lwlog_err("unload_xdp_from_ifname: %s", strerror(err));
-    }
-
-    err = unload_xdp_from_ifname(inner);
-    if (err != EXIT_OK) {
-        lwlog_err("unload_xdp_from_ifname: %s", strerror(err));
-    }
+    if (steer_get_default() == (__u32)slot)
+        steer_default_reassign();
 
-    char cmd[CMD_SIZE];
-    snprintf(cmd, CMD_SIZE, "./scripts/delete_veth.sh %s", inner);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    xsk_pool_release(prefix);
+    port_prog_detach(inner, outer);
 
     lwlog_info("Deleting veth pair: [%s, %s]", inner, outer);
-    err = system(cmd);
-    if (err != 0) {
+    if (rtnl_link_delete(inner) != 0) {
         lwlog_err("Failed to delete veth pair: [%s, %s]", inner, outer);
+        return CTL_ERR_SYS;
     }
+    return CTL_OK;
 }
 
 void unload_list() {
@@ -87,4 +354,556 @@ void unload_list() {
     HASH_ITER(hh, veths, current, tmp) {
         delete_port(current->prefix);
     }
-}
\ No newline at end of file
+}
+
+void unload_switch_ports() {
+    struct veth_pair *current, *tmp;
+    HASH_ITER(hh, veths, current, tmp) {
+        if (xsk_switch_queues(current->slot))
+            delete_port(current->prefix);
+    }
+}
+
+/* Appends a line to an optional reply, upgrade reports every interface while trace only logs */
+static void swap_report(char* reply, const size_t size, const char* what, const struct xdp_swap_stat* stat) {
+    if (reply == NULL)
+        return;
+
+    const size_t used = strlen(reply);
+    if (used < size)
+        snprintf(reply + used, size - used, "%s verify_ms=%.3f swap_ms=%.3f\n", what, stat->verify_ns / 1e6, stat->swap_ns / 1e6);
+}
+
+/*
+ * Swaps the PHY and every port to the programs in obj/ of the current variant. Each interface goes from the old program to
+ * the new one in a single attach request over the same pinned maps, so no frame finds it without one and counters, XSK
+ * bindings and steering rules carry over.
+ */
+static int swap_programs(char* reply, const size_t size) {
+    static char prefixes[MAX_PORTS][IFNAMSIZ];
+    struct xdp_swap_stat stat = {0};
+    char obj[PATH_MAX];
+
+    xdp_obj_path(obj, sizeof(obj), "phy_xdp");
+    const int err = reload_xdp_on_ifname(opts.dev, obj, "xdp_redirect", "xdp_devmap", &stat);
+    if (err == EXIT_FAIL_MAP_LAYOUT) {
+        /* Nothing was swapped, the running programs and their state stay */
+        const size_t used = reply != NULL ? strlen(reply) : size;
+        if (used < size)
+            snprintf(reply + used, size - used, "%s refused: map %s changed layout, restart the daemon to upgrade\n", opts.dev, stat.changed_map);
+        return CTL_ERR_INVAL;
+    }
+    if (err != EXIT_OK) {
+        lwlog_err("reload_xdp_on_ifname %s: %s", opts.dev, strerror(err));
+        return CTL_ERR_SYS;
+    }
+    swap_report(reply, size, opts.dev, &stat);
+
+    /* The cpumap entries still run the previous variant's xdp_rss_cpumap */
+    rss_reapply();
+
+    /* One verification for the programs every port shares */
+    uint64_t start = phase_now();
+    if (port_prog_init() < 0) {
+        lwlog_err("Failed to reload the port programs");
+        return CTL_ERR_SYS;
+    }
+    stat.verify_ns = phase_now() - start;
+    stat.swap_ns = 0;
+    swap_report(reply, size, "port_programs", &stat);
+
+    int status = CTL_OK;
+    const int nr_prefixes = veth_list_prefixes(&veths, prefixes, MAX_PORTS);
+    for (int i = 0; i < nr_prefixes; i++) {
+        /* Direct mode and switch ports have no programs of their own */
+        if (veth_list_queues(&veths, prefixes[i]) || xsk_switch_queues(veth_list_slot(&veths, prefixes[i])))
+            continue;
+
+        char inner[IFNAMSIZ];
+        char outer[IFNAMSIZ];
+        snprintf(inner, IFNAMSIZ, "%s_inner", prefixes[i]);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        snprintf(outer, IFNAMSIZ, "%s_outer", prefixes[i]);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+
+        /* Replaces the running programs in place, the xsks_map stays */
+        start = phase_now();
+        if (port_prog_attach(inner, outer) < 0) {
+            lwlog_err("Failed to swap the programs of %s", prefixes[i]);
+            status = CTL_ERR_SYS;
+            continue;
+        }
+
+        /* Overwriting the devmap entry swaps its egress program just as atomically */
+        const int slot = veth_list_slot(&veths, prefixes[i]);
+        if (slot >= 0 && update_devmap(slot, if_nametoindex(outer), port_prog_egress_fd(), outer) < 0) {
+            lwlog_err("Failed to swap the egress program of %s", prefixes[i]);
+            status = CTL_ERR_SYS;
+            continue;
+        }
+
+        stat.verify_ns = 0;
+        stat.swap_ns = phase_now() - start;
+        swap_report(reply, size, prefixes[i], &stat);
+    }
+    return status;
+}
+
+// "on [sample_rate]" swaps every interface to the *_trace.o objects, "off" back to the production ones
+int trace_port(char* args) {
+    unsigned int rate = XDP_TRACE_DEFAULT_RATE;
+    char mode[8] = "";
+
+    if (sscanf(args, "%7s %u", mode, &rate) < 1 || (strcmp(mode, "on") != 0 && strcmp(mode, "off") != 0) || rate == 0) {
+        lwlog_err("Usage: trace on [sample_rate] | trace off");
+        return CTL_ERR_INVAL;
+    }
+
+    const bool on = strcmp(mode, "on") == 0;
+    const int swap = xdp_trace_set(on, rate);
+    if (swap < 0) {
+        lwlog_err("Failed to configure tracing");
+        return CTL_ERR_SYS;
+    }
+
+    lwlog_info("Tracing %s, sampling 1 in %u packets", on ? "on" : "off", on ? rate : 0);
+    if (swap == 0)
+        return CTL_OK;
+
+    const int status = swap_programs(NULL, 0);
+    if (!on)
+        xdp_trace_unpin(opts.dev);
+    return status;
+}
+
+// Reloads every program from obj/ in place, after the objects were rebuilt. One "<ifname> verify_ms=.. swap_ms=.." line each
+int xdp_upgrade(char* args, char* reply, const size_t size) {
+    (void)args;
+
+    reply[0] = '\0';
+    const uint64_t start = phase_now();
+    const int status = swap_programs(reply, size);
+
+    const size_t used = strlen(reply);
+    if (used < size)
+        snprintf(reply + used, size - used, "total_ms=%.3f", (phase_now() - start) / 1e6);
+    lwlog_info("Upgraded the XDP programs in %.3f ms", (phase_now() - start) / 1e6);
+    return status;
+}
+
+// "add <prefix> <rule>", "del <rule>" or "default <prefix>", rules as in create_port
+int steer_port(char* args) {
+    char* saveptr = NULL;
+    const char* op = strtok_r(args, " ", &saveptr);
+    const char* arg1 = strtok_r(NULL, " ", &saveptr);
+    const char* arg2 = strtok_r(NULL, " ", &saveptr);
+
+    if (op != NULL && arg1 != NULL && strcmp(op, "del") == 0)
+        return steer_rule_del(arg1) < 0 ? CTL_ERR_INVAL : CTL_OK;
+
+    const int slot = arg1 != NULL ? veth_list_slot(&veths, arg1) : -1;
+    if (op != NULL && strcmp(op, "add") == 0 && arg2 != NULL) {
+        if (slot < 0) {
+            lwlog_err("Unknown port %s", arg1);
+            return CTL_ERR_NOENT;
+        }
+        return steer_rule_add(arg2, slot) < 0 ? CTL_ERR_INVAL : CTL_OK;
+    }
+
+    if (op != NULL && strcmp(op, "default") == 0) {
+        if (slot < 0) {
+            lwlog_err("Unknown port %s", arg1 != NULL ? arg1 : "");
+            return CTL_ERR_NOENT;
+        }
+        return steer_set_default(slot) < 0 ? CTL_ERR_SYS : CTL_OK;
+    }
+
+    lwlog_err("Usage: steer add <prefix> <rule> | steer del <rule> | steer default <prefix>");
+    return CTL_ERR_INVAL;
+}
+
+/*
+ * Tells a client where to bind from the port's registry entry: "veth <inner ifname> <queue,..>", "direct <phy ifname> <queue,..>"
+ * or "switch <phy ifname> <queue,..>" for the rings of a switch port
+ */
+int port_binding(const char* prefix, char* buf, const size_t size) {
+    struct port_entry entry;
+    int len;
+
+    /* Switch ports have no interfaces of their own, nothing of them goes into port_registry */
+    uint64_t queues = xsk_switch_queues(veth_list_slot(&veths, prefix));
+    if (queues) {
+        len = snprintf(buf, size, "switch %s ", opts.dev);
+    } else if (veth_list_entry(&veths, prefix, &entry) < 0) {
+        return -1;
+    } else if (!(entry.flags & PORT_F_DIRECT)) {
+        queues = entry.veth_queues >= 64 ? ~0ULL : (1ULL << entry.veth_queues) - 1;
+        len = snprintf(buf, size, "veth %s_inner ", entry.prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    } else {
+        queues = entry.phy_queues;
+        len = snprintf(buf, size, "direct %s ", opts.dev);
+    }
+
+    for (int queue = 0; queue < PHY_QUEUES_MAX && len > 0 && (size_t)len < size; queue++) {
+        if (queues & (1ULL << queue))
+            len += snprintf(buf + len, size - len, "%d,", queue);
+    }
+    if (len > 0 && (size_t)len <= size)
+        buf[len - 1] = '\0';
+    return 0;
+}
+
+// "<cpus> [qsize]" spreads PHY traffic over the CPUs, e.g. "rss 0-3,6 4096", "off" keeps it on the receiving CPU
+int rss_port(char* args) {
+    char spec[CMD_SIZE] = "";
+    unsigned int qsize = opts.rss_qsize;
+
+    if (sscanf(args, "%1023s %u", spec, &qsize) < 1) {
+        lwlog_err("Usage: rss <cpus> [qsize] | rss off");
+        return CTL_ERR_INVAL;
+    }
+
+    if (rss_configure(spec, qsize) < 0) {
+        lwlog_err("Failed to configure software RSS");
+        return CTL_ERR_INVAL;
+    }
+    return CTL_OK;
+}
+
+// "<prefix> [smac=..] [dmac=..] [vlan=<id>]" replaces the L2 rewrite of a port, "<prefix> off" hands it frames untouched
+int l2_port(char* args) {
+    struct port_l2 l2 = {0};
+
+    char* saveptr = NULL;
+    const char* prefix = strtok_r(args, " ", &saveptr);
+    if (prefix == NULL) {
+        lwlog_err("Usage: l2 <prefix> [smac=..] [dmac=..] [vlan=<id>] | l2 <prefix> off");
+        return CTL_ERR_INVAL;
+    }
+
+    if (veth_list_slot(&veths, prefix) < 0 || veth_list_queues(&veths, prefix) != 0) {
+        lwlog_err("Unknown port %s or port in direct mode", prefix);
+        return CTL_ERR_NOENT;
+    }
+
+    for (const char* arg = strtok_r(NULL, " ", &saveptr); arg != NULL; arg = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(arg, "off") == 0) {
+            l2.flags = 0;
+            break;
+        }
+        if (port_l2_parse(arg, &l2) <= 0) {
+            lwlog_err("Invalid L2 rewrite for %s: %s", prefix, arg);
+            return CTL_ERR_INVAL;
+        }
+    }
+
+    char outer[IFNAMSIZ];
+    snprintf(outer, IFNAMSIZ, "%s_outer", prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    if (port_l2_set(if_nametoindex(outer), &l2) < 0)
+        return CTL_ERR_SYS;
+
+    lwlog_info("L2 rewrite of %s set to flags 0x%x", prefix, l2.flags);
+    return CTL_OK;
+}
+
+struct batch_port {
+    char prefix[IFNAMSIZ];
+    int slot;
+    int err;          /* Negative errno of the step that failed, 0 while all went fine */
+    const char* step; /* What failed, for the reply */
+};
+
+static void batch_fail(struct batch_port* port, const int err, const char* step) {
+    if (port->err == 0) {
+        port->err = err;
+        port->step = step;
+    }
+}
+
+/* Turns every name into count ports "<name>0".."<name><count-1>", or keeps it as is when count is 0 */
+static int batch_expand(char** names, const int nr_names, const unsigned int count, struct batch_port* ports, const int max) {
+    int n = 0;
+
+    for (int i = 0; i < nr_names; i++) {
+        for (unsigned int j = 0; j < (count ? count : 1) && n < max; j++, n++) {
+            memset(&ports[n], 0, sizeof(ports[n]));
+            ports[n].slot = -1;
+            int len;
+            if (count)
+                len = snprintf(ports[n].prefix, IFNAMSIZ, "%s%u", names[i], j);
+            else
+                len = snprintf(ports[n].prefix, IFNAMSIZ, "%s", names[i]);
+            /* Room for the _inner/_outer suffix */
+            if (len < 0 || len + (int)strlen("_inner") >= IFNAMSIZ)
+                batch_fail(&ports[n], -ENAMETOOLONG, "name");
+        }
+    }
+    return n;
+}
+
+/* Deletes the veth pairs of ports that failed after their pair was created */
+static void batch_rollback(struct batch_port* ports, const int nr, struct rtnl_veth* pairs, int* errs) {
+    int n = 0;
+
+    for (int i = 0; i < nr; i++) {
+        if (ports[i].err == 0 || ports[i].slot < 0)
+            continue;
+        snprintf(pairs[n].ifname, IFNAMSIZ, "%s_inner", ports[i].prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        snprintf(pairs[n].peer, IFNAMSIZ, "%s_outer", ports[i].prefix);    // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        xsk_pool_release(ports[i].prefix);
+        port_prog_detach(pairs[n].ifname, pairs[n].peer);
+        port_l2_clear(if_nametoindex(pairs[n].peer));
+        veth_list_remove(&veths, ports[i].prefix);
+        n++;
+    }
+    if (n > 0)
+        rtnl_link_delete_batch(pairs, n, errs);
+}
+
+/* Switch mode, a port is rings on the daemon's XSKs and nothing needs the kernel in bulk */
+static void batch_create_switch(struct batch_port* ports, const int nr) {
+    for (int i = 0; i < nr; i++) {
+        if (ports[i].err != 0)
+            continue;
+        ports[i].slot = veth_list_add(&veths, ports[i].prefix);
+        if (ports[i].slot < 0) {
+            batch_fail(&ports[i], -EEXIST, "register");
+            continue;
+        }
+        stats_shm_reset(ports[i].slot);
+        if (xsk_switch_add(ports[i].slot, ports[i].prefix) < 0) {
+            batch_fail(&ports[i], -ENOMEM, "switch");
+            veth_list_remove(&veths, ports[i].prefix);
+            ports[i].slot = -1;
+            continue;
+        }
+        if (steer_get_default() == STEER_NO_DEFAULT)
+            steer_set_default(ports[i].slot);
+    }
+}
+
+static void batch_create(struct batch_port* ports, const int nr, const struct port_l2* l2, const unsigned int veth_queues, const bool offload) {
+    struct rtnl_veth* pairs = calloc(nr, sizeof(*pairs));
+    int* pair_port = calloc(nr, sizeof(*pair_port));
+    int* errs = calloc(nr, sizeof(*errs));
+    int* slots = calloc(nr, sizeof(*slots));
+    int* ifindexes = calloc(nr, sizeof(*ifindexes));
+    int n = 0;
+
+    if (pairs == NULL || pair_port == NULL || errs == NULL || slots == NULL || ifindexes == NULL) {
+        for (int i = 0; i < nr; i++)
+            batch_fail(&ports[i], -ENOMEM, "alloc");
+        goto out;
+    }
+
+    for (int i = 0; i < nr; i++) {
+        if (ports[i].err != 0)
+            continue;
+        ports[i].slot = veth_list_add(&veths, ports[i].prefix);
+        if (ports[i].slot < 0) {
+            batch_fail(&ports[i], -EEXIST, "register");
+            continue;
+        }
+        /* A reused slot would keep serving the stats file of its previous port */
+        stats_shm_reset(ports[i].slot);
+        snprintf(pairs[n].ifname, IFNAMSIZ, "%s_inner", ports[i].prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        snprintf(pairs[n].peer, IFNAMSIZ, "%s_outer", ports[i].prefix);    // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        pairs[n].queues = veth_queues;
+        pair_port[n++] = i;
+    }
+
+    lwlog_info("Creating %d veth pairs", n);
+    rtnl_veth_create_batch(pairs, n, errs);
+
+    int nr_live = 0;
+    for (int k = 0; k < n; k++) {
+        struct batch_port* port = &ports[pair_port[k]];
+        if (errs[k]) {
+            batch_fail(port, errs[k], "veth");
+            veth_list_remove(&veths, port->prefix);
+            port->slot = -1;
+            continue;
+        }
+
+        veth_list_set_veth_queues(&veths, port->prefix, veth_queues);
+        if (veth_list_publish(&veths, port->prefix) < 0) {
+            batch_fail(port, -EIO, "registry");
+            continue;
+        }
+        if (!offload) {
+            rtnl_set_csum_offload(pairs[k].ifname, false);
+            rtnl_set_csum_offload(pairs[k].peer, false);
+        }
+        if (port_prog_attach(pairs[k].ifname, pairs[k].peer) < 0) {
+            batch_fail(port, -EINVAL, "xdp");
+            continue;
+        }
+        veth_port_pool_bind(port->prefix, pairs[k].ifname, veth_queues);
+
+        const int ifindex = if_nametoindex(pairs[k].peer);
+        if (l2->flags != 0 && port_l2_set(ifindex, l2) < 0) {
+            batch_fail(port, -EINVAL, "l2");
+            continue;
+        }
+        pair_port[nr_live] = pair_port[k];
+        slots[nr_live] = port->slot;
+        ifindexes[nr_live++] = ifindex;
+    }
+
+    /* Every port goes live in one devmap update */
+    if (update_devmap_batch(slots, ifindexes, errs, nr_live, port_prog_egress_fd()) < 0) {
+        for (int k = 0; k < nr_live; k++)
+            errs[k] = -EIO;
+    }
+    for (int k = 0; k < nr_live; k++) {
+        if (errs[k])
+            batch_fail(&ports[pair_port[k]], errs[k], "devmap");
+        else if (steer_get_default() == STEER_NO_DEFAULT)
+            steer_set_default(slots[k]);
+    }
+
+    batch_rollback(ports, nr, pairs, errs);
+
+out:
+    free(pairs);
+    free(pair_port);
+    free(errs);
+    free(slots);
+    free(ifindexes);
+}
+
+static void batch_delete(struct batch_port* ports, const int nr) {
+    struct rtnl_veth* pairs = calloc(nr, sizeof(*pairs));
+    int* errs = calloc(nr, sizeof(*errs));
+    int* slots = calloc(nr, sizeof(*slots));
+    int* pair_port = calloc(nr, sizeof(*pair_port));
+    bool reassign = false;
+    int n = 0;
+
+    if (pairs == NULL || errs == NULL || slots == NULL || pair_port == NULL) {
+        for (int i = 0; i < nr; i++)
+            batch_fail(&ports[i], -ENOMEM, "alloc");
+        goto out;
+    }
+
+    const __u32 default_slot = steer_get_default();
+    for (int i = 0; i < nr; i++) {
+        if (ports[i].err != 0)
+            continue;
+        ports[i].slot = veth_list_slot(&veths, ports[i].prefix);
+        if (ports[i].slot < 0) {
+            batch_fail(&ports[i], -ENOENT, "lookup");
+            continue;
+        }
+
+        /* Direct mode and switch ports own no interfaces, the single path is as cheap as it gets */
+        if (veth_list_queues(&veths, ports[i].prefix) || xsk_switch_queues(ports[i].slot)) {
+            char prefix[IFNAMSIZ];
+            snprintf(prefix, IFNAMSIZ, "%s", ports[i].prefix);
+            delete_port(prefix);
+            continue;
+        }
+
+        snprintf(pairs[n].ifname, IFNAMSIZ, "%s_inner", ports[i].prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        snprintf(pairs[n].peer, IFNAMSIZ, "%s_outer", ports[i].prefix);    // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        steer_port_flush(ports[i].slot);
+        reassign |= default_slot == (__u32)ports[i].slot;
+        slots[n] = ports[i].slot;
+        pair_port[n++] = i;
+    }
+
+    /* Off the devmap first so the PHY stops redirecting into interfaces about to go */
+    clear_devmap_batch(slots, n);
+
+    for (int k = 0; k < n; k++) {
+        port_l2_clear(if_nametoindex(pairs[k].peer));
+        xsk_pool_release(ports[pair_port[k]].prefix);
+        port_prog_detach(pairs[k].ifname, pairs[k].peer);
+        veth_list_remove(&veths, ports[pair_port[k]].prefix);
+    }
+    if (reassign)
+        steer_default_reassign();
+
+    lwlog_info("Deleting %d veth pairs", n);
+    rtnl_link_delete_batch(pairs, n, errs);
+    for (int k = 0; k < n; k++) {
+        if (errs[k])
+            batch_fail(&ports[pair_port[k]], errs[k], "veth");
+    }
+
+out:
+    free(pairs);
+    free(errs);
+    free(slots);
+    free(pair_port);
+}
+
+// "create|delete <name>.. [count=<n>] [create_port options]", one "<name> OK" or "<name> ERR <step>: <reason>" line per port
+int port_batch(char* args, char* reply, const size_t size) {
+    char* names[MAX_PORTS];
+    struct port_l2 l2 = {0};
+    unsigned int veth_queues = 1;
+    unsigned int count = 0;
+    bool offload = true;
+    int nr_names = 0;
+
+    char* saveptr = NULL;
+    const char* op = strtok_r(args, " ", &saveptr);
+    const bool create = op != NULL && strcmp(op, "create") == 0;
+    if (op == NULL || (!create && strcmp(op, "delete") != 0)) {
+        snprintf(reply, size, "usage: batch create|delete <name>.. [count=<n>] [veth_queues=<n>] [offload=off] [smac=..] [dmac=..] [vlan=..]");
+        return CTL_ERR_INVAL;
+    }
+
+    for (char* arg = strtok_r(NULL, " ", &saveptr); arg != NULL; arg = strtok_r(NULL, " ", &saveptr)) {
+        if (strchr(arg, '=') == NULL) {
+            if (nr_names < MAX_PORTS)
+                names[nr_names++] = arg;
+        } else if (strncmp(arg, "count=", 6) == 0) {
+            count = strtoul(arg + 6, NULL, 10);
+        } else if (strncmp(arg, "veth_queues=", 12) == 0) {
+            veth_queues = strtoul(arg + 12, NULL, 10);
+        } else if (strcmp(arg, "offload=off") == 0) {
+            offload = false;
+        } else if (port_l2_parse(arg, &l2) <= 0) {
+            /* Steering rules and direct mode name a single port, they have no place in a batch */
+            snprintf(reply, size, "unsupported option %s", arg);
+            return CTL_ERR_INVAL;
+        }
+    }
+
+    if (veth_queues == 0 || veth_queues > PORT_XSK_QUEUES) {
+        snprintf(reply, size, "veth_queues out of range");
+        return CTL_ERR_INVAL;
+    }
+
+    /* Per request, batches run on several workers at once */
+    struct batch_port* ports = calloc(MAX_PORTS, sizeof(*ports));
+    if (ports == NULL) {
+        snprintf(reply, size, "out of memory");
+        return CTL_ERR_SYS;
+    }
+
+    const int nr = batch_expand(names, nr_names, count, ports, MAX_PORTS);
+    if (create && xsk_switch_enabled())
+        batch_create_switch(ports, nr);
+    else if (create)
+        batch_create(ports, nr, &l2, veth_queues, offload);
+    else
+        batch_delete(ports, nr);
+
+    int len = 0;
+    int nr_ok = 0;
+    for (int i = 0; i < nr && len >= 0 && (size_t)len < size; i++) {
+        if (ports[i].err == 0) {
+            nr_ok++;
+            len += snprintf(reply + len, size - len, "%s OK\n", ports[i].prefix);
+        } else {
+            len += snprintf(reply + len, size - len, "%s ERR %s: %s\n", ports[i].prefix, ports[i].step, strerror(-ports[i].err));
+        }
+    }
+    if (len >= 0 && (size_t)len < size)
+        len += snprintf(reply + len, size - len, "DONE %d/%d", nr_ok, nr);
+
+    lwlog_info("Batch %s: %d of %d ports done", op, nr_ok, nr);
+    free(ports);
+    return nr_ok == nr ? CTL_OK : CTL_ERR_PARTIAL;
+}
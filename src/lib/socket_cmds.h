@@ -1,7 +1,28 @@
 #pragma once
 
-void create_port(char* prefix);
+#include <stddef.h>
 
-void delete_port(char* prefix);
+/* Command handlers return an enum ctl_status */
+int create_port(char* args);
 
-void unload_list();
\ No newline at end of file
+int delete_port(char* args);
+
+void unload_list();
+/* Deletes the switch ports alone, their rings die with the daemon */
+void unload_switch_ports();
+
+int trace_port(char* args);
+
+/* Swaps every interface to the programs now in obj/ without detaching, writes verification and swap times into reply */
+int xdp_upgrade(char* args, char* reply, size_t size);
+
+int steer_port(char* args);
+
+int rss_port(char* args);
+
+int l2_port(char* args);
+
+int port_binding(const char* prefix, char* buf, size_t size);
+
+/* Creates or deletes many ports in one go, writes one status line per port into reply */
+int port_batch(char* args, char* reply, size_t size);
\ No newline at end of file
@@ -1,3 +1,5 @@
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,61 +7,173 @@
 
 #include "socket_handler.h"
 #include "socket_cmds.h"
+#include "ctl_proto.h"
 #include "lwlog.h"
+#include "stats_shm.h"
+#include "veth_list.h"
+#include "xsk_pool.h"
+#include "xsk_switch.h"
 #include "args.h"
 
 enum { CMD_SIZE = 1024 };
 
-typedef void (*CommandHandler)(char* data);
+typedef int (*CommandHandler)(char* data);
 
 typedef struct {
     char* command;
-    CommandHandler handler;
+    enum ctl_op op;
+    CommandHandler handler; /* NULL for the ops answered in handle_request itself */
+    bool exclusive;         /* Changes state every port depends on, runs with no other command in flight */
 } Command;
 
 Command commands[] = {
-    {"create_port", create_port},
-    {"delete_port", delete_port},
+    {"create_port", CTL_OP_CREATE_PORT, create_port, false},
+    {"delete_port", CTL_OP_DELETE_PORT, delete_port, false},
+    {"trace", CTL_OP_TRACE, trace_port, true},
+    {"steer", CTL_OP_STEER, steer_port, true},
+    {"rss", CTL_OP_RSS, rss_port, true},
+    {"l2", CTL_OP_L2, l2_port, true},
+    {"hello", CTL_OP_HELLO, NULL, false},
+    {"get_phy_if", CTL_OP_GET_PHY_IF, NULL, false},
+    {"get_binding", CTL_OP_GET_BINDING, NULL, false},
+    {"batch", CTL_OP_BATCH, NULL, false},
+    {"attach", CTL_OP_ATTACH, NULL, false},
+    {"upgrade", CTL_OP_UPGRADE, NULL, true},
 };
 
+/* Port provisioning of different clients runs side by side on the worker pool, the rest takes the lock for itself */
+static pthread_rwlock_t ctl_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const Command* command_by_op(const unsigned int op) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(Command); i++) {
+        if (commands[i].op == op)
+            return &commands[i];
+    }
+    return NULL;
+}
+
 int handle_command(const char* command, void* data) {
     for (size_t i = 0; i < sizeof(commands) / sizeof(Command); i++) {
-        if (strcmp(command, commands[i].command) == 0) {
-            commands[i].handler(data);
-            return 0;
+        if (commands[i].handler != NULL && strcmp(command, commands[i].command) == 0) {
+            if (commands[i].exclusive)
+                pthread_rwlock_wrlock(&ctl_lock);
+            else
+                pthread_rwlock_rdlock(&ctl_lock);
+            const int status = commands[i].handler(data);
+            pthread_rwlock_unlock(&ctl_lock);
+            return status;
         }
     }
     return -1;
 }
 
-void handle_client(const int client_socket_fd) {
-    char buffer[CMD_SIZE];
-    long bytes_read;
-    while ((bytes_read = read(client_socket_fd, buffer, sizeof(buffer))) > 0) {
-        buffer[bytes_read] = '\0';
-        const char* command = strtok(buffer, " ");
-        char data[CMD_SIZE] = "";
-        char* possible_data = strtok(NULL, " ");
-        if (possible_data != NULL) {
-            strcpy(data, possible_data);
-        }
+/*
+ * create_port, then everything the client needs to bind: "<phy ifname> <binding>". When the daemon bound the port's XSKs, a
+ * line with their mmap layout follows and fds carries them. A last "stats" line goes with the stats region's descriptor,
+ * which comes after the XSK ones.
+ */
+static int attach_port(char* args, char* reply, const size_t size, struct ctl_fds* fds) {
+    char prefix[CMD_SIZE] = "";
+    sscanf(args, "%1023s", prefix);
 
-        if (strcmp(command, "get_phy_if") == 0) {
-            if (write(client_socket_fd, opts.dev, strlen(opts.dev)) < 0) {
-                perror("write");
-                exit(EXIT_FAILURE);
-            }
-            continue;
-        }
+    const int status = create_port(args);
+    if (status != CTL_OK)
+        return status;
 
-        if (handle_command(command, data) < 0) {
-            lwlog_err("Unknown command: %s", command);
-        }
+    const int len = snprintf(reply, size, "%s ", opts.dev);
+    if (len < 0 || (size_t)len >= size || port_binding(prefix, reply + len, size - len) < 0)
+        return CTL_ERR_SYS;
 
-        if (write(client_socket_fd, "OK", 2) < 0) {
-            perror("write");
-            exit(EXIT_FAILURE);
-        }
+    char layout[CMD_SIZE];
+    if (fds != NULL && (xsk_pool_handover(prefix, fds, layout, sizeof(layout)) == 0 ||
+                        xsk_switch_handover(veth_list_slot(&veths, prefix), fds, layout, sizeof(layout)) == 0)) {
+        const size_t used = strlen(reply);
+        snprintf(reply + used, size - used, "\n%s", layout);
+    }
+
+    if (fds != NULL && stats_shm_handover(veth_list_slot(&veths, prefix), fds, layout, sizeof(layout)) == 0) {
+        const size_t used = strlen(reply);
+        snprintf(reply + used, size - used, "\n%s", layout);
     }
-    close(client_socket_fd);
+    return CTL_OK;
+}
+
+int handle_request(const unsigned int op, char* args, char* reply, const size_t size, struct ctl_fds* fds) {
+    const Command* cmd = command_by_op(op);
+    int status;
+
+    reply[0] = '\0';
+    if (cmd == NULL)
+        return CTL_ERR_OP;
+
+    if (cmd->handler != NULL) {
+        status = handle_command(cmd->command, args);
+        if (status != CTL_OK)
+            snprintf(reply, size, "%s failed, see the daemon log", cmd->command);
+        return status;
+    }
+
+    switch (op) {
+        case CTL_OP_HELLO:
+            snprintf(reply, size, "%d", CTL_VERSION);
+            return CTL_OK;
+        case CTL_OP_GET_PHY_IF:
+            snprintf(reply, size, "%s", opts.dev);
+            return CTL_OK;
+        case CTL_OP_UPGRADE:
+            /* Swaps programs under every port, like trace */
+            pthread_rwlock_wrlock(&ctl_lock);
+            status = xdp_upgrade(args, reply, size);
+            pthread_rwlock_unlock(&ctl_lock);
+            return status;
+        default:
+            break;
+    }
+
+    pthread_rwlock_rdlock(&ctl_lock);
+    if (op == CTL_OP_GET_BINDING) {
+        status = port_binding(args, reply, size) < 0 ? CTL_ERR_NOENT : CTL_OK;
+        if (status != CTL_OK)
+            snprintf(reply, size, "unknown port %s", args);
+    } else if (op == CTL_OP_BATCH) {
+        status = port_batch(args, reply, size);
+    } else {
+        status = attach_port(args, reply, size, fds);
+    }
+    pthread_rwlock_unlock(&ctl_lock);
+    return status;
+}
+
+int handle_line(char* line, char* reply, const size_t size) {
+    char* saveptr = NULL;
+    const char* command = strtok_r(line, " \r\n", &saveptr);
+    char data[CMD_SIZE] = "";
+    char msg[CMD_SIZE];
+
+    if (command == NULL)
+        return snprintf(reply, size, "ERR empty command");
+
+    /* Rest of the line, commands like trace take more than one argument */
+    const char* possible_data = strtok_r(NULL, "\r\n", &saveptr);
+    if (possible_data != NULL)
+        snprintf(data, sizeof(data), "%s", possible_data);
+
+    const Command* cmd = NULL;
+    for (size_t i = 0; i < sizeof(commands) / sizeof(Command) && cmd == NULL; i++) {
+        if (strcmp(command, commands[i].command) == 0)
+            cmd = &commands[i];
+    }
+    if (cmd == NULL) {
+        lwlog_err("Unknown command: %s", command);
+        return snprintf(reply, size, "ERR %s", ctl_strerror(CTL_ERR_OP));
+    }
+
+    /* Text clients get the payload as is, "OK" when there is none, or "ERR <reason>[: <message>]" */
+    const int status = handle_request(cmd->op, data, reply, size, NULL);
+    if (status == CTL_OK || status == CTL_ERR_PARTIAL)
+        return reply[0] != '\0' ? (int)strlen(reply) : snprintf(reply, size, "OK");
+
+    snprintf(msg, sizeof(msg), "%s", reply);
+    const int len = msg[0] != '\0' ? snprintf(reply, size, "ERR %s: %s", ctl_strerror(status), msg) : snprintf(reply, size, "ERR %s", ctl_strerror(status));
+    return len < (int)size ? len : (int)size - 1;
 }
@@ -1,7 +1,17 @@
 #pragma once
 
+#include <stddef.h>
+
+#include "ctl_proto.h"
+
+/* Runs a command by its text name, returns its enum ctl_status or -1 when unknown */
 int handle_command(const char* command, void* data);
 
-void handle_client(const int client_socket_fd);
+/*
+ * Runs one enum ctl_op with its text arguments, writes the reply payload and returns an enum ctl_status. Safe from several
+ * workers. Descriptors for the client land in fds, NULL when the connection can't carry them.
+ */
+int handle_request(unsigned int op, char* args, char* reply, size_t size, struct ctl_fds* fds);
 
-void send_command(const int socket_fd, const char* command);
+/* Runs one control line, safe to call from several workers at once. Writes the reply and returns its length */
+int handle_line(char* line, char* reply, size_t size);
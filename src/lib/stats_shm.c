@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lwlog.h"
+#include "seqlock.h"
+#include "stats_shm.h"
+#include "steer_kern_user.h"
+
+/* Readers give up on a slot after this many torn copies, the writer is rewriting it every STATS_SHM_INTERVAL_MS at most */
+enum { STATS_SHM_READ_TRIES = 8 };
+
+static const size_t region_size = STATS_SHM_SLOT_SIZE * (DEVMAP_SLOTS + 1);
+
+/* Daemon: the header then every slot file mapped side by side, slots without a file read as zeroes */
+static void* region;
+
+/* Client: its own slot only */
+static struct stats_shm_slot* own_slot;
+
+static uint64_t stats_shm_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static struct stats_shm_slot* slot_at(const int slot) {
+    if (region == NULL || slot < 0 || slot >= DEVMAP_SLOTS)
+        return NULL;
+    return (struct stats_shm_slot*)((char*)region + STATS_SHM_SLOT_SIZE * (slot + 1));
+}
+
+static void slot_path(char* path, const size_t size, const int slot) {
+    snprintf(path, size, "%s/%d", STATS_SHM_DIR, slot);
+}
+
+/* Puts fd in place of whatever the window had at off, the replaced file stays with whoever else maps it */
+static int region_map(const size_t off, const size_t size, const int fd) {
+    return mmap((char*)region + off, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ? -1 : 0;
+}
+
+static void stats_shm_remove(void) {
+    char path[PATH_MAX];
+
+    for (int slot = 0; slot < DEVMAP_SLOTS; slot++) {
+        slot_path(path, sizeof(path), slot);
+        unlink(path);
+    }
+    unlink(STATS_SHM_DIR "/header");
+    rmdir(STATS_SHM_DIR);
+}
+
+/* The files a previous daemon left, when their layout matches ours */
+static int stats_shm_reuse(void) {
+    char path[PATH_MAX];
+    struct stats_shm_hdr hdr;
+    struct stat st;
+    int nr = 0;
+
+    const int fd = open(STATS_SHM_DIR "/header", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != STATS_SHM_MAGIC || hdr.version != STATS_SHM_VERSION || hdr.nr_slots != DEVMAP_SLOTS ||
+        hdr.slot_size != STATS_SHM_SLOT_SIZE || hdr.metrics_version != PORT_METRICS_VERSION || region_map(0, STATS_SHM_PAGE, fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    for (int slot = 0; slot < DEVMAP_SLOTS; slot++) {
+        slot_path(path, sizeof(path), slot);
+        const int slot_fd = open(path, O_RDWR | O_CLOEXEC);
+        if (slot_fd < 0)
+            continue;
+        if (fstat(slot_fd, &st) == 0 && (size_t)st.st_size == STATS_SHM_SLOT_SIZE && region_map(STATS_SHM_SLOT_SIZE * (slot + 1), STATS_SHM_SLOT_SIZE, slot_fd) == 0)
+            nr++;
+        close(slot_fd);
+    }
+
+    lwlog_info("Took over port stats in %s, %d slots", STATS_SHM_DIR, nr);
+    return 0;
+}
+
+int stats_shm_create(const bool keep) {
+    /* Reserved once, header and slot files get mapped over it */
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        lwlog_err("Couldn't reserve the port stats window: %s", strerror(errno));
+        return -1;
+    }
+
+    if (keep && stats_shm_reuse() == 0)
+        return 0;
+
+    /* New files rather than truncating the old ones, clients still mapping those would fault */
+    stats_shm_remove();
+    if (mkdir(STATS_SHM_DIR, 0755) < 0) {
+        lwlog_err("Couldn't create %s: %s", STATS_SHM_DIR, strerror(errno));
+        goto err;
+    }
+
+    /* Readable by tools, only the client holding a slot's descriptor from the daemon writes to it */
+    const int fd = open(STATS_SHM_DIR "/header", O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, STATS_SHM_PAGE) < 0 || region_map(0, STATS_SHM_PAGE, fd) < 0) {
+        lwlog_err("Couldn't set up %s/header: %s", STATS_SHM_DIR, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        goto err;
+    }
+    close(fd);
+
+    struct stats_shm_hdr* hdr = region;
+    hdr->version = STATS_SHM_VERSION;
+    hdr->nr_slots = DEVMAP_SLOTS;
+    hdr->slot_size = STATS_SHM_SLOT_SIZE;
+    hdr->metrics_version = PORT_METRICS_VERSION;
+    /* Last, a reader that sees the magic sees the rest of the header */
+    __atomic_store_n(&hdr->magic, STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    lwlog_info("Port stats shared in %s, slots of %zu bytes", STATS_SHM_DIR, STATS_SHM_SLOT_SIZE);
+    return 0;
+
+err:
+    munmap(region, region_size);
+    region = NULL;
+    stats_shm_remove();
+    return -1;
+}
+
+void stats_shm_destroy(const bool keep) {
+    if (region == NULL)
+        return;
+
+    munmap(region, region_size);
+    region = NULL;
+    if (!keep)
+        stats_shm_remove();
+}
+
+void stats_shm_reset(const int slot) {
+    char path[PATH_MAX];
+
+    if (slot_at(slot) == NULL)
+        return;
+
+    /* A new file, a client of the slot's previous port may still be writing into the old one */
+    slot_path(path, sizeof(path), slot);
+    unlink(path);
+    const int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, STATS_SHM_SLOT_SIZE) < 0 || region_map(STATS_SHM_SLOT_SIZE * (slot + 1), STATS_SHM_SLOT_SIZE, fd) < 0)
+        lwlog_err("Couldn't set up stats slot %d: %s", slot, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+int stats_shm_handover(const int slot, struct ctl_fds* fds, char* line, const size_t size) {
+    char path[PATH_MAX];
+
+    if (slot_at(slot) == NULL || fds->nr >= CTL_FDS_MAX)
+        return -1;
+
+    slot_path(path, sizeof(path), slot);
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    fds->fds[fds->nr++] = fd;
+    snprintf(line, size, "stats slot=%d size=%zu version=%d", slot, STATS_SHM_SLOT_SIZE, STATS_SHM_VERSION);
+    return 0;
+}
+
+int stats_shm_read(const int slot, struct port_metrics* out) {
+    const struct stats_shm_slot* s = slot_at(slot);
+    if (s == NULL)
+        return -1;
+
+    for (int i = 0; i < STATS_SHM_READ_TRIES; i++) {
+        const uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0)
+            return -1;
+        if (seq & 1)
+            continue;
+
+        const uint64_t updated = s->updated_ns;
+        memcpy(out, &s->metrics, sizeof(*out));
+        if (seqlock_read_retry(&s->seq, seq))
+            continue;
+
+        if (stats_shm_now() - updated > STATS_SHM_STALE_MS * 1000000ULL || out->version != PORT_METRICS_VERSION)
+            return -1;
+        if (out->nr_queues > METRICS_MAX_QUEUES)
+            out->nr_queues = METRICS_MAX_QUEUES;
+        return 0;
+    }
+    return -1;
+}
+
+int stats_shm_attach(const int fd, const char* line) {
+    int slot;
+    size_t slot_size;
+    int version;
+
+    if (sscanf(line, "stats slot=%d size=%zu version=%d", &slot, &slot_size, &version) != 3 || slot < 0 || version != STATS_SHM_VERSION ||
+        slot_size != STATS_SHM_SLOT_SIZE) {
+        lwlog_warning("Ignoring stats slot from daemon: %s", line);
+        close(fd);
+        return -1;
+    }
+
+    void* map = mmap(NULL, slot_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        lwlog_err("Couldn't map stats slot %d: %s", slot, strerror(errno));
+        return -1;
+    }
+
+    own_slot = map;
+    lwlog_info("Publishing stats into slot %d of %s", slot, STATS_SHM_DIR);
+    return 0;
+}
+
+void stats_shm_publish(const struct port_metrics* metrics) {
+    struct stats_shm_slot* s = own_slot;
+    if (s == NULL)
+        return;
+
+    /* Readers retry while seq is odd or moved on under them */
+    seqlock_write_begin(&s->seq);
+    memcpy(&s->metrics, metrics, sizeof(*metrics));
+    s->updated_ns = stats_shm_now();
+    seqlock_write_end(&s->seq);
+}
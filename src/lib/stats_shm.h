@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ctl_proto.h"
+#include "metrics.h"
+
+/*
+ * Data path counters of every port in shared memory. The daemon creates a directory under /dev/shm with a header file and
+ * one file per port, named after the port's devmap slot, and gives each client a descriptor of its own file at attach. The
+ * client is the only writer of its slot and publishes with a seqlock, so the daemon and any tool mapping the files read every
+ * port with plain loads, no syscall and no round trip to the client.
+ *
+ * Layout: STATS_SHM_DIR/header holds struct stats_shm_hdr in a page, STATS_SHM_DIR/<n> the STATS_SHM_SLOT_SIZE bytes of
+ * slot n. A new port in a slot gets a new file, a client of its previous port keeps writing into the old one.
+ */
+#define STATS_SHM_DIR "/dev/shm/xsknet.stats"
+#define STATS_SHM_MAGIC 0x534b5358 /* "XSKS" */
+/* Bumped whenever the header or slot layout changes, struct port_metrics has its own version */
+#define STATS_SHM_VERSION 2
+#define STATS_SHM_PAGE 4096
+
+/* Clients publish at this interval, slots older than STATS_SHM_STALE_MS belong to a client that went away */
+#define STATS_SHM_INTERVAL_MS 500
+#define STATS_SHM_STALE_MS 5000
+
+struct stats_shm_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nr_slots;
+    uint32_t slot_size;
+    uint32_t metrics_version; /* PORT_METRICS_VERSION of the daemon that laid the region out */
+};
+
+struct stats_shm_slot {
+    uint32_t seq;        /* Odd while the client is writing, 0 until its first publish */
+    uint32_t pad;
+    uint64_t updated_ns; /* CLOCK_MONOTONIC of the last publish */
+    struct port_metrics metrics;
+};
+
+#define STATS_SHM_SLOT_SIZE ((sizeof(struct stats_shm_slot) + STATS_SHM_PAGE - 1) & ~(size_t)(STATS_SHM_PAGE - 1))
+
+/*
+ * Daemon side: creates STATS_SHM_DIR and maps it. With keep, files of the same layout left by a previous daemon are taken
+ * over as they are, their clients go on publishing into them. destroy removes the files, a restart only unmaps them.
+ */
+int stats_shm_create(bool keep);
+void stats_shm_destroy(bool keep);
+
+/* Gives a new port an empty slot file, before its client learns about it */
+void stats_shm_reset(int slot);
+
+/* Appends a descriptor of the slot's file to fds and writes "stats slot=<n> size=<slot size> version=<n>" into line */
+int stats_shm_handover(int slot, struct ctl_fds* fds, char* line, size_t size);
+
+/* Consistent copy of a slot, -1 when its client never published, went stale or kept it busy */
+int stats_shm_read(int slot, struct port_metrics* out);
+
+/* Client side: maps the slot described by the attach reply line from fd, which is closed either way */
+int stats_shm_attach(int fd, const char* line);
+
+/* Publishes a snapshot into the client's slot, a no-op when the daemon handed none over. Single writer */
+void stats_shm_publish(const struct port_metrics* metrics);
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+
+#include "lwlog.h"
+#include "steer.h"
+#include "xdp_utils.h"
+
+int steer_rule_parse(const char* spec, struct steer_key* key) {
+    unsigned int mac[6];
+    char extra;
+
+    memset(key, 0, sizeof(*key));
+
+    if (strncmp(spec, "mac=", 4) == 0) {
+        if (sscanf(spec + 4, "%x:%x:%x:%x:%x:%x%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &extra) != 6)
+            return -1;
+        key->kind = STEER_DST_MAC;
+        for (int i = 0; i < 6; i++) {
+            if (mac[i] > 0xff)
+                return -1;
+            key->dst_mac[i] = mac[i];
+        }
+        return 0;
+    }
+
+    if (strncmp(spec, "ip=", 3) == 0) {
+        key->kind = STEER_DST_IP;
+        return inet_pton(AF_INET, spec + 3, &key->dst_ip) == 1 ? 0 : -1;
+    }
+
+    if (strncmp(spec, "port=", 5) == 0) {
+        char* end;
+        const unsigned long port = strtoul(spec + 5, &end, 10);
+        if (*end != '\0' || port == 0 || port > 0xffff)
+            return -1;
+        key->kind = STEER_L4_PORT;
+        key->l4_port = htons(port);
+        return 0;
+    }
+
+    return -1;
+}
+
+int steer_rule_add(const char* spec, const __u32 slot) {
+    struct steer_key key;
+
+    if (steer_rule_parse(spec, &key)) {
+        lwlog_err("Invalid steering rule: %s", spec);
+        return -1;
+    }
+
+    const int fd = open_phy_map("steer_map");
+    if (fd < 0)
+        return -1;
+
+    const int err = bpf_map_update_elem(fd, &key, &slot, BPF_ANY);
+    if (err)
+        lwlog_err("Couldn't add steering rule %s: %s", spec, strerror(errno));
+    else
+        lwlog_info("Steering %s to slot %u", spec, slot);
+
+    close(fd);
+    return err ? -1 : 0;
+}
+
+int steer_rule_del(const char* spec) {
+    struct steer_key key;
+
+    if (steer_rule_parse(spec, &key)) {
+        lwlog_err("Invalid steering rule: %s", spec);
+        return -1;
+    }
+
+    const int fd = open_phy_map("steer_map");
+    if (fd < 0)
+        return -1;
+
+    const int err = bpf_map_delete_elem(fd, &key);
+    if (err)
+        lwlog_err("Couldn't delete steering rule %s: %s", spec, strerror(errno));
+
+    close(fd);
+    return err ? -1 : 0;
+}
+
+int steer_port_flush(const __u32 slot) {
+    struct steer_key keys[STEER_RULES_MAX];
+    struct steer_key key, next;
+    int n = 0;
+
+    const int fd = open_phy_map("steer_map");
+    if (fd < 0)
+        return -1;
+
+    /* Collect first, deleting while walking with get_next_key restarts the walk */
+    void* prev = NULL;
+    while (n < STEER_RULES_MAX && bpf_map_get_next_key(fd, prev, &next) == 0) {
+        __u32 value;
+        if (bpf_map_lookup_elem(fd, &next, &value) == 0 && value == slot)
+            keys[n++] = next;
+        key = next;
+        prev = &key;
+    }
+
+    for (int i = 0; i < n; i++)
+        bpf_map_delete_elem(fd, &keys[i]);
+
+    close(fd);
+    return n;
+}
+
+int steer_flush_except(const __u64* kept) {
+    struct steer_key keys[STEER_RULES_MAX];
+    struct steer_key key, next;
+    int n = 0;
+
+    const int fd = open_phy_map("steer_map");
+    if (fd < 0)
+        return -1;
+
+    void* prev = NULL;
+    while (n < STEER_RULES_MAX && bpf_map_get_next_key(fd, prev, &next) == 0) {
+        __u32 value;
+        if (bpf_map_lookup_elem(fd, &next, &value) == 0 && (value >= DEVMAP_SLOTS || !(kept[value / 64] & (1ULL << (value % 64)))))
+            keys[n++] = next;
+        key = next;
+        prev = &key;
+    }
+
+    for (int i = 0; i < n; i++)
+        bpf_map_delete_elem(fd, &keys[i]);
+
+    close(fd);
+    return n;
+}
+
+int steer_set_default(const __u32 slot) {
+    const struct steer_cfg cfg = {.default_slot = slot};
+    const __u32 key = 0;
+
+    const int fd = open_phy_map("steer_cfg");
+    if (fd < 0)
+        return -1;
+
+    const int err = bpf_map_update_elem(fd, &key, &cfg, BPF_ANY);
+    if (err)
+        lwlog_err("Couldn't set the default port: %s", strerror(errno));
+
+    close(fd);
+    return err ? -1 : 0;
+}
+
+__u32 steer_get_default(void) {
+    struct steer_cfg cfg = {.default_slot = STEER_NO_DEFAULT};
+    const __u32 key = 0;
+
+    const int fd = open_phy_map("steer_cfg");
+    if (fd < 0)
+        return STEER_NO_DEFAULT;
+
+    bpf_map_lookup_elem(fd, &key, &cfg);
+    close(fd);
+    return cfg.default_slot;
+}
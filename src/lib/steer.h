@@ -0,0 +1,23 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "steer_kern_user.h"
+
+/* Parses "mac=aa:bb:cc:dd:ee:ff", "ip=10.0.0.2" or "port=5000" into a steer_map key */
+int steer_rule_parse(const char* spec, struct steer_key* key);
+
+/* Steers frames matching spec to the port owning slot */
+int steer_rule_add(const char* spec, __u32 slot);
+
+int steer_rule_del(const char* spec);
+
+/* Drops every rule pointing at slot, called when its port goes away */
+int steer_port_flush(__u32 slot);
+
+/* Drops every rule whose slot has no bit in kept, a resumed daemon clears out the ports it didn't get back */
+int steer_flush_except(const __u64* kept);
+
+/* Port receiving IPv4 ICMP no rule matched, STEER_NO_DEFAULT for none */
+int steer_set_default(__u32 slot);
+__u32 steer_get_default(void);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <linux/types.h>
+
+/* max_entries of xdp_devmap, every port owns one slot. Bounds the number of ports */
+#define DEVMAP_SLOTS 4096
+
+#define STEER_RULES_MAX 1024
+
+/* max_entries of phy_xsks_map, PHY RX queues a port can take over in direct mode */
+#define PHY_QUEUES_MAX 64
+
+/* max_entries of the xsks_map each veth port gets, one entry per queue of its inner veth */
+#define PORT_XSK_QUEUES 64
+
+/* steer_cfg.default_slot when no port takes unclassified ICMP */
+#define STEER_NO_DEFAULT 0xffffffff
+
+enum steer_kind {
+    STEER_DST_MAC = 1,
+    STEER_DST_IP = 2,
+    STEER_L4_PORT = 3, /* TCP or UDP destination port */
+};
+
+/*
+ * Key of steer_map, only the field selected by kind is set and everything else must be zero. The PHY program tries the
+ * destination MAC first, then the destination IPv4 address, then the L4 destination port.
+ */
+struct steer_key {
+    __u8 kind;
+    __u8 pad;
+    __u16 l4_port; /* Network byte order */
+    __u32 dst_ip;  /* Network byte order */
+    __u8 dst_mac[6];
+    __u8 pad2[2];
+};
+
+/* Single entry of steer_cfg */
+struct steer_cfg {
+    __u32 default_slot; /* Receives IPv4 ICMP no rule matched, STEER_NO_DEFAULT to pass it to the stack */
+};
@@ -2,54 +2,138 @@
 #include <stdlib.h>
 #include <string.h>
 #include <net/if.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
 
 #include "args.h"
 #include "lwlog.h"
 #include "veth_list.h"
 #include "uthash.h"
+#include "steer_kern_user.h"
+#include "xdp_utils.h"
 
 struct veth_pair* veths = NULL;
 
+/* The control thread edits the list while the metrics thread walks it */
+static pthread_mutex_t veths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Devmap slots in use, guarded by veths_lock */
+static uint64_t slots_used[(DEVMAP_SLOTS + 63) / 64];
+
+/* Lowest free slot, a word of the bitmap at a time */
+static int slot_alloc(void) {
+    for (int word = 0; word < (DEVMAP_SLOTS + 63) / 64; word++) {
+        if (slots_used[word] == ~0ULL)
+            continue;
+        const int slot = word * 64 + __builtin_ctzll(~slots_used[word]);
+        if (slot >= DEVMAP_SLOTS)
+            break;
+        slots_used[word] |= 1ULL << (slot % 64);
+        return slot;
+    }
+    return -1;
+}
+
+static void slot_free(const int slot) {
+    slots_used[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+/* PHY RX queues held by direct mode ports, guarded by veths_lock */
+static uint64_t queues_used;
+
+/* Keys the port is registered under in port_registry, none until it was published. keys holds PHY_QUEUES_MAX */
+static int registry_keys(const struct veth_pair* veth_pair, struct port_key* keys) {
+    int n = 0;
+
+    if (veth_pair->phy_queues != 0 && veth_pair->phy_ifindex != 0) {
+        for (uint32_t queue = 0; queue < PHY_QUEUES_MAX; queue++) {
+            if (veth_pair->phy_queues & (1ULL << queue))
+                keys[n++] = (struct port_key){.ifindex = veth_pair->phy_ifindex, .queue = queue};
+        }
+    } else if (veth_pair->inner_ifindex != 0) {
+        keys[n++] = (struct port_key){.ifindex = veth_pair->inner_ifindex, .queue = PORT_KEY_ANY_QUEUE};
+        keys[n++] = (struct port_key){.ifindex = veth_pair->outer_ifindex, .queue = PORT_KEY_ANY_QUEUE};
+    }
+    return n;
+}
+
+static void registry_delete(const struct port_key* keys, const int nr) {
+    if (nr == 0)
+        return;
+
+    const int fd = open_phy_map("port_registry");
+    if (fd < 0)
+        return;
+    for (int i = 0; i < nr; i++) {
+        if (bpf_map_delete_elem(fd, &keys[i]) && errno != ENOENT)
+            lwlog_warning("Couldn't remove ifindex %u queue %d from port_registry: %s", keys[i].ifindex, (int)keys[i].queue, strerror(errno));
+    }
+    close(fd);
+}
+
 int veth_list_add(struct veth_pair** veth_map, const char* prefix) {
     struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
     HASH_FIND_STR(*veth_map, prefix, veth_pair);
     if (veth_pair != NULL) {
+        pthread_mutex_unlock(&veths_lock);
         lwlog_err("veth pair with prefix %s already exists", prefix);
         return -1;  // Return without freeing if the entry already exists
     }
 
+    const int slot = slot_alloc();
+    if (slot < 0) {
+        pthread_mutex_unlock(&veths_lock);
+        lwlog_err("No devmap slot left for %s, %d ports max", prefix, DEVMAP_SLOTS);
+        return -1;
+    }
+
     struct veth_pair* new_entry = (struct veth_pair*)malloc(sizeof(struct veth_pair));
     if (new_entry == NULL) {
+        slot_free(slot);
+        pthread_mutex_unlock(&veths_lock);
         lwlog_err("malloc: %s", strerror(errno));
         return -1;
     }
 
-    char veth1[IFNAMSIZ];
-    char veth2[IFNAMSIZ];
-    snprintf(veth1, IFNAMSIZ, "%s_inner", prefix);
-    snprintf(veth2, IFNAMSIZ, "%s_outer", prefix);
-
     strncpy(new_entry->prefix, prefix, sizeof(new_entry->prefix) - 1);
     new_entry->prefix[sizeof(new_entry->prefix) - 1] = '\0';  // Ensure null-termination
 
-    new_entry->veth1 = strdup(veth1);
-    new_entry->veth2 = strdup(veth2);
+    snprintf(new_entry->veth1, IFNAMSIZ, "%s_inner", new_entry->prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    snprintf(new_entry->veth2, IFNAMSIZ, "%s_outer", new_entry->prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    new_entry->slot = slot;
+    new_entry->phy_queues = 0;
+    new_entry->veth_queues = 1;
+    new_entry->inner_ifindex = 0;
+    new_entry->outer_ifindex = 0;
+    new_entry->phy_ifindex = 0;
 
     HASH_ADD_STR(*veth_map, prefix, new_entry);
-    veth_list_print(*veth_map);
-    return 0;
+    pthread_mutex_unlock(&veths_lock);
+    return slot;
 }
 
 int veth_list_remove(struct veth_pair** veth_map, const char* prefix) {
     struct veth_pair* veth_pair = NULL;
-    veth_list_print(*veth_map);
+    pthread_mutex_lock(&veths_lock);
     HASH_FIND_STR(*veth_map, prefix, veth_pair);
     if (veth_pair == NULL) {
+        pthread_mutex_unlock(&veths_lock);
         lwlog_err("veth pair with prefix %s does not exist", prefix);
         return -1;
     }
 
     HASH_DEL(*veth_map, veth_pair);
+    slot_free(veth_pair->slot);
+    queues_used &= ~veth_pair->phy_queues;
+    pthread_mutex_unlock(&veths_lock);
+
+    struct port_key keys[PHY_QUEUES_MAX];
+    registry_delete(keys, registry_keys(veth_pair, keys));
     free(veth_pair);
 
     // Set the pointer to NULL to avoid use-after-free
@@ -58,12 +142,200 @@ int veth_list_remove(struct veth_pair** veth_map, const char* prefix) {
     return 0;
 }
 
+int veth_list_slot(struct veth_pair** veth_map, const char* prefix) {
+    struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    const int slot = veth_pair != NULL ? veth_pair->slot : -1;
+    pthread_mutex_unlock(&veths_lock);
+    return slot;
+}
+
+int veth_list_claim_queues(struct veth_pair** veth_map, const char* prefix, const uint64_t queues) {
+    struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    if (veth_pair == NULL || (queues_used & queues)) {
+        pthread_mutex_unlock(&veths_lock);
+        return -1;
+    }
+
+    queues_used |= queues;
+    veth_pair->phy_queues = queues;
+    pthread_mutex_unlock(&veths_lock);
+    return 0;
+}
+
+uint64_t veth_list_queues(struct veth_pair** veth_map, const char* prefix) {
+    struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    const uint64_t queues = veth_pair != NULL ? veth_pair->phy_queues : 0;
+    pthread_mutex_unlock(&veths_lock);
+    return queues;
+}
+
+void veth_list_set_veth_queues(struct veth_pair** veth_map, const char* prefix, const unsigned int queues) {
+    struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    if (veth_pair != NULL)
+        veth_pair->veth_queues = queues;
+    pthread_mutex_unlock(&veths_lock);
+}
+
+unsigned int veth_list_veth_queues(struct veth_pair** veth_map, const char* prefix) {
+    struct veth_pair* veth_pair = NULL;
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    const unsigned int queues = veth_pair != NULL ? veth_pair->veth_queues : 0;
+    pthread_mutex_unlock(&veths_lock);
+    return queues;
+}
+
+int veth_list_publish(struct veth_pair** veth_map, const char* prefix) {
+    struct veth_pair* veth_pair = NULL;
+    struct port_key keys[PHY_QUEUES_MAX];
+    struct port_entry entry = {0};
+    int err = 0;
+
+    const int fd = open_phy_map("port_registry");
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    if (veth_pair == NULL) {
+        err = -1;
+        goto out;
+    }
+
+    if (veth_pair->phy_queues != 0) {
+        veth_pair->phy_ifindex = if_nametoindex(opts.dev);
+        entry.flags = PORT_F_DIRECT;
+    } else {
+        veth_pair->inner_ifindex = if_nametoindex(veth_pair->veth1);
+        veth_pair->outer_ifindex = if_nametoindex(veth_pair->veth2);
+    }
+
+    const int nr_keys = registry_keys(veth_pair, keys);
+    if (nr_keys == 0) {
+        lwlog_err("Interfaces of %s are gone, not publishing it", prefix);
+        err = -1;
+        goto out;
+    }
+
+    snprintf(entry.prefix, sizeof(entry.prefix), "%s", veth_pair->prefix);
+    entry.slot = veth_pair->slot;
+    entry.inner_ifindex = veth_pair->inner_ifindex;
+    entry.outer_ifindex = veth_pair->outer_ifindex;
+    entry.veth_queues = veth_pair->veth_queues;
+    entry.phy_queues = veth_pair->phy_queues;
+
+    /* Published again after a change, the L2 rewrite is port_l2's to keep */
+    struct port_entry old;
+    if (bpf_map_lookup_elem(fd, &keys[0], &old) == 0)
+        entry.l2 = old.l2;
+
+    for (int i = 0; i < nr_keys && err == 0; i++) {
+        err = bpf_map_update_elem(fd, &keys[i], &entry, BPF_ANY);
+        if (err)
+            lwlog_err("Couldn't publish %s to port_registry: %s", prefix, strerror(errno));
+    }
+
+out:
+    pthread_mutex_unlock(&veths_lock);
+    close(fd);
+    return err ? -1 : 0;
+}
+
+int veth_list_restore(struct veth_pair** veth_map, const struct port_entry* entry, const uint32_t phy_ifindex) {
+    struct veth_pair* veth_pair = NULL;
+    const int slot = entry->slot;
+
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, entry->prefix, veth_pair);
+    if (veth_pair != NULL) {
+        /* Direct mode ports are in the registry once per queue */
+        pthread_mutex_unlock(&veths_lock);
+        return 0;
+    }
+
+    if (slot < 0 || slot >= DEVMAP_SLOTS || (slots_used[slot / 64] & (1ULL << (slot % 64))) || (queues_used & entry->phy_queues)) {
+        pthread_mutex_unlock(&veths_lock);
+        lwlog_err("Slot %d or queues 0x%llx of %s already taken", slot, (unsigned long long)entry->phy_queues, entry->prefix);
+        return -1;
+    }
+
+    struct veth_pair* new_entry = calloc(1, sizeof(*new_entry));
+    if (new_entry == NULL) {
+        pthread_mutex_unlock(&veths_lock);
+        lwlog_err("calloc: %s", strerror(errno));
+        return -1;
+    }
+
+    snprintf(new_entry->prefix, sizeof(new_entry->prefix), "%s", entry->prefix);
+    snprintf(new_entry->veth1, IFNAMSIZ, "%s_inner", new_entry->prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    snprintf(new_entry->veth2, IFNAMSIZ, "%s_outer", new_entry->prefix);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    new_entry->slot = slot;
+    new_entry->phy_queues = entry->phy_queues;
+    new_entry->veth_queues = entry->veth_queues;
+    new_entry->inner_ifindex = entry->inner_ifindex;
+    new_entry->outer_ifindex = entry->outer_ifindex;
+    new_entry->phy_ifindex = entry->flags & PORT_F_DIRECT ? phy_ifindex : 0;
+
+    slots_used[slot / 64] |= 1ULL << (slot % 64);
+    queues_used |= entry->phy_queues;
+    HASH_ADD_STR(*veth_map, prefix, new_entry);
+    pthread_mutex_unlock(&veths_lock);
+    return 0;
+}
+
+int veth_list_entry(struct veth_pair** veth_map, const char* prefix, struct port_entry* entry) {
+    struct veth_pair* veth_pair = NULL;
+    struct port_key keys[PHY_QUEUES_MAX];
+    int nr_keys = 0;
+
+    pthread_mutex_lock(&veths_lock);
+    HASH_FIND_STR(*veth_map, prefix, veth_pair);
+    if (veth_pair != NULL)
+        nr_keys = registry_keys(veth_pair, keys);
+    pthread_mutex_unlock(&veths_lock);
+    if (nr_keys == 0)
+        return -1;
+
+    const int fd = open_phy_map("port_registry");
+    if (fd < 0)
+        return -1;
+    const int err = bpf_map_lookup_elem(fd, &keys[0], entry);
+    close(fd);
+    return err ? -1 : 0;
+}
+
 void veth_list_print(struct veth_pair* veth_map) {
     struct veth_pair *current, *tmp;
     lwlog_info("Dumping veth_map");
+    pthread_mutex_lock(&veths_lock);
     HASH_ITER(hh, veth_map, current, tmp) {
-        lwlog_info("veth prefix: %s, veth1: %s, veth2: %s", current->prefix, current->veth1, current->veth2);
+        lwlog_info("veth prefix: %s, veth1: %s, veth2: %s, slot: %d, phy queues: 0x%llx", current->prefix, current->veth1, current->veth2, current->slot,
+                   (unsigned long long)current->phy_queues);
+    }
+    pthread_mutex_unlock(&veths_lock);
+}
+
+/* Copies up to max prefixes out under the lock, returns how many were copied */
+int veth_list_prefixes(struct veth_pair** veth_map, char (*prefixes)[IFNAMSIZ], const int max) {
+    struct veth_pair *current, *tmp;
+    int n = 0;
+
+    pthread_mutex_lock(&veths_lock);
+    HASH_ITER(hh, *veth_map, current, tmp) {
+        if (n == max)
+            break;
+        snprintf(prefixes[n++], IFNAMSIZ, "%s", current->prefix);
     }
+    pthread_mutex_unlock(&veths_lock);
+    return n;
 }
 
 void veth_list_destroy(struct veth_pair* veth_map) {
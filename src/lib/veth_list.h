@@ -1,11 +1,20 @@
 #pragma once
+#include <stdint.h>
+#include <net/if.h>
+
+#include "port_registry_kern_user.h"
 #include "uthash.h"
 
 struct veth_pair {
-    char prefix[16];  // key for the hash table
-    // const char* prefix;
-    char* veth1;
-    char* veth2;
+    char prefix[IFNAMSIZ];  // key for the hash table
+    char veth1[IFNAMSIZ];  // <prefix>_inner
+    char veth2[IFNAMSIZ];  // <prefix>_outer
+    int slot;  // xdp_devmap key the PHY program redirects this port's traffic to
+    uint64_t phy_queues;  // PHY RX queues taken over in direct mode, 0 for a veth port
+    unsigned int veth_queues;  // RX queues of the inner veth, one XSK each
+    uint32_t inner_ifindex;  // Set once published to port_registry, what it is keyed by
+    uint32_t outer_ifindex;
+    uint32_t phy_ifindex;  // Direct mode ports only
     UT_hash_handle hh;  // makes this structure hashable
 };
 
@@ -18,11 +27,39 @@ extern struct veth_pair* veths;
 // Destroy a veth_list struct
 void veth_list_destroy(struct veth_pair* veth_map);
 
-// Add a veth pair to the veth_list
+// Add a veth pair to the veth_list, returns the devmap slot allocated for it or -1
 int veth_list_add(struct veth_pair** veth_map, const char* prefix);
 
 // Remove a veth pair from the veth_list
 int veth_list_remove(struct veth_pair** veth_map, const char* prefix);
 
+// Devmap slot of the veth pair, -1 when unknown
+int veth_list_slot(struct veth_pair** veth_map, const char* prefix);
+
+// Hands the PHY RX queues in the mask to the port, fails when another port holds one of them
+int veth_list_claim_queues(struct veth_pair** veth_map, const char* prefix, uint64_t queues);
+
+// PHY RX queues of a direct mode port, 0 for a veth port
+uint64_t veth_list_queues(struct veth_pair** veth_map, const char* prefix);
+
+// Records how many RX queues the port's inner veth was created with
+void veth_list_set_veth_queues(struct veth_pair** veth_map, const char* prefix, unsigned int queues);
+
+// RX queues of the inner veth, 0 when unknown
+unsigned int veth_list_veth_queues(struct veth_pair** veth_map, const char* prefix);
+
+// Writes the port to the pinned port_registry under every key it is found by, once its interfaces exist. The registry is what
+// the XDP programs and tools see, this list only indexes it by prefix for the control socket
+int veth_list_publish(struct veth_pair** veth_map, const char* prefix);
+
+// Adds a port a previous daemon left in port_registry, keeping its slot. 0 when added or already known, -1 when its slot is taken
+int veth_list_restore(struct veth_pair** veth_map, const struct port_entry* entry, uint32_t phy_ifindex);
+
+// The port's port_registry entry, -1 when unknown or not published yet
+int veth_list_entry(struct veth_pair** veth_map, const char* prefix, struct port_entry* entry);
+
 // Print the veth_list
-void veth_list_print(struct veth_pair* veth_map);
\ No newline at end of file
+void veth_list_print(struct veth_pair* veth_map);
+
+// Copy the prefixes of the veth_list, safe against concurrent add/remove
+int veth_list_prefixes(struct veth_pair** veth_map, char (*prefixes)[IFNAMSIZ], int max);
\ No newline at end of file
@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <net/if.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "args.h"
+#include "lwlog.h"
+#include "metrics.h"
+#include "uthash.h"
+#include "veth_list.h"
+#include "xdp_stats.h"
+#include "xdp_utils.h"
+#include "xsk_stats.h"
+#include "xsk_switch.h"
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+
+enum { MAX_STATS_IFACES = XDP_STATS_IFACES_MAX };
+
+/* The poll thread prints the PHY, the sum over ports and the busiest few of them */
+enum { XDP_STATS_INTERVAL = 2, XDP_STATS_TOP = 5 };
+
+/* Attach modes only change on upgrade or when an interface is recreated, which gets it a new ifindex */
+#define XDP_MODE_CACHE_NS (30ULL * NANOSEC_PER_SEC)
+
+pthread_t xdp_stats_thread = 0;
+
+static const char* xdp_action_names[XDP_ACTION_MAX] = {
+    [XDP_ABORTED] = "ABORTED", [XDP_DROP] = "DROP", [XDP_PASS] = "PASS", [XDP_TX] = "TX", [XDP_REDIRECT] = "REDIRECT",
+};
+
+const char* xdp_action_name(const __u32 action) {
+    return action < XDP_ACTION_MAX ? xdp_action_names[action] : "UNKNOWN";
+}
+
+/* Last reading per interface for the rate view */
+struct xdp_stats_prev {
+    char ifname[IFNAMSIZ];  // key for the hash table
+    uint64_t timestamp;
+    struct datarec rec[XDP_ACTION_MAX];
+    UT_hash_handle hh;
+};
+
+/* Port interface among the busiest of a round */
+struct xdp_stats_top {
+    char ifname[IFNAMSIZ];
+    uint64_t packets;
+};
+
+/* xdp_attached_mode() asks the kernel over netlink, a scrape reuses its answer per interface. Metrics thread only */
+struct xdp_mode_cache {
+    char ifname[IFNAMSIZ];  // key for the hash table
+    unsigned int ifindex;
+    uint64_t checked;
+    uint64_t round;
+    const char* mode;
+    UT_hash_handle hh;
+};
+
+static struct xdp_mode_cache* mode_cache;
+
+/* Entries fetched per batch lookup */
+enum { XDP_STATS_BATCH = 256 };
+
+/* The kernel's own "operation not supported", what older kernels answer batch ops on hash maps with */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+/* Interface of the caller's list, found by name while resolving ifindexes and by ifindex while walking the map */
+struct xdp_stats_iface {
+    char ifname[IFNAMSIZ];
+    unsigned int ifindex;
+    int pos;
+    UT_hash_handle hh;
+    UT_hash_handle hh_index;
+};
+
+static void xdp_stats_add(struct datarec* out, const struct datarec* values, const int nr_cpus) {
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        out->rx_packets += values[cpu].rx_packets;
+        out->rx_bytes += values[cpu].rx_bytes;
+    }
+}
+
+/* Kernels without batch ops on hash maps, one lookup per interface and verdict */
+static int xdp_stats_read_fallback(const int fd, struct xdp_stats_iface* ifaces, const int n, const int nr_cpus, struct datarec* values,
+                                   struct datarec (*recs)[XDP_ACTION_MAX]) {
+    for (int i = 0; i < n; i++) {
+        for (__u32 action = 0; ifaces[i].ifindex != 0 && action < XDP_ACTION_MAX; action++) {
+            const struct xdp_stats_key key = {.ifindex = ifaces[i].ifindex, .action = action};
+            if (bpf_map_lookup_elem(fd, &key, values)) {
+                /* Entries show up with the first frame of that verdict */
+                if (errno == ENOENT)
+                    continue;
+                return -1;
+            }
+            xdp_stats_add(&recs[i][action], values, nr_cpus);
+        }
+    }
+    return 0;
+}
+
+/* Walks the whole map in batches, the count of interfaces doesn't change the count of syscalls much */
+static int xdp_stats_read_batch(const int fd, struct xdp_stats_iface* by_index, const int nr_cpus, struct xdp_stats_key* keys, struct datarec* values,
+                                struct datarec (*recs)[XDP_ACTION_MAX]) {
+    DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, batch_opts);
+    struct xdp_stats_iface* iface;
+    void* in_batch = NULL;
+    __u32 out_batch;
+
+    for (;;) {
+        __u32 count = XDP_STATS_BATCH;
+        const int err = bpf_map_lookup_batch(fd, in_batch, &out_batch, keys, values, &count, &batch_opts);
+        if (err && errno != ENOENT)
+            return -errno;
+
+        for (__u32 i = 0; i < count; i++) {
+            HASH_FIND(hh_index, by_index, &keys[i].ifindex, sizeof(keys[i].ifindex), iface);
+            if (iface != NULL && keys[i].action < XDP_ACTION_MAX)
+                xdp_stats_add(&recs[iface->pos][keys[i].action], &values[(size_t)i * nr_cpus], nr_cpus);
+        }
+        /* ENOENT comes with the last batch */
+        if (err)
+            return 0;
+        in_batch = &out_batch;
+    }
+}
+
+int xdp_stats_read(char (*ifnames)[IFNAMSIZ], const int n, struct datarec (*recs)[XDP_ACTION_MAX], bool* valid) {
+    struct xdp_stats_key keys[XDP_STATS_BATCH];
+    struct xdp_stats_iface *by_name = NULL, *by_index = NULL, *iface;
+    char path[PATH_MAX];
+    int err = -1;
+
+    memset(recs, 0, sizeof(*recs) * n);
+    memset(valid, 0, sizeof(*valid) * n);
+
+    const int len = snprintf(path, sizeof(path), "%s/%s/xdp_stats_map", pin_basedir, opts.dev);
+    if (n > MAX_STATS_IFACES || len < 0 || len >= (int)sizeof(path))
+        return -1;
+
+    /* Nothing pinned before the PHY program is up, that is not worth a log line */
+    const int fd = bpf_obj_get(path);
+    if (fd < 0)
+        return -1;
+
+    /* Per call, the metrics and the poll thread read at the same time */
+    const int nr_cpus = libbpf_num_possible_cpus();
+    struct datarec* values = calloc((size_t)XDP_STATS_BATCH * nr_cpus, sizeof(*values));
+    struct xdp_stats_iface* ifaces = calloc(n > 0 ? n : 1, sizeof(*ifaces));
+    struct if_nameindex* links = if_nameindex();
+    if (values == NULL || ifaces == NULL || links == NULL)
+        goto out;
+
+    /* One link dump resolves every name, instead of an ioctl each */
+    for (int i = 0; i < n; i++) {
+        snprintf(ifaces[i].ifname, sizeof(ifaces[i].ifname), "%s", ifnames[i]);
+        ifaces[i].pos = i;
+        HASH_ADD_STR(by_name, ifname, &ifaces[i]);
+    }
+    for (const struct if_nameindex* link = links; link->if_index != 0; link++) {
+        HASH_FIND_STR(by_name, link->if_name, iface);
+        if (iface == NULL || iface->ifindex != 0)
+            continue;
+        iface->ifindex = link->if_index;
+        HASH_ADD(hh_index, by_index, ifindex, sizeof(iface->ifindex), iface);
+        valid[iface->pos] = true;
+    }
+
+    err = xdp_stats_read_batch(fd, by_index, nr_cpus, keys, values, recs);
+    if (err == -EINVAL || err == -ENOTSUPP || err == -EOPNOTSUPP) {
+        memset(recs, 0, sizeof(*recs) * n);
+        err = xdp_stats_read_fallback(fd, ifaces, n, nr_cpus, values, recs);
+    }
+
+    HASH_CLEAR(hh_index, by_index);
+    HASH_CLEAR(hh, by_name);
+out:
+    if (err)
+        memset(valid, 0, sizeof(*valid) * n);
+    if (links != NULL)
+        if_freenameindex(links);
+    free(ifaces);
+    free(values);
+    close(fd);
+    return err ? -1 : 0;
+}
+
+void xdp_stats_forget(const char* ifname) {
+    const __u32 ifindex = if_nametoindex(ifname);
+    if (ifindex == 0)
+        return;
+
+    const int fd = open_phy_map("xdp_stats_map");
+    if (fd < 0)
+        return;
+
+    /* The next interface to get this ifindex starts from zero */
+    for (__u32 action = 0; action < XDP_ACTION_MAX; action++) {
+        const struct xdp_stats_key key = {.ifindex = ifindex, .action = action};
+        bpf_map_delete_elem(fd, &key);
+    }
+    close(fd);
+}
+
+/* The PHY followed by both ends of every port, prefixes is scratch space of the caller for MAX_STATS_IFACES / 2 names */
+static int xdp_stats_ifnames(char (*ifnames)[IFNAMSIZ], char (*prefixes)[IFNAMSIZ], const int max) {
+    int n = 0;
+
+    snprintf(ifnames[n++], IFNAMSIZ, "%s", opts.dev);
+
+    const int nr_prefixes = veth_list_prefixes(&veths, prefixes, MAX_STATS_IFACES / 2);
+    for (int i = 0; i < nr_prefixes && n + 2 <= max; i++) {
+        /* Direct mode and switch ports are counted by the PHY */
+        if (veth_list_queues(&veths, prefixes[i]) || xsk_switch_queues(veth_list_slot(&veths, prefixes[i])))
+            continue;
+        snprintf(ifnames[n++], IFNAMSIZ, "%s_inner", prefixes[i]);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+        snprintf(ifnames[n++], IFNAMSIZ, "%s_outer", prefixes[i]);  // NOLINT(clang-analyzer-security.insecureAPI.DeprecatedOrUnsafeBufferHandling)
+    }
+    return n;
+}
+
+static const char* xdp_cached_mode(const char* ifname, const uint64_t now, const uint64_t round) {
+    struct xdp_mode_cache* entry;
+
+    const unsigned int ifindex = if_nametoindex(ifname);
+    HASH_FIND_STR(mode_cache, ifname, entry);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL)
+            return xdp_attached_mode(ifname);
+        snprintf(entry->ifname, sizeof(entry->ifname), "%s", ifname);
+        HASH_ADD_STR(mode_cache, ifname, entry);
+    } else if (entry->ifindex == ifindex && now - entry->checked < XDP_MODE_CACHE_NS) {
+        entry->round = round;
+        return entry->mode;
+    }
+
+    entry->ifindex = ifindex;
+    entry->checked = now;
+    entry->round = round;
+    entry->mode = xdp_attached_mode(ifname);
+    return entry->mode;
+}
+
+/* Interfaces that weren't part of the last scrape belong to deleted ports */
+static void xdp_mode_cache_prune(const uint64_t round) {
+    struct xdp_mode_cache *entry, *tmp;
+
+    HASH_ITER(hh, mode_cache, entry, tmp) {
+        if (entry->round != round) {
+            HASH_DEL(mode_cache, entry);
+            free(entry);
+        }
+    }
+}
+
+void xdp_stats_render_metrics(struct metrics_buf* buf) {
+    static uint64_t round;
+    static char ifnames[MAX_STATS_IFACES][IFNAMSIZ];
+    static char prefixes[MAX_STATS_IFACES / 2][IFNAMSIZ];
+    static struct datarec recs[MAX_STATS_IFACES][XDP_ACTION_MAX];
+    static bool valid[MAX_STATS_IFACES];
+
+    const int n = xdp_stats_ifnames(ifnames, prefixes, MAX_STATS_IFACES);
+    /* Interfaces stay without counters when the map can't be read, their attach modes still show */
+    xdp_stats_read(ifnames, n, recs, valid);
+
+    const uint64_t now = gettime();
+    round++;
+    metrics_family(buf, "xsknet_xdp_attach_mode", "gauge", "Mode the XDP program of each interface runs in");
+    for (int i = 0; i < n; i++)
+        metrics_buf_printf(buf, "xsknet_xdp_attach_mode{ifname=\"%s\",mode=\"%s\"} 1\n", ifnames[i], xdp_cached_mode(ifnames[i], now, round));
+    xdp_mode_cache_prune(round);
+
+    metrics_family(buf, "xsknet_xdp_actions", "counter", "XDP verdicts per interface, summed over CPUs");
+    for (int i = 0; i < n; i++) {
+        for (int a = 0; valid[i] && a < XDP_ACTION_MAX; a++) {
+            metrics_buf_printf(buf, "xsknet_xdp_actions_total{ifname=\"%s\",action=\"%s\"} %llu\n", ifnames[i], xdp_action_names[a],
+                               (unsigned long long)recs[i][a].rx_packets);
+        }
+    }
+
+    metrics_family(buf, "xsknet_xdp_action_bytes", "counter", "Bytes per XDP verdict per interface, summed over CPUs");
+    for (int i = 0; i < n; i++) {
+        for (int a = 0; valid[i] && a < XDP_ACTION_MAX; a++) {
+            metrics_buf_printf(buf, "xsknet_xdp_action_bytes_total{ifname=\"%s\",action=\"%s\"} %llu\n", ifnames[i], xdp_action_names[a],
+                               (unsigned long long)recs[i][a].rx_bytes);
+        }
+    }
+}
+
+/* One line per verdict seen during the period, total holds the counters so far and delta what the period added */
+static void xdp_stats_print(const char* label, const struct datarec* total, const struct datarec* delta, double period) {
+    const char* fmt = "XDP %-16s %-9s %'11llu pkts (%'10.0f pps) %'11llu Kbytes (%'6.0f Mbits/s)\n";
+
+    if (period <= 0)
+        period = 1;
+
+    for (int a = 0; a < XDP_ACTION_MAX; a++) {
+        if (delta[a].rx_packets == 0)
+            continue;
+
+        printf(fmt, label, xdp_action_names[a], (unsigned long long)total[a].rx_packets, delta[a].rx_packets / period,
+               (unsigned long long)total[a].rx_bytes / 1000, (delta[a].rx_bytes * 8) / period / 1000000);
+    }
+}
+
+/* Keeps top sorted by packets, XDP_STATS_TOP entries at most */
+static void xdp_stats_rank(struct xdp_stats_top* top, int* nr, const char* ifname, const uint64_t packets) {
+    int i = *nr;
+
+    if (packets == 0)
+        return;
+    if (i == XDP_STATS_TOP) {
+        if (packets <= top[i - 1].packets)
+            return;
+        i--;
+    } else {
+        (*nr)++;
+    }
+
+    for (; i > 0 && top[i - 1].packets < packets; i--)
+        top[i] = top[i - 1];
+    snprintf(top[i].ifname, sizeof(top[i].ifname), "%s", ifname);
+    top[i].packets = packets;
+}
+
+/*
+ * Every XDP_STATS_INTERVAL seconds: the PHY's verdicts, then those of all port interfaces summed up and the busiest
+ * XDP_STATS_TOP of them. Per-interface counters of every port are in the metrics.
+ */
+void* xdp_stats_poll(void* exit_flag) {
+    static char ifnames[MAX_STATS_IFACES][IFNAMSIZ];
+    static char prefixes[MAX_STATS_IFACES / 2][IFNAMSIZ];
+    static struct datarec recs[MAX_STATS_IFACES][XDP_ACTION_MAX];
+    static bool valid[MAX_STATS_IFACES];
+    struct xdp_stats_prev *prevs = NULL, *prev, *tmp;
+    struct datarec delta[XDP_ACTION_MAX];
+    struct datarec ports_total[XDP_ACTION_MAX], ports_delta[XDP_ACTION_MAX];
+    struct xdp_stats_top top[XDP_STATS_TOP];
+
+    /* Trick to pretty printf with thousands separators use %' */
+    setlocale(LC_NUMERIC, "en_US");
+
+    while (*(int*)exit_flag == 0) {
+        sleep(XDP_STATS_INTERVAL);
+
+        int nr_top = 0, nr_ports = 0;
+        double period = XDP_STATS_INTERVAL;
+        memset(ports_total, 0, sizeof(ports_total));
+        memset(ports_delta, 0, sizeof(ports_delta));
+
+        const int n = xdp_stats_ifnames(ifnames, prefixes, MAX_STATS_IFACES);
+        if (xdp_stats_read(ifnames, n, recs, valid))
+            continue;
+
+        for (int i = 0; i < n; i++) {
+            const struct datarec* rec = recs[i];
+            if (!valid[i])
+                continue;
+
+            const uint64_t now = gettime();
+            HASH_FIND_STR(prevs, ifnames[i], prev);
+            if (prev == NULL) {
+                prev = calloc(1, sizeof(*prev));
+                if (prev == NULL)
+                    continue;
+                snprintf(prev->ifname, sizeof(prev->ifname), "%s", ifnames[i]);
+                HASH_ADD_STR(prevs, ifname, prev);
+                /* First reading, its period starts now */
+                memcpy(prev->rec, rec, sizeof(prev->rec));
+            }
+
+            uint64_t packets = 0;
+            for (int a = 0; a < XDP_ACTION_MAX; a++) {
+                delta[a].rx_packets = rec[a].rx_packets - prev->rec[a].rx_packets;
+                delta[a].rx_bytes = rec[a].rx_bytes - prev->rec[a].rx_bytes;
+                packets += delta[a].rx_packets;
+            }
+            if (prev->timestamp != 0)
+                period = (double)(now - prev->timestamp) / NANOSEC_PER_SEC;
+
+            /* The PHY comes first */
+            if (i == 0) {
+                xdp_stats_print(ifnames[i], rec, delta, period);
+            } else {
+                for (int a = 0; a < XDP_ACTION_MAX; a++) {
+                    ports_total[a].rx_packets += rec[a].rx_packets;
+                    ports_total[a].rx_bytes += rec[a].rx_bytes;
+                    ports_delta[a].rx_packets += delta[a].rx_packets;
+                    ports_delta[a].rx_bytes += delta[a].rx_bytes;
+                }
+                xdp_stats_rank(top, &nr_top, ifnames[i], packets);
+                nr_ports++;
+            }
+
+            prev->timestamp = now;
+            memcpy(prev->rec, rec, sizeof(prev->rec));
+        }
+
+        if (nr_ports > 0) {
+            char label[IFNAMSIZ];
+            snprintf(label, sizeof(label), "%d port ifs", nr_ports);
+            xdp_stats_print(label, ports_total, ports_delta, period);
+        }
+        for (int i = 0; i < nr_top; i++)
+            printf("XDP %-16s %-9s %'11.0f pps\n", top[i].ifname, "busiest", top[i].packets / period);
+    }
+
+    HASH_ITER(hh, prevs, prev, tmp) {
+        HASH_DEL(prevs, prev);
+        free(prev);
+    }
+
+    lwlog_info("Exiting XDP stats thread");
+    return NULL;
+}
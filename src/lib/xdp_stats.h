@@ -0,0 +1,28 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <net/if.h>
+
+#include "xdp_stats_kern_user.h"
+
+struct metrics_buf;
+
+extern pthread_t xdp_stats_thread;
+
+const char* xdp_action_name(__u32 action);
+
+/*
+ * Sums the per-CPU counters of the n interfaces in ifnames into recs out of the xdp_stats_map pinned for the PHY, in one
+ * walk over the map. valid[i] is false for interfaces that don't exist
+ */
+int xdp_stats_read(char (*ifnames)[IFNAMSIZ], int n, struct datarec (*recs)[XDP_ACTION_MAX], bool* valid);
+
+/* Drops the counters of ifname, called before the interface goes away */
+void xdp_stats_forget(const char* ifname);
+
+/* XDP verdict counters of the PHY and every port interface, for the daemon's metrics endpoint */
+void xdp_stats_render_metrics(struct metrics_buf* buf);
+
+/* Daemon thread printing per-interface XDP verdict rates */
+void* xdp_stats_poll(void* exit_flag);
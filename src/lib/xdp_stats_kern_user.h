@@ -0,0 +1,28 @@
+#pragma once
+
+#include <linux/bpf.h>
+#include <linux/types.h>
+
+#include "steer_kern_user.h"
+
+/*
+ * Entries of xdp_stats_map are created on first use, this bounds the interfaces counted at once: the PHY and both ends of
+ * every port. The map isn't preallocated, its memory follows the interfaces that saw traffic
+ */
+#define XDP_STATS_IFACES_MAX (2 * DEVMAP_SLOTS + 1)
+
+/* Key of xdp_stats_map, a single map shared by the PHY program and every port program */
+struct xdp_stats_key {
+    __u32 ifindex;
+    __u32 action;
+};
+
+/* Per-CPU value of xdp_stats_map */
+struct datarec {
+    __u64 rx_packets;
+    __u64 rx_bytes;
+};
+
+#ifndef XDP_ACTION_MAX
+#define XDP_ACTION_MAX (XDP_REDIRECT + 1)
+#endif
@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/limits.h>
+#include <net/if.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "lwlog.h"
+#include "xdp_stats.h"
+#include "xdp_trace.h"
+#include "xdp_utils.h"
+
+enum { TRACE_POLL_TIMEOUT_MS = 500 };
+
+pthread_t xdp_trace_thread = 0;
+
+static int trace_events_fd = -1;
+static int trace_cfg_fd = -1;
+static bool tracing = false;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* trace_hook_names[] = {
+    [XDP_TRACE_HOOK_PHY] = "phy",
+    [XDP_TRACE_HOOK_XSK] = "xsk",
+    [XDP_TRACE_HOOK_DUMMY] = "dummy",
+};
+
+int xdp_trace_init(void) {
+    trace_events_fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "trace_events", 0, 0, XDP_TRACE_RINGBUF_SIZE, NULL);
+    if (trace_events_fd < 0) {
+        lwlog_err("Couldn't create trace ring buffer: %s", strerror(errno));
+        return EXIT_FAIL_BPF;
+    }
+
+    trace_cfg_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "trace_cfg", sizeof(__u32), sizeof(struct xdp_trace_cfg), 1, NULL);
+    if (trace_cfg_fd < 0) {
+        lwlog_err("Couldn't create trace config map: %s", strerror(errno));
+        close(trace_events_fd);
+        trace_events_fd = -1;
+        return EXIT_FAIL_BPF;
+    }
+
+    return EXIT_OK;
+}
+
+void xdp_obj_path(char* buf, const size_t size, const char* name) {
+    pthread_mutex_lock(&trace_lock);
+    snprintf(buf, size, "obj/%s%s.o", name, tracing ? "_trace" : "");
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int xdp_trace_reuse_maps(struct bpf_object* obj) {
+    struct bpf_map* map;
+
+    bpf_object__for_each_map(map, obj) {
+        const char* name = bpf_map__name(map);
+        int fd = -1;
+
+        if (strcmp(name, "trace_events") == 0)
+            fd = trace_events_fd;
+        else if (strcmp(name, "trace_cfg") == 0)
+            fd = trace_cfg_fd;
+        else
+            continue;
+
+        if (fd < 0) {
+            lwlog_err("Tracing object loaded without xdp_trace_init()");
+            return EXIT_FAIL_BPF;
+        }
+
+        const int err = bpf_map__reuse_fd(map, fd);
+        if (err) {
+            lwlog_err("Couldn't reuse %s: %s", name, strerror(-err));
+            return EXIT_FAIL_BPF;
+        }
+    }
+
+    return EXIT_OK;
+}
+
+int xdp_trace_set(const bool on, const unsigned int sample_rate) {
+    struct xdp_trace_cfg cfg = {0};
+    const __u32 key = 0;
+
+    if (trace_cfg_fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&trace_lock);
+
+    /* Keep the drop counter, only the rate is ours to change */
+    bpf_map_lookup_elem(trace_cfg_fd, &key, &cfg);
+    cfg.sample_rate = on ? sample_rate : 0;
+    if (bpf_map_update_elem(trace_cfg_fd, &key, &cfg, BPF_ANY)) {
+        lwlog_err("Couldn't update trace_cfg: %s", strerror(errno));
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    const int swap = tracing != on;
+    tracing = on;
+
+    pthread_mutex_unlock(&trace_lock);
+    return swap;
+}
+
+void xdp_trace_unpin(const char* ifname) {
+    const char* maps[] = {"trace_events", "trace_cfg"};
+    char path[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", pin_basedir, ifname, maps[i]);
+        if (unlink(path) && errno != ENOENT)
+            lwlog_warning("Couldn't unpin %s: %s", path, strerror(errno));
+    }
+}
+
+static int xdp_trace_event_print(void* ctx, void* data, size_t size) {
+    const struct xdp_trace_event* ev = data;
+    char ifname[IF_NAMESIZE] = "?";
+    char saddr[INET_ADDRSTRLEN] = "-";
+    char daddr[INET_ADDRSTRLEN] = "-";
+
+    if (size < sizeof(*ev))
+        return 0;
+
+    if_indextoname(ev->ifindex, ifname);
+    if (ev->h_proto == htons(ETH_P_IP)) {
+        inet_ntop(AF_INET, &ev->saddr, saddr, sizeof(saddr));
+        inet_ntop(AF_INET, &ev->daddr, daddr, sizeof(daddr));
+    }
+
+    const char* hook = ev->hook < sizeof(trace_hook_names) / sizeof(trace_hook_names[0]) ? trace_hook_names[ev->hook] : "?";
+
+    printf("TRACE %llu.%06llu %-5s %-16s q%-3u %5u bytes %-8s %02x:%02x:%02x:%02x:%02x:%02x > %02x:%02x:%02x:%02x:%02x:%02x 0x%04x %s > %s proto %u\n",
+           (unsigned long long)(ev->timestamp / 1000000000), (unsigned long long)(ev->timestamp % 1000000000 / 1000), hook, ifname, ev->rx_queue, ev->pkt_len,
+           xdp_action_name(ev->verdict), ev->h_source[0], ev->h_source[1], ev->h_source[2], ev->h_source[3], ev->h_source[4], ev->h_source[5], ev->h_dest[0],
+           ev->h_dest[1], ev->h_dest[2], ev->h_dest[3], ev->h_dest[4], ev->h_dest[5], ntohs(ev->h_proto), saddr, daddr, ev->protocol);
+    return 0;
+}
+
+static __u64 xdp_trace_dropped(void) {
+    struct xdp_trace_cfg cfg = {0};
+    const __u32 key = 0;
+
+    bpf_map_lookup_elem(trace_cfg_fd, &key, &cfg);
+    return cfg.dropped;
+}
+
+void* xdp_trace_poll(void* exit_flag) {
+    struct ring_buffer* rb = ring_buffer__new(trace_events_fd, xdp_trace_event_print, NULL, NULL);
+    if (rb == NULL) {
+        lwlog_err("Couldn't open trace ring buffer: %s", strerror(errno));
+        return NULL;
+    }
+
+    __u64 dropped = 0;
+    while (*(int*)exit_flag == 0) {
+        const int err = ring_buffer__poll(rb, TRACE_POLL_TIMEOUT_MS);
+        if (err < 0 && err != -EINTR) {
+            lwlog_err("ring_buffer__poll: %s", strerror(-err));
+            break;
+        }
+
+        const __u64 now = xdp_trace_dropped();
+        if (now != dropped) {
+            lwlog_warning("Trace ring buffer full, %llu samples lost", (unsigned long long)(now - dropped));
+            dropped = now;
+        }
+    }
+
+    ring_buffer__free(rb);
+    lwlog_info("Exiting XDP trace thread");
+    return NULL;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "xdp_trace_kern_user.h"
+
+struct bpf_object;
+
+extern pthread_t xdp_trace_thread;
+
+/* Creates the ring buffer and config map shared by all tracing objects, daemon only */
+int xdp_trace_init(void);
+
+/* "obj/<name>.o", or "obj/<name>_trace.o" while tracing is on */
+void xdp_obj_path(char* buf, size_t size, const char* name);
+
+/* Points trace_events and trace_cfg of a tracing object at the daemon's maps, no-op for production objects */
+int xdp_trace_reuse_maps(struct bpf_object* obj);
+
+/* Sets the sample rate, returns 1 when the object variant has to be swapped, 0 when not and -1 on error */
+int xdp_trace_set(bool on, unsigned int sample_rate);
+
+/* Removes the trace map pins a tracing object left under ifname */
+void xdp_trace_unpin(const char* ifname);
+
+/* Daemon thread decoding sampled packets from the ring buffer */
+void* xdp_trace_poll(void* exit_flag);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <linux/types.h>
+
+/* Shared by every *_trace.o object, created once by the daemon and reused by fd on each load */
+#define XDP_TRACE_RINGBUF_SIZE (256 * 1024)
+
+/* Sample one packet in this many when "trace on" is sent without a rate */
+#define XDP_TRACE_DEFAULT_RATE 100
+
+enum xdp_trace_hook {
+    XDP_TRACE_HOOK_PHY = 0,
+    XDP_TRACE_HOOK_XSK = 1,
+    XDP_TRACE_HOOK_DUMMY = 2,
+};
+
+/* Single entry of trace_cfg */
+struct xdp_trace_cfg {
+    __u32 sample_rate; /* 0 disables sampling, 1 samples every packet */
+    __u32 pad;
+    __u64 dropped; /* Samples lost to a full ring buffer */
+};
+
+/* One sampled packet, written into trace_events by the tracing objects */
+struct xdp_trace_event {
+    __u64 timestamp; /* bpf_ktime_get_ns() */
+    __u32 ifindex;
+    __u32 rx_queue;
+    __u32 pkt_len;
+    __u32 verdict;
+    __u32 saddr; /* Network byte order, 0 unless IPv4 */
+    __u32 daddr;
+    __u16 h_proto; /* Network byte order */
+    __u8 protocol;
+    __u8 hook;
+    __u8 h_source[6];
+    __u8 h_dest[6];
+};
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -9,13 +10,19 @@
 #include <xdp/libxdp.h>
 
 #include <linux/if_link.h> /* Need XDP flags */
+#include <linux/ethtool.h>
+#include <linux/limits.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "lwlog.h"
+#include "phase_prof.h"
+#include "steer_kern_user.h"
+#include "xdp_trace.h"
 #include "xdp_utils.h"
 #include "args.h"
 
-enum { PATH_MAX = 4096 };
-
 /* Pinning maps under /sys/fs/bpf in subdir */
 int pin_maps_in_bpf_object(struct bpf_object* bpf_obj, const char* subdir, const char* map_name) {
     if (bpf_obj == NULL) {
@@ -52,11 +59,14 @@ int pin_maps_in_bpf_object(struct bpf_object* bpf_obj, const char* subdir, const
     if (access(map_filename, F_OK) != -1) {
         lwlog_info("Unpinning (remove) prev maps in %s/", pin_dir);
 
-        /* Basically calls unlink(3) on map_filename */
-        err = bpf_object__unpin_maps(bpf_obj, pin_dir);
-        if (err) {
-            lwlog_err("UNpinning maps in %s", pin_dir);
-            return EXIT_FAIL_BPF;
+        /* Unlink one by one, the previous object may have been the other variant with a different set of maps */
+        struct bpf_map* map;
+        bpf_object__for_each_map(map, bpf_obj) {
+            len = snprintf(map_filename, PATH_MAX, "%s/%s", pin_dir, bpf_map__name(map));
+            if (len < 0 || len >= PATH_MAX || (unlink(map_filename) && errno != ENOENT)) {
+                lwlog_err("UNpinning maps in %s", pin_dir);
+                return EXIT_FAIL_BPF;
+            }
         }
     }
     lwlog_info("Pinning maps in %s/", pin_dir);
@@ -137,7 +147,127 @@ int open_bpf_map_file(const char* pin_dir, const char* mapname, struct bpf_map_i
     return fd;
 }
 
-int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, const char* progname, const char* map_name) {
+/* Hands the object the maps pinned for ifname by the program it replaces, when they are compatible */
+int reuse_pinned_maps(struct bpf_object* bpf_obj, const char* ifname) {
+    char path[PATH_MAX];
+    struct bpf_map* map;
+
+    bpf_object__for_each_map(map, bpf_obj) {
+        /* .rodata and friends belong to the object that created them */
+        if (bpf_map__is_internal(map))
+            continue;
+
+        const int len = snprintf(path, PATH_MAX, "%s/%s/%s", pin_basedir, ifname, bpf_map__name(map));
+        if (len < 0 || len >= PATH_MAX)
+            return EXIT_FAIL_OPTION;
+
+        const int fd = bpf_obj_get(path);
+        if (fd < 0)
+            continue;
+
+        struct bpf_map_info info = {0};
+        __u32 info_len = sizeof(info);
+        if (bpf_obj_get_info_by_fd(fd, &info, &info_len) || info.type != bpf_map__type(map) || info.key_size != bpf_map__key_size(map) ||
+            info.value_size != bpf_map__value_size(map) || info.max_entries != bpf_map__max_entries(map)) {
+            lwlog_warning("Not reusing incompatible map %s", path);
+            close(fd);
+            continue;
+        }
+
+        const int err = bpf_map__reuse_fd(map, fd);
+        close(fd);
+        if (err) {
+            lwlog_err("Couldn't reuse %s: %s", path, strerror(-err));
+            return EXIT_FAIL_BPF;
+        }
+    }
+
+    return EXIT_OK;
+}
+
+static const char* xdp_mode_name(const enum xdp_attach_mode mode) {
+    switch (mode) {
+        case XDP_MODE_NATIVE:
+            return "native";
+        case XDP_MODE_SKB:
+            return "generic";
+        case XDP_MODE_HW:
+            return "offload";
+        default:
+            return "none";
+    }
+}
+
+const char* xdp_attached_mode(const char* ifname) {
+    const int ifindex = if_nametoindex(ifname);
+    if (!ifindex)
+        return "none";
+
+    struct xdp_multiprog* mp = xdp_multiprog__get_from_ifindex(ifindex);
+    if (libxdp_get_error(mp) || !mp)
+        return "none";
+
+    const char* name = xdp_mode_name(xdp_multiprog__attach_mode(mp));
+    xdp_multiprog__close(mp);
+    return name;
+}
+
+/* Attaches in driver mode unless --xdp-mode says otherwise, generic mode runs after the skb is built and is several times slower */
+static int attach_xdp(struct xdp_program* prog, const int ifindex, const char* ifname) {
+    enum xdp_attach_mode mode = opts.xdp_mode == XDP_POLICY_GENERIC ? XDP_MODE_SKB : XDP_MODE_NATIVE;
+
+    int err = xdp_program__attach(prog, ifindex, mode, 0);
+    if (err && mode == XDP_MODE_NATIVE && opts.xdp_mode == XDP_POLICY_PREFER_NATIVE) {
+        lwlog_warning("Native XDP unavailable on %s (%s), falling back to generic mode", ifname, strerror(-err));
+        mode = XDP_MODE_SKB;
+        err = xdp_program__attach(prog, ifindex, mode, 0);
+    }
+
+    if (err) {
+        lwlog_err("Couldn't attach XDP to %s in %s mode: %s", ifname, xdp_mode_name(mode), strerror(-err));
+        return err;
+    }
+
+    lwlog_info("XDP attached to %s in %s mode", ifname, xdp_mode_name(mode));
+    return 0;
+}
+
+int attach_xdp_fd(const int prog_fd, const char* ifname) {
+    const int ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        lwlog_err("if_nametoindex(%s)", ifname);
+        return -1;
+    }
+
+    /* Replaces whatever runs in the same mode, so a new variant goes live without a window */
+    enum xdp_attach_mode mode = opts.xdp_mode == XDP_POLICY_GENERIC ? XDP_MODE_SKB : XDP_MODE_NATIVE;
+    int err = bpf_xdp_attach(ifindex, prog_fd, mode == XDP_MODE_SKB ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE, NULL);
+    if (err && mode == XDP_MODE_NATIVE && opts.xdp_mode == XDP_POLICY_PREFER_NATIVE) {
+        lwlog_warning("Native XDP unavailable on %s (%s), falling back to generic mode", ifname, strerror(-err));
+        mode = XDP_MODE_SKB;
+        err = bpf_xdp_attach(ifindex, prog_fd, XDP_FLAGS_SKB_MODE, NULL);
+    }
+
+    if (err) {
+        lwlog_err("Couldn't attach XDP to %s in %s mode: %s", ifname, xdp_mode_name(mode), strerror(-err));
+        return err;
+    }
+
+    lwlog_info("XDP attached to %s in %s mode", ifname, xdp_mode_name(mode));
+    return 0;
+}
+
+void detach_xdp_fd(const char* ifname) {
+    const int ifindex = if_nametoindex(ifname);
+    if (!ifindex)
+        return;
+
+    /* Only the mode the program runs in has something to detach */
+    bpf_xdp_detach(ifindex, XDP_FLAGS_DRV_MODE, NULL);
+    bpf_xdp_detach(ifindex, XDP_FLAGS_SKB_MODE, NULL);
+}
+
+static int load_xdp(const char* ifname, const char* filename, const char* progname, const char* map_name, const bool reuse_maps) {
     lwlog_info("Loading XDP program %s on interface %s", filename, ifname);
     if (ifname == NULL) {
         lwlog_err("ifname is NULL");
@@ -161,6 +291,9 @@ int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, cons
     xdp_opts.prog_name = progname;
     xdp_opts.opts = &opts;
 
+    struct phase_clock clock;
+    phase_clock_start(&clock);
+
     struct xdp_program* prog = xdp_program__create(&xdp_opts);
     int err = libxdp_get_error(prog);
     if (err) {
@@ -171,9 +304,17 @@ int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, cons
     }
     int ifindex = if_nametoindex(ifname);
 
-    err = xdp_program__attach(prog, ifindex, 0, 0);
+    err = xdp_trace_reuse_maps(xdp_program__bpf_obj(prog));
+    if (err == EXIT_OK && reuse_maps)
+        err = reuse_pinned_maps(xdp_program__bpf_obj(prog), ifname);
     if (err) {
-        lwlog_err("loading program: %s\n", strerror(-err));
+        xdp_program__close(prog);
+        return err;
+    }
+
+    err = attach_xdp(prog, ifindex, ifname);
+    if (err) {
+        xdp_program__close(prog);
         return EXIT_FAIL_BPF;
     }
 
@@ -182,6 +323,7 @@ int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, cons
         lwlog_err("xdp_program__fd failed: %s\n", strerror(errno));
         return EXIT_FAIL_BPF;
     }
+    phase_clock_mark(&clock, PHASE_XDP_LOAD);
 
     if (map_name == NULL) {
         lwlog_info("No map name specified for %s, not pinning maps", ifname);
@@ -194,13 +336,178 @@ int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, cons
         lwlog_err("ERR: pinning maps in %s", ifname);
         return err;
     }
+    phase_clock_mark(&clock, PHASE_PIN_MAPS);
 
     return EXIT_OK;
 }
 
-int update_devmap(int ifindex, char* ifname) {
+int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, const char* progname, const char* map_name) {
+    return load_xdp(ifname, filename, progname, map_name, false);
+}
+
+/* Loads only progname out of obj_path on top of the maps pinned for ifname */
+static int load_prog_on(const char* obj_path, const char* progname, const char* ifname, struct bpf_object** obj_out) {
+    struct bpf_program* prog;
+    struct bpf_program* wanted = NULL;
+
+    struct bpf_object* obj = bpf_object__open_file(obj_path, NULL);
+    if (libbpf_get_error(obj)) {
+        lwlog_err("Couldn't open %s", obj_path);
+        return -1;
+    }
+
+    bpf_object__for_each_program(prog, obj) {
+        const bool is_wanted = strcmp(bpf_program__name(prog), progname) == 0;
+        bpf_program__set_autoload(prog, is_wanted);
+        if (is_wanted)
+            wanted = prog;
+    }
+
+    if (wanted == NULL || reuse_pinned_maps(obj, ifname) != EXIT_OK || xdp_trace_reuse_maps(obj) != EXIT_OK) {
+        lwlog_err("Couldn't prepare %s from %s", progname, obj_path);
+        bpf_object__close(obj);
+        return -1;
+    }
+
+    const int err = bpf_object__load(obj);
+    if (err) {
+        lwlog_err("Couldn't load %s: %s", progname, strerror(-err));
+        bpf_object__close(obj);
+        return -1;
+    }
+
+    *obj_out = obj;
+    return bpf_program__fd(wanted);
+}
+
+/* Same map behind both descriptors */
+static bool same_map(const int a, const int b) {
+    struct bpf_map_info info_a = {0};
+    struct bpf_map_info info_b = {0};
+    __u32 len_a = sizeof(info_a);
+    __u32 len_b = sizeof(info_b);
+
+    return !bpf_obj_get_info_by_fd(a, &info_a, &len_a) && !bpf_obj_get_info_by_fd(b, &info_b, &len_b) && info_a.id == info_b.id;
+}
+
+/*
+ * Name of the first pinned map obj couldn't share, its layout changed. Swapping such an object in would start it on an
+ * empty map, steering rules and devmap slots gone until someone refills them.
+ */
+static const char* changed_map(struct bpf_object* obj, const char* ifname) {
+    char path[PATH_MAX];
+    struct bpf_map* map;
+
+    bpf_object__for_each_map(map, obj) {
+        if (bpf_map__is_internal(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", pin_basedir, ifname, bpf_map__name(map));
+
+        const int pinned = bpf_obj_get(path);
+        if (pinned < 0)
+            continue;
+        const bool reused = same_map(pinned, bpf_map__fd(map));
+        close(pinned);
+        if (!reused)
+            return bpf_map__name(map);
+    }
+    return NULL;
+}
+
+/* Pins the maps a newer object brought along, the ones it shares with its predecessor are pinned already */
+static int pin_new_maps(struct bpf_object* obj, const char* ifname) {
+    char path[PATH_MAX];
+    struct bpf_map* map;
+
+    bpf_object__for_each_map(map, obj) {
+        if (bpf_map__is_internal(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", pin_basedir, ifname, bpf_map__name(map));
+        if (access(path, F_OK) == 0)
+            continue;
+        if (bpf_map__pin(map, path)) {
+            lwlog_err("Couldn't pin %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int replace_xdp_fd(const int prog_fd, const char* ifname) {
+    LIBBPF_OPTS(bpf_xdp_query_opts, query);
+
+    const int ifindex = if_nametoindex(ifname);
+    if (!ifindex || bpf_xdp_query(ifindex, 0, &query)) {
+        lwlog_err("Couldn't query the XDP program of %s", ifname);
+        return -1;
+    }
+
+    /* The mode the running program is in, libxdp's dispatcher included */
+    __u32 old_id = query.drv_prog_id;
+    __u32 flags = XDP_FLAGS_DRV_MODE;
+    if (old_id == 0) {
+        old_id = query.skb_prog_id;
+        flags = XDP_FLAGS_SKB_MODE;
+    }
+    if (old_id == 0)
+        return attach_xdp_fd(prog_fd, ifname);
+
+    const int old_fd = bpf_prog_get_fd_by_id(old_id);
+    if (old_fd < 0) {
+        lwlog_err("Couldn't get program %u of %s: %s", old_id, ifname, strerror(errno));
+        return -1;
+    }
+
+    /* One netlink request swaps the programs, fails instead when someone else replaced old_fd meanwhile */
+    LIBBPF_OPTS(bpf_xdp_attach_opts, attach, .old_prog_fd = old_fd);
+    const int err = bpf_xdp_attach(ifindex, prog_fd, flags | XDP_FLAGS_REPLACE, &attach);
+    close(old_fd);
+    if (err) {
+        lwlog_err("Couldn't replace the XDP program of %s: %s", ifname, strerror(-err));
+        return -1;
+    }
+    return 0;
+}
+
+int reload_xdp_on_ifname(const char* ifname, const char* filename, const char* progname, const char* map_name, struct xdp_swap_stat* stat) {
+    struct bpf_object* obj;
+
+    const uint64_t start = phase_now();
+    const int prog_fd = load_prog_on(filename, progname, ifname, &obj);
+    if (prog_fd < 0)
+        return EXIT_FAIL_BPF;
+    const uint64_t loaded = phase_now();
+
+    const char* changed = changed_map(obj, ifname);
+    if (changed != NULL) {
+        lwlog_err("Not replacing the XDP program of %s, its map %s changed layout", ifname, changed);
+        if (stat != NULL)
+            snprintf(stat->changed_map, sizeof(stat->changed_map), "%s", changed);
+        bpf_object__close(obj);
+        return EXIT_FAIL_MAP_LAYOUT;
+    }
+
+    /* The old program keeps running until the new one is in, no frame sees neither */
+    int err = replace_xdp_fd(prog_fd, ifname);
+    const uint64_t swapped = phase_now();
+    if (!err && map_name != NULL)
+        err = pin_new_maps(obj, ifname);
+
+    /* The interface holds its own reference on the program */
+    bpf_object__close(obj);
+    if (err)
+        return EXIT_FAIL_XDP;
+
+    if (stat != NULL) {
+        stat->verify_ns = loaded - start;
+        stat->swap_ns = swapped - loaded;
+    }
+    lwlog_info("Replaced the XDP program of %s with %s in %.3f ms, %.3f ms to verify", ifname, filename, (swapped - loaded) / 1e6, (loaded - start) / 1e6);
+    return EXIT_OK;
+}
+
+int open_phy_map(const char* map_name) {
     char pin_dir[PATH_MAX] = {0};
-    struct bpf_map_info info = {0};
 
     const int len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, opts.dev);
     if (len < 0 || len >= PATH_MAX) {
@@ -208,17 +515,131 @@ int update_devmap(int ifindex, char* ifname) {
         return -1;
     }
 
-    const int map_fd = open_bpf_map_file(pin_dir, "xdp_devmap", &info);
+    return open_bpf_map_file(pin_dir, map_name, NULL);
+}
+
+/* Loads only progname out of obj_name, sharing the maps the attached PHY program pinned */
+int load_shared_prog(const char* obj_name, const char* progname, struct bpf_object** obj_out) {
+    char obj_path[PATH_MAX];
+
+    xdp_obj_path(obj_path, sizeof(obj_path), obj_name);
+    return load_prog_on(obj_path, progname, opts.dev, obj_out);
+}
+
+int update_devmap(int slot, int ifindex, int egress_fd, char* ifname) {
+    const int map_fd = open_phy_map("xdp_devmap");
     if (map_fd < 0) {
         lwlog_err("Couldn't open xdp_devmap");
         return -1;
     }
 
-    const int key = 0;
-    const int ret = bpf_map_update_elem(map_fd, &key, &ifindex, BPF_ANY);
+    if (egress_fd < 0)
+        lwlog_warning("Redirecting to %s without L2 rewriting", ifname);
+
+    const struct bpf_devmap_val val = {.ifindex = ifindex, .bpf_prog.fd = egress_fd};
+    const int ret = bpf_map_update_elem(map_fd, &slot, &val, BPF_ANY);
+    close(map_fd);
     if (ret) {
         lwlog_info("Couldn't update devmap for %s", ifname);
         return -1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int update_devmap_batch(const int* slots, const int* ifindexes, int* errs, const int nr, const int egress_fd) {
+    struct bpf_devmap_val* vals = calloc(nr, sizeof(*vals));
+    if (vals == NULL)
+        return -1;
+
+    const int map_fd = open_phy_map("xdp_devmap");
+    if (map_fd < 0) {
+        lwlog_err("Couldn't open xdp_devmap");
+        free(vals);
+        return -1;
+    }
+
+    for (int i = 0; i < nr; i++) {
+        vals[i].ifindex = ifindexes[i];
+        vals[i].bpf_prog.fd = egress_fd;
+        errs[i] = 0;
+    }
+
+    __u32 count = nr;
+    if (bpf_map_update_batch(map_fd, slots, vals, &count, NULL)) {
+        /* Devmaps have no batch ops, libbpf then leaves count as it was. Updates are idempotent, so every slot gets one
+         * syscall on the fd we already hold */
+        for (int i = 0; i < nr; i++)
+            errs[i] = bpf_map_update_elem(map_fd, &slots[i], &vals[i], BPF_ANY) ? -errno : 0;
+    }
+
+    close(map_fd);
+    free(vals);
+    return 0;
+}
+
+int clear_devmap(int slot) {
+    const int map_fd = open_phy_map("xdp_devmap");
+    if (map_fd < 0) {
+        lwlog_err("Couldn't open xdp_devmap");
+        return -1;
+    }
+
+    const int ret = bpf_map_delete_elem(map_fd, &slot);
+    close(map_fd);
+    if (ret && errno != ENOENT) {
+        lwlog_info("Couldn't clear devmap slot %d", slot);
+        return -1;
+    }
+    return 0;
+}
+
+void clear_devmap_batch(const int* slots, const int nr) {
+    const int map_fd = open_phy_map("xdp_devmap");
+    if (map_fd < 0) {
+        lwlog_err("Couldn't open xdp_devmap");
+        return;
+    }
+
+    __u32 count = nr;
+    if (bpf_map_delete_batch(map_fd, slots, &count, NULL)) {
+        /* Same as update_devmap_batch(), count can't be trusted and a slot already gone just says ENOENT */
+        for (int i = 0; i < nr; i++)
+            bpf_map_delete_elem(map_fd, &slots[i]);
+    }
+    close(map_fd);
+}
+
+int clear_phy_xsks(uint64_t queues) {
+    const int map_fd = open_phy_map("phy_xsks_map");
+    if (map_fd < 0) {
+        lwlog_err("Couldn't open phy_xsks_map");
+        return -1;
+    }
+
+    for (__u32 queue = 0; queue < PHY_QUEUES_MAX; queue++) {
+        if (queues & (1ULL << queue))
+            bpf_map_delete_elem(map_fd, &queue);
+    }
+
+    close(map_fd);
+    return 0;
+}
+
+int phy_rx_queue_count(const char* ifname) {
+    struct ethtool_channels channels = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr = {0};
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    ifr.ifr_data = (void*)&channels;
+
+    const int err = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+    if (err)
+        return -1;
+
+    return channels.rx_count + channels.combined_count;
+}
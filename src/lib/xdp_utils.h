@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <linux/bpf.h>
 
 enum {
@@ -9,11 +10,54 @@ enum {
     EXIT_FAIL_MEM = 5,
     EXIT_FAIL_XDP = 30,
     EXIT_FAIL_BPF = 40,
+    EXIT_FAIL_MAP_LAYOUT = 41,
 };
 
+struct bpf_object;
+
 #define pin_basedir "/sys/fs/bpf"
 int unload_xdp_from_ifname(const char* ifname);
 int open_bpf_map_file(const char* pin_dir, const char* mapname, struct bpf_map_info* info);
+/* Opens a map pinned for the PHY program under pin_basedir/<--dev> */
+int open_phy_map(const char* map_name);
 int load_xdp_and_attach_to_ifname(const char* ifname, const char* filename, const char* progname, const char* map_name);
+/* Hands bpf_obj the compatible maps pinned for ifname, call before loading it */
+int reuse_pinned_maps(struct bpf_object* bpf_obj, const char* ifname);
+/* "native", "generic", "offload" or "none", as the kernel reports it for ifname */
+const char* xdp_attached_mode(const char* ifname);
+/* Time it took to replace the program of one interface */
+struct xdp_swap_stat {
+    uint64_t verify_ns; /* Opening and loading the new program, mostly the verifier */
+    uint64_t swap_ns;   /* The attach request that swaps it in */
+    char changed_map[BPF_OBJ_NAME_LEN]; /* Pinned map the new program can't share, set with EXIT_FAIL_MAP_LAYOUT */
+};
+
+/*
+ * Replaces the program on ifname in one attach request, the new one shares the maps pinned for it and frames see either the
+ * old program or the new one. Returns EXIT_FAIL_MAP_LAYOUT and leaves the old program running when a pinned map changed
+ * layout, its state wouldn't carry over. Fills stat unless it is NULL
+ */
+int reload_xdp_on_ifname(const char* ifname, const char* filename, const char* progname, const char* map_name, struct xdp_swap_stat* stat);
+
+/* Swaps prog_fd in for whatever runs on ifname, in the mode that one runs in. Attaches as attach_xdp_fd() when nothing does */
+int replace_xdp_fd(int prog_fd, const char* ifname);
+
+/* Loads progname alone out of obj/<obj_name>.o on top of the PHY's pinned maps, returns its fd and the object to close once it is in use */
+int load_shared_prog(const char* obj_name, const char* progname, struct bpf_object** obj_out);
+
+/* Attaches an already loaded program to ifname without libxdp, in the mode --xdp-mode allows */
+int attach_xdp_fd(int prog_fd, const char* ifname);
+void detach_xdp_fd(const char* ifname);
+
+/* Points slot at ifindex, with egress_fd (xdp_port_egress) applying the port's L2 rewrite on the way out */
+int update_devmap(int slot, int ifindex, int egress_fd, char* ifname);
+/* update_devmap() for nr ports at once, errs[i] is 0 or a negative errno for slots[i] */
+int update_devmap_batch(const int* slots, const int* ifindexes, int* errs, int nr, int egress_fd);
+int clear_devmap(int slot);
+void clear_devmap_batch(const int* slots, int nr);
+
+/* Removes the direct mode XSKs of the queues in the mask from the PHY program */
+int clear_phy_xsks(uint64_t queues);
 
-int update_devmap(int ifindex, char* ifname);
+/* RX plus combined channels of ifname, -1 when the driver doesn't tell */
+int phy_rx_queue_count(const char* ifname);
@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <xdp/xsk.h>
+
+#include "args.h"
+#include "lwlog.h"
+#include "steer_kern_user.h"
+#include "uthash.h"
+#include "xsk_pool.h"
+#include "xsk_utils.h"
+
+/* A registered UMEM backed by a memfd, the client maps the same pages */
+struct pool_umem {
+    int memfd;
+    void* buffer;
+    struct xsk_umem* umem;
+    struct xsk_ring_prod fq; /* libxdp keeps pointers to these until the first socket binds */
+    struct xsk_ring_cons cq;
+    struct pool_umem* next;
+};
+
+struct pool_xsk {
+    uint32_t queue_id;
+    struct xsk_socket* xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct pool_umem* umem;
+};
+
+struct pool_port {
+    char prefix[IFNAMSIZ];
+    int nr;
+    struct pool_xsk xsks[PHY_QUEUES_MAX]; /* Direct mode ports bind PHY queues, veth ports at most PORT_XSK_QUEUES */
+    UT_hash_handle hh;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pool_umem* warm;
+    int nr_warm;
+    struct pool_port* ports;
+    int egress_fd;
+} pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .egress_fd = -1};
+
+static uint64_t umem_size(void) {
+    return (uint64_t)opts.pool_frames * FRAME_SIZE;
+}
+
+/* Every ring gets half the frames, the other half is in flight on the client's side */
+static uint32_t ring_size(void) {
+    return opts.pool_frames / 2;
+}
+
+static void umem_destroy(struct pool_umem* umem) {
+    if (umem->umem != NULL)
+        xsk_umem__delete(umem->umem);
+    if (umem->buffer != NULL)
+        munmap(umem->buffer, umem_size());
+    if (umem->memfd >= 0)
+        close(umem->memfd);
+    free(umem);
+}
+
+static struct pool_umem* umem_create(void) {
+    const struct xsk_umem_config cfg = {
+        .fill_size = ring_size(),
+        .comp_size = ring_size(),
+        .frame_size = FRAME_SIZE,
+        .frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+    };
+
+    struct pool_umem* umem = calloc(1, sizeof(*umem));
+    if (umem == NULL)
+        return NULL;
+
+    umem->memfd = syscall(SYS_memfd_create, "xsknet-umem", MFD_CLOEXEC);
+    if (umem->memfd < 0 || ftruncate(umem->memfd, umem_size()) < 0) {
+        lwlog_err("Couldn't create a UMEM memfd: %s", strerror(errno));
+        goto err;
+    }
+
+    /* Populated up front, registering pins the pages anyway */
+    umem->buffer = mmap(NULL, umem_size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, umem->memfd, 0);
+    if (umem->buffer == MAP_FAILED) {
+        umem->buffer = NULL;
+        lwlog_err("Couldn't map a UMEM: %s", strerror(errno));
+        goto err;
+    }
+
+    const int ret = xsk_umem__create(&umem->umem, umem->buffer, umem_size(), &umem->fq, &umem->cq, &cfg);
+    if (ret) {
+        umem->umem = NULL;
+        lwlog_err("Couldn't register a UMEM: %s", strerror(-ret));
+        goto err;
+    }
+    return umem;
+
+err:
+    umem_destroy(umem);
+    return NULL;
+}
+
+/* Warm UMEM if there is one, a fresh one otherwise */
+static struct pool_umem* umem_take(void) {
+    pthread_mutex_lock(&pool.lock);
+    struct pool_umem* umem = pool.warm;
+    if (umem != NULL) {
+        pool.warm = umem->next;
+        pool.nr_warm--;
+        pthread_cond_signal(&pool.cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return umem != NULL ? umem : umem_create();
+}
+
+/* Tops the warm list back up after ports took from it, off the request path */
+static void* pool_refill_thread(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.nr_warm >= XSK_POOL_WARM)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        struct pool_umem* umem = umem_create();
+
+        pthread_mutex_lock(&pool.lock);
+        if (umem == NULL) {
+            /* Retried on the next take rather than spinning on a failing allocation */
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            continue;
+        }
+        umem->next = pool.warm;
+        pool.warm = umem;
+        pool.nr_warm++;
+    }
+    return NULL;
+}
+
+int xsk_pool_init(void) {
+    pthread_t thread;
+
+    /* Clients send their replies through it, without it they would need CAP_NET_RAW themselves */
+    pool.egress_fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    if (pool.egress_fd < 0) {
+        lwlog_err("Couldn't open the egress socket: %s", strerror(errno));
+        return -1;
+    }
+
+    const int err = pthread_create(&thread, NULL, pool_refill_thread, NULL);
+    if (err != 0) {
+        lwlog_err("pthread_create: %s", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+static void port_destroy(struct pool_port* port) {
+    for (int i = 0; i < port->nr; i++) {
+        xsk_socket__delete(port->xsks[i].xsk);
+        umem_destroy(port->xsks[i].umem);
+    }
+    free(port);
+}
+
+int xsk_pool_bind(const char* prefix, const char* ifname, const uint64_t queues, const int map_fd) {
+    const struct xsk_socket_config cfg = {
+        .rx_size = ring_size(),
+        .tx_size = ring_size(),
+        .libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+    };
+
+    struct pool_port* port = calloc(1, sizeof(*port));
+    if (port == NULL)
+        return -1;
+    snprintf(port->prefix, sizeof(port->prefix), "%s", prefix);
+
+    for (uint32_t queue = 0; queue < PHY_QUEUES_MAX; queue++) {
+        if (!(queues & (1ULL << queue)))
+            continue;
+
+        struct pool_xsk* xsk = &port->xsks[port->nr];
+        xsk->queue_id = queue;
+        xsk->umem = umem_take();
+        if (xsk->umem == NULL)
+            goto err;
+
+        const int ret = xsk_socket__create(&xsk->xsk, ifname, queue, xsk->umem->umem, &xsk->rx, &xsk->tx, &cfg);
+        if (ret) {
+            lwlog_err("Couldn't bind an XSK to %s queue %u: %s", ifname, queue, strerror(-ret));
+            umem_destroy(xsk->umem);
+            goto err;
+        }
+        port->nr++;
+
+        if (xsk_socket__update_xskmap(xsk->xsk, map_fd)) {
+            lwlog_err("Couldn't publish the XSK of %s queue %u: %s", ifname, queue, strerror(errno));
+            goto err;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    struct pool_port* old;
+    HASH_FIND_STR(pool.ports, prefix, old);
+    if (old != NULL)
+        HASH_DEL(pool.ports, old);
+    HASH_ADD_STR(pool.ports, prefix, port);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (old != NULL)
+        port_destroy(old);
+    lwlog_info("Bound %d XSKs of %s on %s", port->nr, prefix, ifname);
+    return 0;
+
+err:
+    port_destroy(port);
+    return -1;
+}
+
+int xsk_pool_handover(const char* prefix, struct ctl_fds* fds, char* layout, const size_t size) {
+    struct pool_port* port;
+    int err = -1;
+
+    fds->nr = 0;
+    pthread_mutex_lock(&pool.lock);
+    HASH_FIND_STR(pool.ports, prefix, port);
+    if (port == NULL || pool.egress_fd < 0 || 1 + 2 * port->nr > CTL_FDS_MAX)
+        goto out;
+
+    /* Copies, the daemon's own stay open for cleanup and a port released before the reply went out */
+    fds->fds[fds->nr++] = fcntl(pool.egress_fd, F_DUPFD_CLOEXEC, 0);
+    for (int i = 0; i < port->nr; i++) {
+        fds->fds[fds->nr++] = fcntl(xsk_socket__fd(port->xsks[i].xsk), F_DUPFD_CLOEXEC, 0);
+        fds->fds[fds->nr++] = fcntl(port->xsks[i].umem->memfd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    for (int i = 0; i < fds->nr; i++) {
+        if (fds->fds[i] < 0) {
+            for (int j = 0; j < fds->nr; j++) {
+                if (fds->fds[j] >= 0)
+                    close(fds->fds[j]);
+            }
+            fds->nr = 0;
+            goto out;
+        }
+    }
+
+    snprintf(layout, size, "xsk frames=%u frame_size=%d rx=%u tx=%u fill=%u comp=%u", opts.pool_frames, FRAME_SIZE, ring_size(), ring_size(), ring_size(),
+             ring_size());
+    err = 0;
+
+out:
+    pthread_mutex_unlock(&pool.lock);
+    return err;
+}
+
+void xsk_pool_release(const char* prefix) {
+    struct pool_port* port;
+
+    pthread_mutex_lock(&pool.lock);
+    HASH_FIND_STR(pool.ports, prefix, port);
+    if (port != NULL)
+        HASH_DEL(pool.ports, port);
+    pthread_mutex_unlock(&pool.lock);
+
+    if (port != NULL)
+        port_destroy(port);
+}
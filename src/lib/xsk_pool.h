@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ctl_proto.h"
+
+/* UMEMs kept registered ahead of time, so binding a port's XSKs skips the allocation and page pinning */
+#define XSK_POOL_WARM 8
+
+/*
+ * --pool-frames, frames in the UMEM of each XSK the daemon binds. Every one stays pinned for the port's lifetime, so a
+ * thousand ports at the 4 MiB default is 4 GiB. Each ring gets half as many entries, the most is what the client's frame
+ * bookkeeping holds (NUM_FRAMES).
+ */
+#define XSK_POOL_FRAMES_DEFAULT 1024
+#define XSK_POOL_FRAMES_MIN 256
+
+/*
+ * The daemon creates each port's XSKs itself and hands them to the client over the control socket, so the client needs no
+ * privileges and no setup of its own. Every UMEM lives in a memfd the client maps at the same layout.
+ */
+
+/* Opens the raw egress socket handed to every client and starts keeping XSK_POOL_WARM UMEMs ready */
+int xsk_pool_init(void);
+
+/* Binds one XSK per queue in the mask to ifname and publishes them in the XSKMAP map_fd, keyed by queue */
+int xsk_pool_bind(const char* prefix, const char* ifname, uint64_t queues, int map_fd);
+
+/*
+ * Dups the port's fds into fds for the attach reply: the egress socket first, then the XSK and UMEM memfd of each queue in
+ * queue order. Writes the mmap layout ("xsk frames=.. frame_size=.. rx=.. tx=.. fill=.. comp=..") into layout.
+ */
+int xsk_pool_handover(const char* prefix, struct ctl_fds* fds, char* layout, size_t size);
+
+/* Closes the daemon's side of the port's XSKs, clients holding them keep theirs */
+void xsk_pool_release(const char* prefix);
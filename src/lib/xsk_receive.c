@@ -2,48 +2,22 @@
 #include <assert.h>
 #include <stdlib.h>
 
-#include <sys/ioctl.h>
 #include <linux/icmp.h>
 #include <linux/ip.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "lwlog.h"
+#include "phase_prof.h"
+#include "pkt_meta.h"
 #include "xsk_receive.h"
+#include "xsk_stats.h"
+#include "xsk_switch.h"
 #include "xsk_utils.h"
 
-void get_mac_address(unsigned char* mac_addr, const char* ifname) {
-    struct ifreq ifr;
-    if (!ifname) {
-        lwlog_err("ERROR: Couldn't get interface name from index");
-        exit(EXIT_FAILURE);
-    }
-    if (!mac_addr) {
-        lwlog_err("ERROR: Couldn't get MAC address");
-        exit(EXIT_FAILURE);
-    }
-
-    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd == -1) {
-        lwlog_err("ERROR: Couldn't create socket");
-        exit(EXIT_FAILURE);
-    }
-
-    ifr.ifr_addr.sa_family = AF_INET;
-    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
-
-    if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1) {
-        lwlog_err("ERROR: Couldn't get MAC address for interface %s", ifname);
-        exit(EXIT_FAILURE);
-    }
-
-    close(fd);
-
-    memcpy(mac_addr, ifr.ifr_hwaddr.sa_data, 6);
-}
-
 /**
  * @brief Allocates a frame from the user memory (umem).
  *
@@ -80,11 +54,13 @@ static void complete_tx(struct xsk_socket_info* xsk) {
     if (!xsk->outstanding_tx)
         return;
 
-    /* Non-blocking wakeup of kernel for completions */
-    sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    /* Non-blocking wakeup of kernel for completions, switch_doorbell() wakes the daemon's worker for switch ports */
+    if (xsk->kick_fd < 0)
+        sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
 
     /* Collect/free completed TX buffers */
     const unsigned int completed = xsk_ring_cons__peek(&xsk->umem->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx_cq);
+    xsk->ring.cq_batch[batch_hist_bucket(completed)]++;
 
     if (completed <= 0)
         return;
@@ -98,6 +74,47 @@ static void complete_tx(struct xsk_socket_info* xsk) {
     xsk->outstanding_tx -= completed < xsk->outstanding_tx ? completed : xsk->outstanding_tx;
 }
 
+/*
+ * Switch ports: rings the doorbell for the tx and fill this burst queued, the worker looks at no other port's rings. It
+ * only needs a kick while it sleeps, to pass our frames on or to collect the completions of outstanding tx.
+ */
+static void switch_doorbell(struct xsk_socket_info* xsk) {
+    bool sleeping;
+
+    if (xsk->doorbell_due)
+        sleeping = xsk_switch_ring_doorbell(xsk->doorbell, xsk->slot);
+    else if (xsk->outstanding_tx)
+        sleeping = xsk_switch_sleeping(xsk->doorbell);
+    else
+        return;
+
+    xsk->doorbell_due = false;
+    if (sleeping)
+        eventfd_write(xsk->kick_fd, 1);
+}
+
+/*
+ * Returns the ingress timestamp the XDP programs left in front of the frame, or 0 if the frame carries none. The magic is
+ * cleared after reading since frames get recycled through the fill ring and a stale stamp would be read again.
+ */
+static uint64_t xsk_pkt_rx_timestamp(const struct xsk_socket_info* xsk, uint64_t addr) {
+    struct pkt_meta* meta = (struct pkt_meta*)((uint8_t*)xsk_umem__get_data(xsk->umem->buffer, addr) - sizeof(*meta));
+
+    if (meta->magic != PKT_META_MAGIC)
+        return 0;
+
+    meta->magic = 0;
+    return meta->rx_timestamp;
+}
+
+/* Records now - since, skipping frames without an ingress stamp */
+static inline void latency_record_since(struct hdr_hist* h, const uint64_t since, const uint64_t now) {
+    if (!since || now < since)
+        return;
+
+    hdr_hist_record(h, now - since);
+}
+
 static inline void csum_replace2(uint16_t* sum, const uint16_t old, const uint16_t new) {
     uint16_t csum = ~*sum;  // 1's complement of the checksum (flip all the bits)
 
@@ -110,7 +127,7 @@ static inline void csum_replace2(uint16_t* sum, const uint16_t old, const uint16
     *sum = ~csum;  // 1's complement of the checksum
 }
 
-static bool process_packet(struct xsk_socket_info* xsk, uint64_t addr, uint32_t len, const struct egress_sock* egress) {
+static bool process_packet(struct xsk_socket_info* xsk, uint64_t addr, uint32_t len, const struct egress_sock* egress, const uint64_t rx_ts) {
     uint8_t* pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
 
     errno = 0;
@@ -162,14 +179,37 @@ static bool process_packet(struct xsk_socket_info* xsk, uint64_t addr, uint32_t
     lwlog_info("Source IP: %s", inet_ntoa(*(struct in_addr*)&ipv4->saddr));
     lwlog_info("Dest IP: %s", inet_ntoa(*(struct in_addr*)&ipv4->daddr));
 
+    /* Switch ports send through the daemon, the frame comes back on the completion ring once the PHY sent it */
+    if (xsk->kick_fd >= 0) {
+        uint32_t tx_idx;
+
+        if (xsk_ring_prod__reserve(&xsk->tx, 1, &tx_idx) != 1) {
+            xsk->ring.tx_reserve_fail++;
+            return false;
+        }
+        xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->addr = addr;
+        xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->len = len;
+        xsk_ring_prod__tx_desc(&xsk->tx, tx_idx)->options = 0;
+        xsk_ring_prod__submit(&xsk->tx, 1);
+        xsk->outstanding_tx++;
+        xsk->doorbell_due = true;
+
+        xsk->stats.tx_bytes += len;
+        xsk->stats.tx_packets++;
+        latency_record_since(&xsk->shared.lat.rx_to_tx, rx_ts, gettime());
+        return true;
+    }
+
     /* Send packet */
     if ((ret = sendto(egress->sockfd, pkt, len, 0, (struct sockaddr*)egress->addr, sizeof(*egress->addr))) == -1) {
+        xsk->ring.tx_send_fail++;
         lwlog_err("ERROR: Failed to send packet");
         return false;
     }
 
     xsk->stats.tx_bytes += len;
     xsk->stats.tx_packets++;
+    latency_record_since(&xsk->shared.lat.rx_to_tx, rx_ts, gettime());
 
     /* Here we send the packet out of the receive port. Note that
      * we allocate one entry and schedule it. Your design would be
@@ -189,16 +229,23 @@ static bool process_packet(struct xsk_socket_info* xsk, uint64_t addr, uint32_t
     return false;
 }
 
-static void handle_receive_packets(struct xsk_socket_info* xsk, struct egress_sock* egress) {
+static void handle_receive_packets(struct xsk_socket_info* xsk, struct egress_sock* egress, const uint64_t wake_ts) {
     unsigned int i;
     uint32_t idx_rx = 0, idx_fq = 0;
+    const uint64_t start = gettime();
 
     const unsigned int rcvd = xsk_ring_cons__peek(&xsk->rx, RX_BATCH_SIZE, &idx_rx);
-    if (!rcvd)
+    xsk->ring.rx_batch[batch_hist_bucket(rcvd)]++;
+    if (!rcvd) {
+        xsk_stats_publish(xsk);
         return;
+    }
 
     /* Stuff the ring with as much frames as possible */
-    const unsigned int stock_frames = xsk_prod_nb_free(&xsk->umem->fq, xsk_umem_free_frames(xsk));
+    unsigned int stock_frames = xsk_prod_nb_free(&xsk->umem->fq, xsk_umem_free_frames(xsk));
+    /* xsk_prod_nb_free() reports the free slots, there may be fewer frames to fill them with */
+    if (stock_frames > xsk_umem_free_frames(xsk))
+        stock_frames = xsk_umem_free_frames(xsk);
 
     if (stock_frames > 0) {
         uint32_t ret = xsk_ring_prod__reserve(&xsk->umem->fq, stock_frames, &idx_fq);
@@ -206,46 +253,67 @@ static void handle_receive_packets(struct xsk_socket_info* xsk, struct egress_so
         /* This should not happen, but just in case
          * Wait until we can reserve enough space in the fill queue
          */
-        while (ret != stock_frames)
+        while (ret != stock_frames) {
+            xsk->ring.fq_reserve_fail++;
             ret = xsk_ring_prod__reserve(&xsk->umem->fq, rcvd, &idx_fq);
+        }
 
         for (i = 0; i < stock_frames; i++)
             *xsk_ring_prod__fill_addr(&xsk->umem->fq, idx_fq++) = xsk_alloc_umem_frame(xsk);
 
         /* Finally, tell the kernel that it can start writing packets into the rx ring */
         xsk_ring_prod__submit(&xsk->umem->fq, stock_frames);
+        xsk->doorbell_due = xsk->kick_fd >= 0;
     }
 
+    /* One clock read per packet: the end of one packet is the start of the next */
+    uint64_t now = gettime();
+    hdr_hist_record(&xsk->shared.lat.wake, now - wake_ts);
+
     /* Process received packets */
     for (i = 0; i < rcvd; i++) {
         /* Get the address of the frame from the rx ring */
         const uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
         const uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++)->len;
+        const uint64_t rx_ts = xsk_pkt_rx_timestamp(xsk, addr);
+        latency_record_since(&xsk->shared.lat.rx_to_process, rx_ts, now);
 
         /* If the packet was not processed correctly or does not need to be transmitted, free the frame */
-        if (!process_packet(xsk, addr, len, egress))
+        if (!process_packet(xsk, addr, len, egress, rx_ts))
             xsk_free_umem_frame(xsk, addr);
 
         xsk->stats.rx_bytes += len;
+
+        const uint64_t done = gettime();
+        hdr_hist_record(&xsk->shared.lat.service, done - now);
+        now = done;
     }
 
     xsk_ring_cons__release(&xsk->rx, rcvd);
+    /* First frame of this XSK, phase_first_packet() keeps only the first of the process */
+    if (xsk->stats.rx_packets == 0)
+        phase_first_packet();
     xsk->stats.rx_packets += rcvd;
 
     /* Do we need to wake up the kernel for transmission */
+    if (xsk->kick_fd >= 0)
+        switch_doorbell(xsk);
     complete_tx(xsk);
+
+    xsk_stats_publish(xsk);
+    hdr_hist_record(&xsk->shared.lat.burst, gettime() - start);
 }
 
 void rx_and_process(struct xsk_socket_info* xsk_socket, const int* global_exit, struct egress_sock* egress) {
     struct pollfd fds[2];
-    /* Open RAW socket to send on */
-    if ((egress->sockfd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+    /* Open RAW socket to send on, unless the daemon handed one over */
+    if (egress->sockfd < 0 && (egress->sockfd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
         lwlog_err("ERROR: Failed to open raw socket");
         return;
     }
 
     memset(fds, 0, sizeof(fds));
-    fds[0].fd = xsk_socket__fd(xsk_socket->xsk);
+    fds[0].fd = xsk_socket->fd;
     fds[0].events = POLLIN;
 
     while (!*global_exit) {
@@ -253,6 +321,36 @@ void rx_and_process(struct xsk_socket_info* xsk_socket, const int* global_exit,
         const int ret = poll(fds, nfds, -1);
         if (ret <= 0 || ret > 1)
             continue;
-        handle_receive_packets(xsk_socket, egress);
+        handle_receive_packets(xsk_socket, egress, gettime());
     }
-}
\ No newline at end of file
+}
+
+void switch_rx_and_process(struct xsk_socket_info** xsks, const int nr, const int wake_fd, const int* global_exit, struct egress_sock* egress) {
+    struct pollfd fds = {.fd = wake_fd, .events = POLLIN};
+    eventfd_t value;
+
+    while (!*global_exit) {
+        bool busy = false;
+        for (int i = 0; i < nr; i++) {
+            if (xsk_cons_nb_avail(&xsks[i]->rx, 1) == 0)
+                continue;
+            handle_receive_packets(xsks[i], egress, gettime());
+            busy = true;
+        }
+        if (busy)
+            continue;
+
+        /* Flag first, then a last look: a frame the daemon queued before seeing the flag isn't left waiting for the timeout */
+        for (int i = 0; i < nr; i++)
+            __atomic_fetch_or(xsks[i]->rx.flags, XDP_RING_NEED_WAKEUP, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (int i = 0; i < nr && !busy; i++)
+            busy = xsk_cons_nb_avail(&xsks[i]->rx, 1) > 0;
+
+        if (!busy)
+            poll(&fds, 1, 1000);
+        eventfd_read(wake_fd, &value);
+        for (int i = 0; i < nr; i++)
+            __atomic_fetch_and(xsks[i]->rx.flags, ~XDP_RING_NEED_WAKEUP, __ATOMIC_RELAXED);
+    }
+}
@@ -9,5 +9,6 @@ struct egress_sock {
 };
 void init_iface(struct egress_sock* egress, const char* phy_ifname);
 
-void get_mac_address(unsigned char* mac_addr, const char* ifname);
-void rx_and_process(struct xsk_socket_info* xsk_socket, const int* global_exit, struct egress_sock* egress);
\ No newline at end of file
+void rx_and_process(struct xsk_socket_info* xsk_socket, const int* global_exit, struct egress_sock* egress);
+/* Switch mode: one loop over the rings of every queue, sleeping on the eventfd the daemon wakes the port with */
+void switch_rx_and_process(struct xsk_socket_info** xsks, int nr, int wake_fd, const int* global_exit, struct egress_sock* egress);
@@ -4,7 +4,11 @@
 #include <locale.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
 
+#include "metrics.h"
 #include "signal_handler.h"
 #include "xdp_utils.h"
 #include "xsk_utils.h"
@@ -13,7 +17,7 @@
 
 #define CLOCK_MONOTONIC 1
 #define NANOSEC_PER_SEC 1000000000 /* 10^9 */
-static uint64_t gettime(void) {
+uint64_t gettime(void) {
     struct timespec t;
 
     const int res = clock_gettime(CLOCK_MONOTONIC, &t);
@@ -24,6 +28,80 @@ static uint64_t gettime(void) {
     return (uint64_t)t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
 }
 
+static struct xsk_socket_info* workers[MAX_STATS_WORKERS];
+static unsigned int nr_workers;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Makes a worker's socket visible to the stats thread, the count is published last so readers only see complete entries */
+int xsk_stats_register(struct xsk_socket_info* xsk) {
+    pthread_mutex_lock(&workers_lock);
+    if (nr_workers >= MAX_STATS_WORKERS) {
+        pthread_mutex_unlock(&workers_lock);
+        lwlog_err("Too many stats workers, max %d", MAX_STATS_WORKERS);
+        return -1;
+    }
+
+    workers[nr_workers] = xsk;
+    __atomic_store_n(&nr_workers, nr_workers + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&workers_lock);
+    return 0;
+}
+
+void xsk_stats_snapshot(const struct xsk_worker_stats* shared, struct stats_record* stats, struct ring_stats* ring) {
+    uint32_t seq;
+
+    do {
+        seq = seqlock_read_begin(&shared->seq);
+        *stats = shared->stats;
+        *ring = shared->ring;
+    } while (seqlock_read_retry(&shared->seq, seq));
+}
+
+static void hdr_hist_accumulate(struct hdr_hist* sum, const struct hdr_hist* live) {
+    static __thread struct hdr_hist snap;
+
+    hdr_hist_snapshot(live, &snap);
+    sum->total += snap.total;
+    sum->sum += snap.sum;
+    for (unsigned int i = 0; i < HDR_BUCKETS; i++)
+        sum->counts[i] += snap.counts[i];
+}
+
+/* Sums a consistent snapshot of every registered worker */
+static unsigned int xsk_stats_aggregate(struct stats_record* stats, struct ring_stats* ring, struct latency_hists* lat) {
+    const unsigned int n = __atomic_load_n(&nr_workers, __ATOMIC_ACQUIRE);
+    struct stats_record s;
+    struct ring_stats r;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(ring, 0, sizeof(*ring));
+    memset(lat, 0, sizeof(*lat));
+
+    for (unsigned int w = 0; w < n; w++) {
+        const struct xsk_worker_stats* shared = &workers[w]->shared;
+
+        xsk_stats_snapshot(shared, &s, &r);
+        stats->rx_packets += s.rx_packets;
+        stats->rx_bytes += s.rx_bytes;
+        stats->tx_packets += s.tx_packets;
+        stats->tx_bytes += s.tx_bytes;
+        for (int i = 0; i < BATCH_HIST_BUCKETS; i++) {
+            ring->rx_batch[i] += r.rx_batch[i];
+            ring->cq_batch[i] += r.cq_batch[i];
+        }
+        ring->fq_reserve_fail += r.fq_reserve_fail;
+        ring->tx_reserve_fail += r.tx_reserve_fail;
+        ring->tx_send_fail += r.tx_send_fail;
+
+        hdr_hist_accumulate(&lat->burst, &shared->lat.burst);
+        hdr_hist_accumulate(&lat->service, &shared->lat.service);
+        hdr_hist_accumulate(&lat->wake, &shared->lat.wake);
+        hdr_hist_accumulate(&lat->rx_to_process, &shared->lat.rx_to_process);
+        hdr_hist_accumulate(&lat->rx_to_tx, &shared->lat.rx_to_tx);
+    }
+    return n;
+}
+
 static double calc_period(const struct stats_record* r, const struct stats_record* p) {
     double period_ = 0;
 
@@ -34,6 +112,119 @@ static double calc_period(const struct stats_record* r, const struct stats_recor
     return period_;
 }
 
+static void latency_print(const char* name, const struct hdr_hist* interval) {
+    if (interval->total == 0)
+        return;
+
+    printf("%-12s p50 %'9.2f p99 %'9.2f p99.9 %'9.2f max %'9.2f avg %'9.2f usec (%'llu samples)\n", name,
+           hdr_hist_percentile(interval, 50.0) / 1000.0, hdr_hist_percentile(interval, 99.0) / 1000.0,
+           hdr_hist_percentile(interval, 99.9) / 1000.0, hdr_hist_max(interval) / 1000.0, (double)interval->sum / interval->total / 1000.0,
+           (unsigned long long)interval->total);
+}
+
+/*
+ * Prints the latency percentiles of the last interval. The live histograms are never reset, the interval is the difference
+ * between the current snapshot and the one taken last time, so the workers keep running untouched.
+ */
+static void latency_hists_print(const struct latency_hists* cur, const struct latency_hists* prev) {
+    static struct hdr_hist interval;
+
+    const struct {
+        const char* name;
+        const struct hdr_hist* cur;
+        const struct hdr_hist* prev;
+    } hists[] = {
+        {"burst:", &cur->burst, &prev->burst},
+        {"service:", &cur->service, &prev->service},
+        {"wake->proc:", &cur->wake, &prev->wake},
+        {"wire->proc:", &cur->rx_to_process, &prev->rx_to_process},
+        {"wire->tx:", &cur->rx_to_tx, &prev->rx_to_tx},
+    };
+
+    for (size_t i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+        hdr_hist_delta(hists[i].cur, hists[i].prev, &interval);
+        latency_print(hists[i].name, &interval);
+    }
+}
+
+static int xsk_get_kernel_stats(const struct xsk_socket_info* xsk, struct xdp_statistics* out) {
+    socklen_t optlen = sizeof(*out);
+
+    /* Switch rings aren't a socket, the daemon's XSK counts for the whole queue */
+    if (xsk->kick_fd >= 0)
+        return -1;
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, out, &optlen)) {
+        lwlog_err("getsockopt(XDP_STATISTICS): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void kernel_stats_print(const struct xdp_statistics* cur, const struct xdp_statistics* prev) {
+    const struct {
+        const char* name;
+        uint64_t cur;
+        uint64_t prev;
+    } counters[] = {
+        {"rx_dropped", cur->rx_dropped, prev->rx_dropped},
+        {"rx_invalid_descs", cur->rx_invalid_descs, prev->rx_invalid_descs},
+        {"rx_ring_full", cur->rx_ring_full, prev->rx_ring_full},
+        {"rx_fill_ring_empty_descs", cur->rx_fill_ring_empty_descs, prev->rx_fill_ring_empty_descs},
+        {"tx_invalid_descs", cur->tx_invalid_descs, prev->tx_invalid_descs},
+        {"tx_ring_empty_descs", cur->tx_ring_empty_descs, prev->tx_ring_empty_descs},
+    };
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (counters[i].cur == counters[i].prev)
+            continue;
+        printf("%-12s %-24s %'11llu (+%'llu)\n", "XSK kernel:", counters[i].name, (unsigned long long)counters[i].cur,
+               (unsigned long long)(counters[i].cur - counters[i].prev));
+    }
+}
+
+/* Entries sitting in a ring, sampled without touching the owner's cached indexes */
+static uint32_t ring_occupancy(const uint32_t* producer, const uint32_t* consumer) {
+    return __atomic_load_n(producer, __ATOMIC_RELAXED) - __atomic_load_n(consumer, __ATOMIC_RELAXED);
+}
+
+static void batch_hist_print(const char* name, const uint64_t* cur, const uint64_t* prev) {
+    static const char* labels[BATCH_HIST_BUCKETS] = {"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"};
+    uint64_t total = 0;
+
+    for (int i = 0; i < BATCH_HIST_BUCKETS; i++)
+        total += cur[i] - prev[i];
+    if (total == 0)
+        return;
+
+    printf("%-12s", name);
+    for (int i = 0; i < BATCH_HIST_BUCKETS; i++)
+        printf(" %s:%'llu", labels[i], (unsigned long long)(cur[i] - prev[i]));
+    printf("\n");
+}
+
+static void ring_occupancy_print(const unsigned int worker, const struct xsk_socket_info* xsk) {
+    printf("%-12s #%u rx %u/%u fill %u/%u tx %u/%u comp %u/%u\n", "XSK rings:", worker, ring_occupancy(xsk->rx.producer, xsk->rx.consumer),
+           xsk->rx.size, ring_occupancy(xsk->umem->fq.producer, xsk->umem->fq.consumer), xsk->umem->fq.size,
+           ring_occupancy(xsk->tx.producer, xsk->tx.consumer), xsk->tx.size, ring_occupancy(xsk->umem->cq.producer, xsk->umem->cq.consumer),
+           xsk->umem->cq.size);
+}
+
+static void ring_stats_print(const struct ring_stats* cur, const struct ring_stats* prev) {
+    batch_hist_print("rx batch:", cur->rx_batch, prev->rx_batch);
+    batch_hist_print("comp batch:", cur->cq_batch, prev->cq_batch);
+
+    if (cur->fq_reserve_fail != prev->fq_reserve_fail || cur->tx_reserve_fail != prev->tx_reserve_fail) {
+        printf("%-12s fill %'llu (+%'llu) tx %'llu (+%'llu)\n", "reserve fail:", (unsigned long long)cur->fq_reserve_fail,
+               (unsigned long long)(cur->fq_reserve_fail - prev->fq_reserve_fail), (unsigned long long)cur->tx_reserve_fail,
+               (unsigned long long)(cur->tx_reserve_fail - prev->tx_reserve_fail));
+    }
+    if (cur->tx_send_fail != prev->tx_send_fail) {
+        printf("%-12s %'llu (+%'llu)\n", "send fail:", (unsigned long long)cur->tx_send_fail,
+               (unsigned long long)(cur->tx_send_fail - prev->tx_send_fail));
+    }
+}
+
 static void stats_print(const struct stats_record* stats_rec, const struct stats_record* stats_prev) {
     double pps; /* packets per sec */
     double bps; /* bits per sec */
@@ -63,14 +254,90 @@ static void stats_print(const struct stats_record* stats_rec, const struct stats
         pps = packets / period;
         bps = (bytes * 8) / period / 1000000;
         printf(fmt, "       TX:", stats_rec->tx_packets, pps, stats_rec->tx_bytes / 1000, bps, period);
+    }
+
+    if (packets != 0 || bytes != 0)
         printf("\n");
+}
+
+static void metrics_lat_fill(struct metrics_lat* out, const struct hdr_hist* h) {
+    out->count = h->total;
+    out->sum_ns = h->sum;
+    for (unsigned int i = 0; i < METRICS_LAT_BUCKETS; i++)
+        out->le[i] = i + 1 < METRICS_LAT_BUCKETS ? hdr_hist_count_le(h, metrics_lat_bound(i)) : h->total;
+}
+
+/*
+ * Fills the snapshot the metrics socket hands out. Runs on the metrics thread and only reads what the workers publish, the
+ * XDP_STATISTICS getsockopt is the one syscall and it is made here, not on the fast path.
+ */
+void xsk_stats_collect(struct port_metrics* out) {
+    /* The stats slot and the metrics socket collect on threads of their own, these are too big for a stack */
+    static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct stats_record stats;
+    static struct ring_stats ring;
+    static struct latency_hists lat;
+    struct stats_record s;
+    struct ring_stats r;
+
+    pthread_mutex_lock(&collect_lock);
+    memset(out, 0, sizeof(*out));
+    out->version = PORT_METRICS_VERSION;
+
+    const unsigned int n = xsk_stats_aggregate(&stats, &ring, &lat);
+    for (unsigned int w = 0; w < n && w < METRICS_MAX_QUEUES; w++) {
+        const struct xsk_socket_info* xsk = workers[w];
+        struct queue_metrics* q = &out->queues[out->nr_queues++];
+
+        xsk_stats_snapshot(&xsk->shared, &s, &r);
+        q->queue_id = xsk->queue_id;
+        q->rx_packets = s.rx_packets;
+        q->rx_bytes = s.rx_bytes;
+        q->tx_packets = s.tx_packets;
+        q->tx_bytes = s.tx_bytes;
+        q->fq_reserve_fail = r.fq_reserve_fail;
+        q->tx_reserve_fail = r.tx_reserve_fail;
+        q->tx_send_fail = r.tx_send_fail;
+        q->rx_occupancy = ring_occupancy(xsk->rx.producer, xsk->rx.consumer);
+        q->fill_occupancy = ring_occupancy(xsk->umem->fq.producer, xsk->umem->fq.consumer);
+        q->tx_occupancy = ring_occupancy(xsk->tx.producer, xsk->tx.consumer);
+        q->comp_occupancy = ring_occupancy(xsk->umem->cq.producer, xsk->umem->cq.consumer);
+        xsk_get_kernel_stats(xsk, &q->kernel);
+    }
+
+    metrics_lat_fill(&out->lat[LAT_STAGE_BURST], &lat.burst);
+    metrics_lat_fill(&out->lat[LAT_STAGE_SERVICE], &lat.service);
+    metrics_lat_fill(&out->lat[LAT_STAGE_WAKE], &lat.wake);
+    metrics_lat_fill(&out->lat[LAT_STAGE_RX_TO_PROCESS], &lat.rx_to_process);
+    metrics_lat_fill(&out->lat[LAT_STAGE_RX_TO_TX], &lat.rx_to_tx);
+    phase_snapshot(out->phases);
+    pthread_mutex_unlock(&collect_lock);
+}
+
+/* Kernel side counters summed over all workers */
+static void xsk_kernel_stats_aggregate(const unsigned int n, struct xdp_statistics* out) {
+    struct xdp_statistics k;
+
+    memset(out, 0, sizeof(*out));
+    for (unsigned int w = 0; w < n; w++) {
+        if (xsk_get_kernel_stats(workers[w], &k))
+            continue;
+        out->rx_dropped += k.rx_dropped;
+        out->rx_invalid_descs += k.rx_invalid_descs;
+        out->tx_invalid_descs += k.tx_invalid_descs;
+        out->rx_ring_full += k.rx_ring_full;
+        out->rx_fill_ring_empty_descs += k.rx_fill_ring_empty_descs;
+        out->tx_ring_empty_descs += k.tx_ring_empty_descs;
     }
 }
 
 void* stats_poll(void* arg) {
-    struct xsk_socket_info* xsk = (struct xsk_socket_info*)arg;
+    (void)arg;
 
-    static struct stats_record previous_stats = {0};
+    static struct stats_record stats, previous_stats = {0};
+    static struct latency_hists lat, previous_lat = {0};
+    static struct ring_stats ring, previous_ring = {0};
+    struct xdp_statistics kernel_stats = {0}, previous_kernel_stats = {0};
 
     previous_stats.timestamp = gettime();
 
@@ -80,9 +347,23 @@ void* stats_poll(void* arg) {
     while (!global_exit_flag) {
         const unsigned int interval = 2;
         sleep(interval);
-        xsk->stats.timestamp = gettime();
-        stats_print(&xsk->stats, &previous_stats);
-        previous_stats = xsk->stats;
+
+        const unsigned int n = xsk_stats_aggregate(&stats, &ring, &lat);
+        stats.timestamp = gettime();
+
+        stats_print(&stats, &previous_stats);
+        latency_hists_print(&lat, &previous_lat);
+        ring_stats_print(&ring, &previous_ring);
+        for (unsigned int w = 0; w < n; w++)
+            ring_occupancy_print(w, workers[w]);
+
+        xsk_kernel_stats_aggregate(n, &kernel_stats);
+        kernel_stats_print(&kernel_stats, &previous_kernel_stats);
+
+        previous_stats = stats;
+        previous_lat = lat;
+        previous_ring = ring;
+        previous_kernel_stats = kernel_stats;
     }
 
     lwlog_info("Exiting stats thread");
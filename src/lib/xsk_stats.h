@@ -1,3 +1,25 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "seqlock.h"
+#include "xsk_utils.h"
+
+#define MAX_STATS_WORKERS 64
+
+struct port_metrics;
+
+uint64_t gettime(void);
+int xsk_stats_register(struct xsk_socket_info* xsk);
+void xsk_stats_snapshot(const struct xsk_worker_stats* shared, struct stats_record* stats, struct ring_stats* ring);
+void xsk_stats_collect(struct port_metrics* out);
+
+/* Called by the worker once per batch, plain stores between the two sequence bumps */
+static inline void xsk_stats_publish(struct xsk_socket_info* xsk) {
+    seqlock_write_begin(&xsk->shared.seq);
+    xsk->shared.stats = xsk->stats;
+    xsk->shared.ring = xsk->ring;
+    seqlock_write_end(&xsk->shared.seq);
+}
+
 void* stats_poll(void* arg);
\ No newline at end of file
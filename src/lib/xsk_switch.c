@@ -0,0 +1,659 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <bpf/bpf.h>
+#include <xdp/xsk.h>
+
+#include "lwlog.h"
+#include "pkt_meta.h"
+#include "steer_kern_user.h"
+#include "xdp_utils.h"
+#include "xsk_switch.h"
+#include "xsk_utils.h"
+
+/* Longest a worker sleeps without being kicked */
+enum { SWITCH_IDLE_MS = 100 };
+
+/* Or'ed into owner[] while the PHY sends the frame, the rest still names the port that sent it */
+#define OWNER_TX 0x8000
+
+struct switch_port_queue {
+    struct xsk_ring_prod rx;
+    struct xsk_ring_cons tx;
+    struct xsk_ring_cons fill;
+    struct xsk_ring_prod comp;
+    uint32_t held; /* Frames of the queue the client has, only its worker touches it */
+};
+
+struct switch_port {
+    int slot;
+    char prefix[IFNAMSIZ];
+    int region_fd;
+    void* region;
+    size_t region_size;
+    int wake_fd;
+    bool dead;          /* Set by xsk_switch_del(), the workers take the port's frames back */
+    uint64_t reclaimed; /* Queues whose worker has, bit per queue position */
+    struct switch_port_queue q[];
+};
+
+struct switch_queue {
+    int index;
+    uint32_t queue_id;
+    pthread_t thread;
+    bool running;
+    int kick_fd; /* Clients write it after ringing the doorbell while the worker sleeps */
+    int umem_fd;
+    void* buffer;
+    struct xsk_switch_doorbell* doorbell; /* Right after the UMEM in the same memfd, the clients map it along */
+    struct xsk_umem* umem;
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    struct xsk_socket* xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    uint64_t gen;     /* Bumped every round, a deleted port is freed once every gen moved */
+    uint64_t dropped; /* Frames no port took, unknown slot or its rings full */
+
+    /* Worker private */
+    uint64_t free_frames[NUM_FRAMES];
+    uint32_t nr_free;
+    uint16_t owner[NUM_FRAMES]; /* 0 while the daemon has the frame, slot + 1 of the port holding it otherwise */
+};
+
+static struct {
+    bool enabled;
+    bool stop;
+    int nr_queues;
+    struct switch_queue* queues[PHY_QUEUES_MAX];
+    struct switch_port* ports[DEVMAP_SLOTS]; /* By slot, the workers look up the port of a frame or doorbell bit here */
+    pthread_mutex_t lock; /* Serializes adding, deleting and handing over ports */
+} sw = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static const uint64_t umem_size = (uint64_t)NUM_FRAMES * FRAME_SIZE;
+static const uint64_t memfd_size = (uint64_t)NUM_FRAMES * FRAME_SIZE + XSK_SWITCH_DOORBELL_SIZE;
+
+bool xsk_switch_enabled(void) {
+    return sw.enabled;
+}
+
+static uint64_t all_queues(void) {
+    return sw.nr_queues >= 64 ? ~0ULL : (1ULL << sw.nr_queues) - 1;
+}
+
+static void switch_kick(const int fd) {
+    const uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        lwlog_err("eventfd write: %s", strerror(errno));
+}
+
+/* Daemon side ring, a deleted port gets its frames taken back the same way clients get their rings looked at */
+static void switch_ring_doorbell(struct switch_queue* q, const int slot) {
+    __atomic_fetch_or(&q->doorbell->bits[slot / 64], 1ULL << (slot % 64), __ATOMIC_SEQ_CST);
+}
+
+static void switch_free_frame(struct switch_queue* q, const uint64_t addr) {
+    if (q->nr_free < NUM_FRAMES)
+        q->free_frames[q->nr_free++] = addr - addr % FRAME_SIZE;
+}
+
+/* Frame index of addr when the port holds it, a client can't hand over frames it doesn't have */
+static int switch_held_frame(const struct switch_queue* q, const struct switch_port* port, const uint64_t addr) {
+    const uint64_t frame = addr / FRAME_SIZE;
+
+    if (frame >= NUM_FRAMES || q->owner[frame] != port->slot + 1)
+        return -1;
+    return (int)frame;
+}
+
+static void switch_refill(struct switch_queue* q) {
+    uint32_t idx;
+
+    uint32_t n = xsk_prod_nb_free(&q->fq, q->nr_free);
+    if (n > q->nr_free)
+        n = q->nr_free;
+    if (n > 0 && xsk_ring_prod__reserve(&q->fq, n, &idx) == n) {
+        for (uint32_t i = 0; i < n; i++)
+            *xsk_ring_prod__fill_addr(&q->fq, idx++) = q->free_frames[--q->nr_free];
+        xsk_ring_prod__submit(&q->fq, n);
+    }
+
+    /* With need_wakeup the driver goes back to the fill ring only when asked */
+    if (xsk_ring_prod__needs_wakeup(&q->fq))
+        recvfrom(xsk_socket__fd(q->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/*
+ * PHY tx completions go back to the port that sent them, or to the free list once it is gone. comp has room for every
+ * frame the port holds, only a client moving its consumer by hand finds it full and loses the frame.
+ */
+static unsigned int switch_complete(struct switch_queue* q) {
+    uint32_t idx, comp_idx;
+
+    const unsigned int n = xsk_ring_cons__peek(&q->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (unsigned int i = 0; i < n; i++) {
+        const uint64_t addr = *xsk_ring_cons__comp_addr(&q->cq, idx++);
+        const uint64_t frame = addr / FRAME_SIZE;
+        if (frame >= NUM_FRAMES)
+            continue;
+
+        /* A port's frames lose their slot when it is reclaimed, so a slot still here is the port that sent it */
+        const int slot = (int)(q->owner[frame] & ~OWNER_TX) - 1;
+        struct switch_port* port = slot >= 0 ? __atomic_load_n(&sw.ports[slot], __ATOMIC_ACQUIRE) : NULL;
+        if (port != NULL && !__atomic_load_n(&port->dead, __ATOMIC_ACQUIRE) && xsk_ring_prod__reserve(&port->q[q->index].comp, 1, &comp_idx) == 1) {
+            *xsk_ring_prod__fill_addr(&port->q[q->index].comp, comp_idx) = addr;
+            xsk_ring_prod__submit(&port->q[q->index].comp, 1);
+            q->owner[frame] = slot + 1;
+            continue;
+        }
+
+        if (port != NULL)
+            port->q[q->index].held--;
+        q->owner[frame] = 0;
+        switch_free_frame(q, addr);
+    }
+    xsk_ring_cons__release(&q->cq, n);
+    return n;
+}
+
+static bool switch_deliver(struct switch_queue* q, struct switch_port* port, const struct xdp_desc* desc) {
+    uint32_t idx;
+
+    if (port == NULL || __atomic_load_n(&port->dead, __ATOMIC_ACQUIRE))
+        return false;
+
+    struct switch_port_queue* pq = &port->q[q->index];
+    if (pq->held >= XSK_SWITCH_PORT_FRAMES || xsk_ring_prod__reserve(&pq->rx, 1, &idx) != 1)
+        return false;
+
+    struct xdp_desc* out = xsk_ring_prod__tx_desc(&pq->rx, idx);
+    out->addr = desc->addr;
+    out->len = desc->len;
+    out->options = 0;
+    xsk_ring_prod__submit(&pq->rx, 1);
+
+    pq->held++;
+    q->owner[desc->addr / FRAME_SIZE] = port->slot + 1;
+    return true;
+}
+
+/* Passes frames on to the port the PHY program stamped into their metadata */
+static unsigned int switch_rx(struct switch_queue* q) {
+    struct switch_port* touched[RX_BATCH_SIZE];
+    int nr_touched = 0;
+    uint32_t idx;
+
+    const unsigned int n = xsk_ring_cons__peek(&q->rx, RX_BATCH_SIZE, &idx);
+    for (unsigned int i = 0; i < n; i++) {
+        const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&q->rx, idx++);
+        const struct pkt_meta* meta = (struct pkt_meta*)((uint8_t*)xsk_umem__get_data(q->buffer, desc->addr) - sizeof(*meta));
+
+        struct switch_port* port = NULL;
+        if (meta->magic == PKT_META_MAGIC && meta->port < DEVMAP_SLOTS)
+            port = __atomic_load_n(&sw.ports[meta->port], __ATOMIC_ACQUIRE);
+
+        if (!switch_deliver(q, port, desc)) {
+            q->dropped++;
+            switch_free_frame(q, desc->addr);
+            continue;
+        }
+
+        int j = 0;
+        while (j < nr_touched && touched[j] != port)
+            j++;
+        if (j == nr_touched)
+            touched[nr_touched++] = port;
+    }
+    xsk_ring_cons__release(&q->rx, n);
+
+    /* Pairs with the fence between a client raising its rx flag and looking at the ring a last time */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < nr_touched; i++) {
+        if (xsk_ring_prod__needs_wakeup(&touched[i]->q[q->index].rx))
+            switch_kick(touched[i]->wake_fd);
+    }
+    return n;
+}
+
+/* Takes back the frames a deleted port still held on this queue, those the PHY is sending come back through the cq */
+static void switch_reclaim(struct switch_queue* q, struct switch_port* port) {
+    const uint64_t bit = 1ULL << q->index;
+
+    if (__atomic_load_n(&port->reclaimed, __ATOMIC_ACQUIRE) & bit)
+        return;
+
+    for (uint32_t frame = 0; frame < NUM_FRAMES; frame++) {
+        if (q->owner[frame] == port->slot + 1) {
+            q->owner[frame] = 0;
+            switch_free_frame(q, (uint64_t)frame * FRAME_SIZE);
+        } else if (q->owner[frame] == (OWNER_TX | (port->slot + 1))) {
+            q->owner[frame] = OWNER_TX;
+        }
+    }
+    port->q[q->index].held = 0;
+    __atomic_fetch_or(&port->reclaimed, bit, __ATOMIC_RELEASE);
+}
+
+static unsigned int switch_port_fill(struct switch_queue* q, struct switch_port* port) {
+    struct switch_port_queue* pq = &port->q[q->index];
+    uint32_t idx;
+
+    const unsigned int n = xsk_ring_cons__peek(&pq->fill, RX_BATCH_SIZE, &idx);
+    for (unsigned int i = 0; i < n; i++) {
+        const uint64_t addr = *xsk_ring_cons__comp_addr(&pq->fill, idx++);
+        const int frame = switch_held_frame(q, port, addr);
+        if (frame < 0)
+            continue;
+
+        q->owner[frame] = 0;
+        pq->held--;
+        switch_free_frame(q, addr);
+    }
+    xsk_ring_cons__release(&pq->fill, n);
+    return n;
+}
+
+static unsigned int switch_port_tx(struct switch_queue* q, struct switch_port* port) {
+    struct switch_port_queue* pq = &port->q[q->index];
+    uint32_t idx, tx_idx;
+    unsigned int i;
+
+    const unsigned int n = xsk_ring_cons__peek(&pq->tx, RX_BATCH_SIZE, &idx);
+    for (i = 0; i < n; i++) {
+        const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&pq->tx, idx + i);
+        const int frame = switch_held_frame(q, port, desc->addr);
+        if (frame < 0 || desc->addr % FRAME_SIZE + desc->len > FRAME_SIZE)
+            continue;
+
+        /* The rest waits for completions to free up the PHY's tx ring */
+        if (xsk_ring_prod__reserve(&q->tx, 1, &tx_idx) != 1)
+            break;
+
+        struct xdp_desc* out = xsk_ring_prod__tx_desc(&q->tx, tx_idx);
+        out->addr = desc->addr;
+        out->len = desc->len;
+        out->options = 0;
+        xsk_ring_prod__submit(&q->tx, 1);
+        q->owner[frame] |= OWNER_TX;
+    }
+    xsk_ring_cons__cancel(&pq->tx, n - i);
+    xsk_ring_cons__release(&pq->tx, i);
+    return i;
+}
+
+/* The rings of the ports that rang the doorbell since the last round */
+static unsigned int switch_ports(struct switch_queue* q) {
+    unsigned int work = 0, sent = 0;
+
+    for (int word = 0; word < DEVMAP_SLOTS / 64; word++) {
+        if (__atomic_load_n(&q->doorbell->bits[word], __ATOMIC_RELAXED) == 0)
+            continue;
+
+        uint64_t bits = __atomic_exchange_n(&q->doorbell->bits[word], 0, __ATOMIC_ACQUIRE);
+        while (bits != 0) {
+            const int slot = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            struct switch_port* port = __atomic_load_n(&sw.ports[slot], __ATOMIC_ACQUIRE);
+            if (port == NULL)
+                continue;
+            if (__atomic_load_n(&port->dead, __ATOMIC_ACQUIRE)) {
+                switch_reclaim(q, port);
+                continue;
+            }
+            work += switch_port_fill(q, port);
+            sent += switch_port_tx(q, port);
+
+            /* More than a batch queued, or the PHY's tx ring is full: the next round goes on with it */
+            if (xsk_cons_nb_avail(&port->q[q->index].tx, 1) > 0 || xsk_cons_nb_avail(&port->q[q->index].fill, 1) > 0)
+                switch_ring_doorbell(q, slot);
+        }
+    }
+
+    if (sent > 0 && xsk_ring_prod__needs_wakeup(&q->tx))
+        sendto(xsk_socket__fd(q->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    return work + sent;
+}
+
+static bool switch_doorbell_rung(const struct switch_queue* q) {
+    for (int word = 0; word < DEVMAP_SLOTS / 64; word++) {
+        if (__atomic_load_n(&q->doorbell->bits[word], __ATOMIC_SEQ_CST) != 0)
+            return true;
+    }
+    return false;
+}
+
+static void switch_idle(struct switch_queue* q) {
+    struct pollfd fds[2] = {
+        {.fd = xsk_socket__fd(q->xsk), .events = POLLIN},
+        {.fd = q->kick_fd, .events = POLLIN},
+    };
+    uint64_t value;
+
+    /* Flag first, then a last look: a bell rung before the client saw the flag isn't left waiting for the timeout */
+    __atomic_store_n(&q->doorbell->flags, XDP_RING_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+    if (!switch_doorbell_rung(q) && !__atomic_load_n(&sw.stop, __ATOMIC_RELAXED))
+        poll(fds, 2, SWITCH_IDLE_MS);
+    if (read(q->kick_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        lwlog_err("eventfd read: %s", strerror(errno));
+    __atomic_store_n(&q->doorbell->flags, 0, __ATOMIC_SEQ_CST);
+}
+
+static void* switch_worker(void* arg) {
+    struct switch_queue* q = arg;
+
+    while (!__atomic_load_n(&sw.stop, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&q->gen, q->gen + 1, __ATOMIC_RELEASE);
+
+        unsigned int work = switch_complete(q);
+        switch_refill(q);
+        work += switch_rx(q);
+        work += switch_ports(q);
+        if (work == 0)
+            switch_idle(q);
+    }
+    return NULL;
+}
+
+static void queue_destroy(struct switch_queue* q) {
+    if (q->xsk != NULL)
+        xsk_socket__delete(q->xsk);
+    if (q->umem != NULL)
+        xsk_umem__delete(q->umem);
+    if (q->buffer != NULL)
+        munmap(q->buffer, memfd_size);
+    if (q->umem_fd >= 0)
+        close(q->umem_fd);
+    if (q->kick_fd >= 0)
+        close(q->kick_fd);
+    free(q);
+}
+
+static struct switch_queue* queue_create(const char* ifname, const uint32_t queue_id, const int map_fd) {
+    const struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+    };
+
+    struct switch_queue* q = calloc(1, sizeof(*q));
+    if (q == NULL)
+        return NULL;
+    q->queue_id = queue_id;
+    q->umem_fd = -1;
+
+    q->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    q->umem_fd = syscall(SYS_memfd_create, "xsknet-switch", MFD_CLOEXEC);
+    if (q->kick_fd < 0 || q->umem_fd < 0 || ftruncate(q->umem_fd, memfd_size) < 0) {
+        lwlog_err("Couldn't set up switch queue %u: %s", queue_id, strerror(errno));
+        goto err;
+    }
+
+    /* Shared with every client of the queue, they map it from the memfd */
+    q->buffer = mmap(NULL, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->umem_fd, 0);
+    if (q->buffer == MAP_FAILED) {
+        q->buffer = NULL;
+        lwlog_err("Couldn't map a UMEM: %s", strerror(errno));
+        goto err;
+    }
+    q->doorbell = (struct xsk_switch_doorbell*)((char*)q->buffer + umem_size);
+
+    int ret = xsk_umem__create(&q->umem, q->buffer, umem_size, &q->fq, &q->cq, NULL);
+    if (ret) {
+        q->umem = NULL;
+        lwlog_err("Couldn't register a UMEM: %s", strerror(-ret));
+        goto err;
+    }
+
+    ret = xsk_socket__create(&q->xsk, ifname, queue_id, q->umem, &q->rx, &q->tx, &cfg);
+    if (ret) {
+        q->xsk = NULL;
+        lwlog_err("Couldn't bind an XSK to %s queue %u: %s", ifname, queue_id, strerror(-ret));
+        goto err;
+    }
+
+    for (uint32_t i = 0; i < NUM_FRAMES; i++)
+        q->free_frames[q->nr_free++] = (uint64_t)(NUM_FRAMES - 1 - i) * FRAME_SIZE;
+    switch_refill(q);
+
+    if (xsk_socket__update_xskmap(q->xsk, map_fd)) {
+        lwlog_err("Couldn't publish the switch XSK of %s queue %u: %s", ifname, queue_id, strerror(errno));
+        goto err;
+    }
+    return q;
+
+err:
+    queue_destroy(q);
+    return NULL;
+}
+
+int xsk_switch_init(const char* ifname) {
+    const int nr = phy_rx_queue_count(ifname);
+    sw.nr_queues = nr <= 0 ? 1 : nr < PHY_QUEUES_MAX ? nr : PHY_QUEUES_MAX;
+
+    const int map_fd = open_phy_map("switch_xsks");
+    if (map_fd < 0)
+        return -1;
+
+    for (int i = 0; i < sw.nr_queues; i++) {
+        sw.queues[i] = queue_create(ifname, i, map_fd);
+        if (sw.queues[i] == NULL) {
+            close(map_fd);
+            xsk_switch_destroy();
+            return -1;
+        }
+        sw.queues[i]->index = i;
+    }
+    close(map_fd);
+
+    for (int i = 0; i < sw.nr_queues; i++) {
+        const int err = pthread_create(&sw.queues[i]->thread, NULL, switch_worker, sw.queues[i]);
+        if (err != 0) {
+            lwlog_err("pthread_create: %s", strerror(err));
+            xsk_switch_destroy();
+            return -1;
+        }
+        sw.queues[i]->running = true;
+    }
+
+    sw.enabled = true;
+    lwlog_info("Switching %s over %d queues", ifname, sw.nr_queues);
+    return 0;
+}
+
+static void port_destroy(struct switch_port* port) {
+    if (port->region != NULL)
+        munmap(port->region, port->region_size);
+    if (port->region_fd >= 0)
+        close(port->region_fd);
+    if (port->wake_fd >= 0)
+        close(port->wake_fd);
+    free(port);
+}
+
+void xsk_switch_destroy(void) {
+    __atomic_store_n(&sw.stop, true, __ATOMIC_RELAXED);
+    sw.enabled = false;
+
+    /* Off the PHY program first, it falls back to the devmap while the sockets go away */
+    const int map_fd = open_phy_map("switch_xsks");
+    for (int i = 0; i < sw.nr_queues; i++) {
+        struct switch_queue* q = sw.queues[i];
+        if (q == NULL)
+            continue;
+        if (map_fd >= 0)
+            bpf_map_delete_elem(map_fd, &q->queue_id);
+        if (q->running) {
+            switch_kick(q->kick_fd);
+            pthread_join(q->thread, NULL);
+        }
+        if (q->dropped > 0)
+            lwlog_info("Switch queue %u dropped %llu frames", q->queue_id, (unsigned long long)q->dropped);
+        queue_destroy(q);
+        sw.queues[i] = NULL;
+    }
+    if (map_fd >= 0)
+        close(map_fd);
+
+    for (int slot = 0; slot < DEVMAP_SLOTS; slot++) {
+        if (sw.ports[slot] != NULL)
+            port_destroy(sw.ports[slot]);
+        sw.ports[slot] = NULL;
+    }
+}
+
+int xsk_switch_add(const int slot, const char* prefix) {
+    if (!sw.enabled || slot < 0 || slot >= DEVMAP_SLOTS)
+        return -1;
+
+    struct switch_port* port = calloc(1, sizeof(*port) + sw.nr_queues * sizeof(port->q[0]));
+    if (port == NULL)
+        return -1;
+    port->slot = slot;
+    snprintf(port->prefix, sizeof(port->prefix), "%s", prefix);
+    port->region_size = XSK_SWITCH_RING_OFF(sw.nr_queues, 0);
+
+    port->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    port->region_fd = syscall(SYS_memfd_create, "xsknet-rings", MFD_CLOEXEC);
+    if (port->wake_fd < 0 || port->region_fd < 0 || ftruncate(port->region_fd, port->region_size) < 0) {
+        lwlog_err("Couldn't set up the rings of %s: %s", prefix, strerror(errno));
+        goto err;
+    }
+
+    port->region = mmap(NULL, port->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, port->region_fd, 0);
+    if (port->region == MAP_FAILED) {
+        port->region = NULL;
+        lwlog_err("Couldn't map the rings of %s: %s", prefix, strerror(errno));
+        goto err;
+    }
+
+    for (int i = 0; i < sw.nr_queues; i++) {
+        XSK_SWITCH_MAP_RING(port->region, i, XSK_SWITCH_RX, &port->q[i].rx, true);
+        XSK_SWITCH_MAP_RING(port->region, i, XSK_SWITCH_TX, &port->q[i].tx, false);
+        XSK_SWITCH_MAP_RING(port->region, i, XSK_SWITCH_FILL, &port->q[i].fill, false);
+        XSK_SWITCH_MAP_RING(port->region, i, XSK_SWITCH_COMP, &port->q[i].comp, true);
+    }
+
+    pthread_mutex_lock(&sw.lock);
+    if (sw.ports[slot] != NULL) {
+        pthread_mutex_unlock(&sw.lock);
+        lwlog_err("Slot %d already has switch port %s", slot, sw.ports[slot]->prefix);
+        goto err;
+    }
+    __atomic_store_n(&sw.ports[slot], port, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sw.lock);
+
+    lwlog_info("Switch port %s on slot %d, %d queues", prefix, slot, sw.nr_queues);
+    return 0;
+
+err:
+    port_destroy(port);
+    return -1;
+}
+
+/* Returns once every worker started a round after the call, none can still be looking at a port unpublished before it */
+static void switch_quiesce(void) {
+    uint64_t gens[PHY_QUEUES_MAX];
+
+    for (int i = 0; i < sw.nr_queues; i++) {
+        gens[i] = __atomic_load_n(&sw.queues[i]->gen, __ATOMIC_ACQUIRE);
+        switch_kick(sw.queues[i]->kick_fd);
+    }
+    for (int i = 0; i < sw.nr_queues; i++) {
+        while (__atomic_load_n(&sw.queues[i]->gen, __ATOMIC_ACQUIRE) == gens[i] && !__atomic_load_n(&sw.stop, __ATOMIC_RELAXED))
+            usleep(100);
+    }
+}
+
+int xsk_switch_del(const int slot) {
+    if (!sw.enabled || slot < 0 || slot >= DEVMAP_SLOTS)
+        return -1;
+
+    pthread_mutex_lock(&sw.lock);
+    struct switch_port* port = sw.ports[slot];
+    if (port == NULL) {
+        pthread_mutex_unlock(&sw.lock);
+        return -1;
+    }
+
+    /* Every worker gives the port's frames back to its queue before the rings go away */
+    __atomic_store_n(&port->dead, true, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&port->reclaimed, __ATOMIC_ACQUIRE) != all_queues() && !__atomic_load_n(&sw.stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < sw.nr_queues; i++) {
+            switch_ring_doorbell(sw.queues[i], slot);
+            switch_kick(sw.queues[i]->kick_fd);
+        }
+        usleep(1000);
+    }
+
+    __atomic_store_n(&sw.ports[slot], NULL, __ATOMIC_RELEASE);
+    switch_quiesce();
+    pthread_mutex_unlock(&sw.lock);
+
+    lwlog_info("Removed switch port %s from slot %d", port->prefix, slot);
+    port_destroy(port);
+    return 0;
+}
+
+uint64_t xsk_switch_queues(const int slot) {
+    if (!sw.enabled || slot < 0 || slot >= DEVMAP_SLOTS)
+        return 0;
+
+    const struct switch_port* port = __atomic_load_n(&sw.ports[slot], __ATOMIC_ACQUIRE);
+    return port != NULL ? all_queues() : 0;
+}
+
+int xsk_switch_handover(const int slot, struct ctl_fds* fds, char* layout, const size_t size) {
+    int err = -1;
+
+    fds->nr = 0;
+    if (!sw.enabled || slot < 0 || slot >= DEVMAP_SLOTS || 2 + 2 * sw.nr_queues > CTL_FDS_MAX)
+        return -1;
+
+    pthread_mutex_lock(&sw.lock);
+    const struct switch_port* port = sw.ports[slot];
+    if (port == NULL)
+        goto out;
+
+    /* Copies, the daemon keeps its own for the workers and later clients of the port */
+    fds->fds[fds->nr++] = fcntl(port->region_fd, F_DUPFD_CLOEXEC, 0);
+    fds->fds[fds->nr++] = fcntl(port->wake_fd, F_DUPFD_CLOEXEC, 0);
+    for (int i = 0; i < sw.nr_queues; i++) {
+        fds->fds[fds->nr++] = fcntl(sw.queues[i]->kick_fd, F_DUPFD_CLOEXEC, 0);
+        fds->fds[fds->nr++] = fcntl(sw.queues[i]->umem_fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    for (int i = 0; i < fds->nr; i++) {
+        if (fds->fds[i] < 0) {
+            for (int j = 0; j < fds->nr; j++) {
+                if (fds->fds[j] >= 0)
+                    close(fds->fds[j]);
+            }
+            fds->nr = 0;
+            goto out;
+        }
+    }
+
+    snprintf(layout, size, "xsk frames=%d frame_size=%d rx=%d tx=%d fill=%d comp=%d slot=%d", NUM_FRAMES, FRAME_SIZE, XSK_SWITCH_RING_SIZE,
+             XSK_SWITCH_RING_SIZE, XSK_SWITCH_RING_SIZE, XSK_SWITCH_COMP_SIZE, slot);
+    err = 0;
+
+out:
+    pthread_mutex_unlock(&sw.lock);
+    return err;
+}
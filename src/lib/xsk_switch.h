@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/if_xdp.h>
+
+#include "ctl_proto.h"
+#include "steer_kern_user.h"
+
+/*
+ * Daemon-hosted switch (--switch). The daemon binds one XSK per PHY RX queue and the PHY program steers frames into it, the
+ * port's slot in pkt_meta.port. A worker per queue passes each frame's descriptor on to the port, so a port is a few pages of
+ * rings instead of a veth pair and frames never leave the UMEM of the queue they arrived on.
+ *
+ * A port has four rings per queue, laid out like XSK rings so the client drives them with the same xsk_ring_* helpers:
+ *   rx    daemon -> client, frames steered to the port
+ *   tx    client -> daemon, frames to send out of the PHY
+ *   fill  client -> daemon, frames the client is done with
+ *   comp  daemon -> client, tx frames the PHY sent, the client hands them back through fill
+ * Every client of a queue maps the queue's whole UMEM, so ports of one switch can read and write each other's frames. Veth ports stay
+ * the choice where clients don't trust each other.
+ */
+#define XSK_SWITCH_RING_SIZE 256
+
+/* Frames a port may hold on one queue, a stalled client can't take the frames of the others */
+#define XSK_SWITCH_PORT_FRAMES 512
+
+/* Every frame the port holds may come back through comp at once, so a completion always finds room */
+#define XSK_SWITCH_COMP_SIZE XSK_SWITCH_PORT_FRAMES
+
+enum xsk_switch_ring {
+    XSK_SWITCH_RX = 0,
+    XSK_SWITCH_TX,
+    XSK_SWITCH_FILL,
+    XSK_SWITCH_COMP,
+    XSK_SWITCH_RINGS,
+};
+
+/* Within a ring: producer, consumer and flags on cache lines of their own, then the descriptors */
+#define XSK_SWITCH_OFF_PRODUCER 0
+#define XSK_SWITCH_OFF_CONSUMER 64
+#define XSK_SWITCH_OFF_FLAGS 128
+#define XSK_SWITCH_OFF_DESC 192
+
+#define XSK_SWITCH_RING_ENTRIES(r) ((r) == XSK_SWITCH_COMP ? XSK_SWITCH_COMP_SIZE : XSK_SWITCH_RING_SIZE)
+/* rx and tx carry struct xdp_desc, fill and comp a bare address. Every ring is a whole number of cache lines */
+#define XSK_SWITCH_RING_BYTES(r) \
+    (XSK_SWITCH_OFF_DESC + (size_t)XSK_SWITCH_RING_ENTRIES(r) * ((r) == XSK_SWITCH_RX || (r) == XSK_SWITCH_TX ? 16 : 8))
+#define XSK_SWITCH_QUEUE_BYTES                                                                           \
+    (XSK_SWITCH_RING_BYTES(XSK_SWITCH_RX) + XSK_SWITCH_RING_BYTES(XSK_SWITCH_TX) + XSK_SWITCH_RING_BYTES(XSK_SWITCH_FILL) + \
+     XSK_SWITCH_RING_BYTES(XSK_SWITCH_COMP))
+
+/* Ring r of the queue at position i of the port's binding, the rings of a queue sit back to back */
+#define XSK_SWITCH_RING_OFF(i, r)                                                                        \
+    ((size_t)(i) * XSK_SWITCH_QUEUE_BYTES + ((r) > XSK_SWITCH_RX ? XSK_SWITCH_RING_BYTES(XSK_SWITCH_RX) : 0) + \
+     ((r) > XSK_SWITCH_TX ? XSK_SWITCH_RING_BYTES(XSK_SWITCH_TX) : 0) + ((r) > XSK_SWITCH_FILL ? XSK_SWITCH_RING_BYTES(XSK_SWITCH_FILL) : 0))
+
+/* Points an xsk_ring_prod or xsk_ring_cons at ring r of queue position i, the producer end sees every free slot */
+#define XSK_SWITCH_MAP_RING(region, i, r, rg, prod)                                                    \
+    do {                                                                                               \
+        char* base_ = (char*)(region) + XSK_SWITCH_RING_OFF(i, r);                                     \
+        (rg)->mask = XSK_SWITCH_RING_ENTRIES(r) - 1;                                                   \
+        (rg)->size = XSK_SWITCH_RING_ENTRIES(r);                                                       \
+        (rg)->producer = (uint32_t*)(base_ + XSK_SWITCH_OFF_PRODUCER);                                 \
+        (rg)->consumer = (uint32_t*)(base_ + XSK_SWITCH_OFF_CONSUMER);                                 \
+        (rg)->flags = (uint32_t*)(base_ + XSK_SWITCH_OFF_FLAGS);                                       \
+        (rg)->ring = base_ + XSK_SWITCH_OFF_DESC;                                                      \
+        (rg)->cached_prod = *(rg)->producer;                                                           \
+        (rg)->cached_cons = *(rg)->consumer + ((prod) ? XSK_SWITCH_RING_ENTRIES(r) : 0);               \
+    } while (0)
+
+/*
+ * The page past a queue's UMEM in its memfd. A client sets its slot's bit after queueing tx or fill and the worker only
+ * looks at the rings of ports it finds rung, so a round costs the same with one port or thousands. flags has
+ * XDP_RING_NEED_WAKEUP while the worker sleeps, the client then writes the queue's kick eventfd as well.
+ */
+#define XSK_SWITCH_DOORBELL_SIZE 4096
+
+struct xsk_switch_doorbell {
+    uint32_t flags;
+    uint64_t bits[DEVMAP_SLOTS / 64] __attribute__((aligned(64)));
+};
+
+_Static_assert(sizeof(struct xsk_switch_doorbell) <= XSK_SWITCH_DOORBELL_SIZE, "doorbell outgrew its page");
+
+/* Client side: rings slot's bit, true when the worker sleeps and needs a kick too */
+static inline bool xsk_switch_ring_doorbell(struct xsk_switch_doorbell* db, const int slot) {
+    /* Pairs with the worker raising flags before a last look at the bits */
+    __atomic_fetch_or(&db->bits[slot / 64], 1ULL << (slot % 64), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&db->flags, __ATOMIC_SEQ_CST) & XDP_RING_NEED_WAKEUP;
+}
+
+static inline bool xsk_switch_sleeping(const struct xsk_switch_doorbell* db) {
+    return __atomic_load_n(&db->flags, __ATOMIC_SEQ_CST) & XDP_RING_NEED_WAKEUP;
+}
+
+/* Daemon side: binds an XSK to every RX queue of ifname and starts their workers */
+int xsk_switch_init(const char* ifname);
+/* Stops the workers and releases the XSKs, ports still around lose their frames */
+void xsk_switch_destroy(void);
+bool xsk_switch_enabled(void);
+
+/* Gives the port in slot its rings, frames steered to the slot go there from now on */
+int xsk_switch_add(int slot, const char* prefix);
+/* Takes the port's frames back and frees its rings, -1 when slot isn't a switch port */
+int xsk_switch_del(int slot);
+/* Switch queues the port in slot is served on, 0 when it isn't a switch port */
+uint64_t xsk_switch_queues(int slot);
+
+/*
+ * Fills fds for the attach reply: the port's ring region, the eventfd the daemon wakes the client with, then per queue the
+ * eventfd waking that queue's worker and the queue's memfd, UMEM then doorbell. Writes the layout as an "xsk .." line, ring
+ * sizes and the port's slot included.
+ */
+int xsk_switch_handover(int slot, struct ctl_fds* fds, char* layout, size_t size);
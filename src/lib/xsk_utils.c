@@ -3,13 +3,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <net/if.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <linux/if_ether.h>
 
 #include "veth_list.h"
 #include "xdp_utils.h"
 #include "xsk_utils.h"
 #include "xsk_receive.h"
+#include "xsk_stats.h"
+#include "xsk_switch.h"
 #include "lwlog.h"
 
 void set_memory_limit() {
@@ -20,12 +24,14 @@ void set_memory_limit() {
     }
 }
 
+/* The raw socket sends whole frames, the addressing comes from the frame the PHY's egress program already rewrote */
 void init_iface(struct egress_sock* egress, const char* phy_ifname) {
     egress->addr = calloc(1, sizeof(*egress->addr));
 
-    get_mac_address(egress->addr->sll_addr, phy_ifname);
-    egress->addr->sll_halen = ETH_ALEN;
+    egress->addr->sll_family = AF_PACKET;
     egress->addr->sll_ifindex = if_nametoindex(phy_ifname);
+    /* Opened by rx_and_process() unless the daemon handed one over */
+    egress->sockfd = -1;
 }
 
 static struct xsk_umem_info* configure_xsk_umem(void* buffer, uint64_t size) {
@@ -52,18 +58,43 @@ static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info* xsk) {
     return frame;
 }
 
-static struct xsk_socket_info* xsk_configure_socket(const char* ifname, struct xsk_umem_info* umem) {
+/* Hands the UMEM's frames to the allocator and stuffs the receive path with fill of them, we assume we have enough */
+static int xsk_stock_fill_ring(struct xsk_socket_info* xsk_info, const uint32_t frames, const uint32_t fill) {
+    uint32_t idx;
+
+    for (uint32_t i = 0; i < frames; i++)
+        xsk_info->umem_frame_addr[i] = (uint64_t)i * FRAME_SIZE;
+
+    xsk_info->umem_frame_free = frames;
+
+    const uint32_t ret = xsk_ring_prod__reserve(&xsk_info->umem->fq, fill, &idx);
+    if (ret != fill) {
+        lwlog_crit("ERROR: Can't reserve enough space for fill queue \"%s\"", strerror(errno));
+        return -ENOSPC;
+    }
+
+    for (uint32_t i = 0; i < fill; i++)
+        *xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) = xsk_alloc_umem_frame(xsk_info);
+
+    xsk_ring_prod__submit(&xsk_info->umem->fq, fill);
+    return 0;
+}
+
+/* Binds an XSK to queue_id of ifname and registers it in the XSKMAP map_name pinned under pin_basedir/map_dir */
+static struct xsk_socket_info* xsk_configure_socket(const char* ifname, const uint32_t queue_id, const char* map_dir, const char* map_name,
+                                                    struct xsk_umem_info* umem) {
     struct xsk_socket_config xsk_cfg;
     struct bpf_map_info info = {0};
-    uint32_t idx;
-    int i;
     int ifindex = if_nametoindex(ifname);
 
-    struct xsk_socket_info* xsk_info = calloc(1, sizeof(*xsk_info));
-    if (!xsk_info)
+    /* Aligned so the published stats get cache lines of their own */
+    struct xsk_socket_info* xsk_info;
+    if (posix_memalign((void**)&xsk_info, CACHE_LINE_SIZE, sizeof(*xsk_info)))
         return NULL;
+    memset(xsk_info, 0, sizeof(*xsk_info));
 
     xsk_info->umem = umem;
+    xsk_info->queue_id = queue_id;
     xsk_cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
     xsk_cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
     xsk_cfg.xdp_flags = 0;
@@ -71,15 +102,14 @@ static struct xsk_socket_info* xsk_configure_socket(const char* ifname, struct x
     xsk_cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
     lwlog_info("Creating AF_XDP socket on %s ifindex %d", ifname, ifindex);
     /* Create the AF_XDP socket */
-    int ret = xsk_socket__create(&xsk_info->xsk, ifname, 0, umem->umem, &xsk_info->rx, &xsk_info->tx, &xsk_cfg);
+    int ret = xsk_socket__create(&xsk_info->xsk, ifname, xsk_info->queue_id, umem->umem, &xsk_info->rx, &xsk_info->tx, &xsk_cfg);
     if (ret) {
         lwlog_crit("ERROR: Can't create xsk socket \"%s\"", strerror(errno));
         goto error_exit;
     }
 
     char pin_dir[PATH_MAX];
-    /* Use the --dev name as subdir for finding pinned maps */
-    const int len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, ifname);
+    const int len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, map_dir);
     if (len < 0) {
         fprintf(stderr, "ERR: creating pin dirname\n");
         return NULL;
@@ -87,7 +117,7 @@ static struct xsk_socket_info* xsk_configure_socket(const char* ifname, struct x
 
     /* Get xsk_map fd from pinned map */
 
-    const int xsk_map_fd = open_bpf_map_file(pin_dir, "xsks_map", &info);
+    const int xsk_map_fd = open_bpf_map_file(pin_dir, map_name, &info);
     if (xsk_map_fd < 0) {
         lwlog_crit("ERROR: Can't open xskmap \"%s\"", strerror(errno));
         goto error_exit;
@@ -100,24 +130,13 @@ static struct xsk_socket_info* xsk_configure_socket(const char* ifname, struct x
         goto error_exit;
     }
 
-    /* Initialize umem frame allocation */
-    for (i = 0; i < NUM_FRAMES; i++)
-        xsk_info->umem_frame_addr[i] = i * FRAME_SIZE;
-
-    xsk_info->umem_frame_free = NUM_FRAMES;
-
-    /* Stuff the receive path with buffers, we assume we have enough */
-    ret = xsk_ring_prod__reserve(&xsk_info->umem->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS, &idx);
-
-    if (ret != XSK_RING_PROD__DEFAULT_NUM_DESCS) {
-        lwlog_crit("ERROR: Can't reserve enough space for fill queue \"%s\"", strerror(errno));
+    xsk_info->fd = xsk_socket__fd(xsk_info->xsk);
+    xsk_info->kick_fd = -1;
+    ret = xsk_stock_fill_ring(xsk_info, NUM_FRAMES, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    if (ret)
         goto error_exit;
-    }
 
-    for (i = 0; i < XSK_RING_PROD__DEFAULT_NUM_DESCS; i++)
-        *xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) = xsk_alloc_umem_frame(xsk_info);
-
-    xsk_ring_prod__submit(&xsk_info->umem->fq, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    xsk_stats_register(xsk_info);
 
     return xsk_info;
 
@@ -126,7 +145,7 @@ error_exit:
     return NULL;
 }
 
-struct xsk_socket_info* init_xsk_socket(const char* prefix) {
+static struct xsk_umem_info* init_umem(void) {
     void* buffer;
 
     const uint64_t size = NUM_FRAMES * FRAME_SIZE;
@@ -147,13 +166,180 @@ struct xsk_socket_info* init_xsk_socket(const char* prefix) {
         exit(EXIT_FAILURE);
     }
 
+    return umem;
+}
+
+struct xsk_socket_info* init_xsk_socket(const char* prefix, const uint32_t queue_id) {
+    struct xsk_umem_info* umem = init_umem();
+
     char* ifname;
     ifname = calloc(1, IF_NAMESIZE);
     snprintf(ifname, IF_NAMESIZE, "%s_inner", prefix);
 
-    struct xsk_socket_info* xsk = xsk_configure_socket(ifname, umem);
+    /* The inner veth's own pin directory holds its xsks_map */
+    struct xsk_socket_info* xsk = xsk_configure_socket(ifname, queue_id, ifname, "xsks_map", umem);
 
     free(ifname);
 
     return xsk;
-}
\ No newline at end of file
+}
+
+struct xsk_socket_info* init_xsk_socket_direct(const char* phy_ifname, const uint32_t queue_id) {
+    struct xsk_umem_info* umem = init_umem();
+
+    return xsk_configure_socket(phy_ifname, queue_id, phy_ifname, "phy_xsks_map", umem);
+}
+
+/* Maps one ring of an XSK the daemon set up, the same way libxdp does for sockets it creates */
+static void* xsk_map_ring(const int fd, const struct xdp_ring_offset* off, const uint32_t nr, const size_t desc_size, const off_t pgoff,
+                          __u32** producer, __u32** consumer, __u32** flags) {
+    void* map = mmap(NULL, off->desc + nr * desc_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *producer = (__u32*)((char*)map + off->producer);
+    *consumer = (__u32*)((char*)map + off->consumer);
+    *flags = (__u32*)((char*)map + off->flags);
+    return (char*)map + off->desc;
+}
+
+#define XSK_MAP_RING(fd, off, nr, desc, pgoff, r) \
+    ((r)->mask = (nr) - 1, (r)->size = (nr), (r)->ring = xsk_map_ring(fd, off, nr, desc, pgoff, &(r)->producer, &(r)->consumer, &(r)->flags))
+
+struct xsk_socket_info* xsk_socket_adopt(const int xsk_fd, const int umem_fd, const uint32_t queue_id, const struct xsk_layout* layout) {
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+
+    /* Frame bookkeeping is sized at compile time, a daemon with bigger UMEMs or other frames has to be refused */
+    if (layout->frames > NUM_FRAMES || layout->frame_size != FRAME_SIZE || layout->fill > layout->frames) {
+        lwlog_err("XSK layout from daemon doesn't match this client");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (getsockopt(xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+        return NULL;
+
+    struct xsk_umem_info* umem = calloc(1, sizeof(*umem));
+    struct xsk_socket_info* xsk_info;
+    if (umem == NULL || posix_memalign((void**)&xsk_info, CACHE_LINE_SIZE, sizeof(*xsk_info))) {
+        free(umem);
+        return NULL;
+    }
+    memset(xsk_info, 0, sizeof(*xsk_info));
+
+    umem->buffer = mmap(NULL, (size_t)layout->frames * layout->frame_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, umem_fd, 0);
+    if (umem->buffer == MAP_FAILED)
+        goto err;
+
+    XSK_MAP_RING(xsk_fd, &off.fr, layout->fill, sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING, &umem->fq);
+    XSK_MAP_RING(xsk_fd, &off.cr, layout->comp, sizeof(__u64), XDP_UMEM_PGOFF_COMPLETION_RING, &umem->cq);
+    XSK_MAP_RING(xsk_fd, &off.rx, layout->rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &xsk_info->rx);
+    XSK_MAP_RING(xsk_fd, &off.tx, layout->tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING, &xsk_info->tx);
+    if (umem->fq.ring == NULL || umem->cq.ring == NULL || xsk_info->rx.ring == NULL || xsk_info->tx.ring == NULL)
+        goto err;
+
+    /* Producers see every free slot, consumers nothing yet */
+    umem->fq.cached_prod = *umem->fq.producer;
+    umem->fq.cached_cons = *umem->fq.consumer + layout->fill;
+    umem->cq.cached_prod = *umem->cq.producer;
+    umem->cq.cached_cons = *umem->cq.consumer;
+    xsk_info->rx.cached_prod = *xsk_info->rx.producer;
+    xsk_info->rx.cached_cons = *xsk_info->rx.consumer;
+    xsk_info->tx.cached_prod = *xsk_info->tx.producer;
+    xsk_info->tx.cached_cons = *xsk_info->tx.consumer + layout->tx;
+
+    xsk_info->umem = umem;
+    xsk_info->fd = xsk_fd;
+    xsk_info->kick_fd = -1;
+    xsk_info->queue_id = queue_id;
+    if (xsk_stock_fill_ring(xsk_info, layout->frames, layout->fill))
+        goto err;
+
+    xsk_stats_register(xsk_info);
+    lwlog_info("Adopted the daemon's XSK for queue %u", queue_id);
+    return xsk_info;
+
+err:
+    /* The process gives up on a failed adoption, the mappings go with it */
+    lwlog_crit("Couldn't map the XSK of queue %u: %s", queue_id, strerror(errno));
+    free(xsk_info);
+    free(umem);
+    return NULL;
+}
+
+/* The rings of one switch queue, the frames arrive on rx so the allocator starts out empty */
+static struct xsk_socket_info* xsk_switch_adopt(void* region, const int index, const int kick_fd, const int umem_fd, const int wake_fd,
+                                                const int slot, const uint32_t queue_id) {
+    struct xsk_umem_info* umem = calloc(1, sizeof(*umem));
+    struct xsk_socket_info* xsk_info;
+    if (umem == NULL || posix_memalign((void**)&xsk_info, CACHE_LINE_SIZE, sizeof(*xsk_info))) {
+        free(umem);
+        return NULL;
+    }
+    memset(xsk_info, 0, sizeof(*xsk_info));
+
+    /* The queue's doorbell page follows the UMEM */
+    umem->buffer = mmap(NULL, (size_t)NUM_FRAMES * FRAME_SIZE + XSK_SWITCH_DOORBELL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, umem_fd, 0);
+    close(umem_fd);
+    if (umem->buffer == MAP_FAILED) {
+        lwlog_crit("Couldn't map the UMEM of switch queue %u: %s", queue_id, strerror(errno));
+        free(xsk_info);
+        free(umem);
+        return NULL;
+    }
+
+    XSK_SWITCH_MAP_RING(region, index, XSK_SWITCH_RX, &xsk_info->rx, false);
+    XSK_SWITCH_MAP_RING(region, index, XSK_SWITCH_TX, &xsk_info->tx, true);
+    XSK_SWITCH_MAP_RING(region, index, XSK_SWITCH_FILL, &umem->fq, true);
+    XSK_SWITCH_MAP_RING(region, index, XSK_SWITCH_COMP, &umem->cq, false);
+
+    xsk_info->umem = umem;
+    xsk_info->fd = wake_fd;
+    xsk_info->kick_fd = kick_fd;
+    xsk_info->doorbell = (struct xsk_switch_doorbell*)((char*)umem->buffer + (size_t)NUM_FRAMES * FRAME_SIZE);
+    xsk_info->slot = slot;
+    xsk_info->queue_id = queue_id;
+    xsk_info->umem_frame_free = 0;
+
+    xsk_stats_register(xsk_info);
+    return xsk_info;
+}
+
+int xsk_switch_attach(const struct ctl_fds* fds, char* queues, const struct xsk_layout* layout, struct xsk_socket_info** xsks, const int max) {
+    int nr = 0;
+
+    if (layout->frames != NUM_FRAMES || layout->frame_size != FRAME_SIZE || layout->rx != XSK_SWITCH_RING_SIZE || layout->tx != XSK_SWITCH_RING_SIZE ||
+        layout->fill != XSK_SWITCH_RING_SIZE || layout->comp != XSK_SWITCH_COMP_SIZE || layout->slot < 0 || layout->slot >= DEVMAP_SLOTS || fds->nr < 4 ||
+        (fds->nr - 2) % 2 != 0) {
+        lwlog_err("Switch layout from daemon doesn't match this client");
+        return -1;
+    }
+
+    const int nr_queues = (fds->nr - 2) / 2;
+    const size_t region_size = XSK_SWITCH_RING_OFF(nr_queues, 0);
+    void* region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds->fds[0], 0);
+    close(fds->fds[0]);
+    if (region == MAP_FAILED) {
+        lwlog_crit("Couldn't map the switch rings: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Same order as the kick and UMEM fds, queue position i has the rings at XSK_SWITCH_RING_OFF(i, ..) */
+    for (char* queue = strtok(queues, ","); queue != NULL && nr < max && nr < nr_queues; queue = strtok(NULL, ",")) {
+        xsks[nr] = xsk_switch_adopt(region, nr, fds->fds[2 + 2 * nr], fds->fds[3 + 2 * nr], fds->fds[1], layout->slot, atoi(queue));
+        if (xsks[nr] == NULL)
+            return -1;
+        nr++;
+    }
+
+    lwlog_info("Attached to the daemon's switch on %d queues", nr);
+    return nr;
+}
+
+int xsk_layout_parse(const char* line, struct xsk_layout* layout) {
+    layout->slot = -1;
+    const int n = sscanf(line, "xsk frames=%u frame_size=%u rx=%u tx=%u fill=%u comp=%u slot=%d", &layout->frames, &layout->frame_size, &layout->rx,
+                         &layout->tx, &layout->fill, &layout->comp, &layout->slot);
+    return n >= 6 ? 0 : -1;
+}
@@ -2,11 +2,17 @@
 
 #include <xdp/xsk.h>
 
+#include "ctl_proto.h"
+#include "hdr_hist.h"
+
 
 #define NUM_FRAMES 4096
 #define FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
 #define RX_BATCH_SIZE 64
 #define INVALID_UMEM_FRAME UINT64_MAX
+/* Batch size buckets: empty, 1, 2-3, 4-7, ..., RX_BATCH_SIZE */
+#define BATCH_HIST_BUCKETS 8
+#define CACHE_LINE_SIZE 64
 
 struct xsk_umem_info {
     struct xsk_ring_prod fq;
@@ -21,20 +27,90 @@ struct stats_record {
     uint64_t tx_packets;
     uint64_t tx_bytes;
 };
+/* Ring level counters, written only by the RX thread */
+struct ring_stats {
+    uint64_t rx_batch[BATCH_HIST_BUCKETS]; /* sizes returned by xsk_ring_cons__peek() on the RX ring */
+    uint64_t cq_batch[BATCH_HIST_BUCKETS]; /* sizes returned by xsk_ring_cons__peek() on the completion ring */
+    uint64_t fq_reserve_fail;              /* xsk_ring_prod__reserve() on the fill ring came back short */
+    uint64_t tx_reserve_fail;              /* xsk_ring_prod__reserve() on the TX ring came back short */
+    uint64_t tx_send_fail;                 /* sendto() on the egress socket failed, the frame was dropped */
+};
+/* Latency distributions in ns, written only by the RX thread */
+struct latency_hists {
+    struct hdr_hist burst;         /* one handle_receive_packets() call */
+    struct hdr_hist service;       /* one process_packet() call */
+    struct hdr_hist wake;          /* poll() wakeup -> first packet of the batch processed */
+    struct hdr_hist rx_to_process; /* XDP ingress stamp -> process_packet() */
+    struct hdr_hist rx_to_tx;      /* XDP ingress stamp -> reply handed to the egress socket */
+};
+/*
+ * What one worker publishes for the stats thread. The worker accumulates into the private copies in xsk_socket_info and
+ * copies them here under the seqlock once per batch, so readers get a consistent view of all counters and never pull the
+ * cache lines holding the ring state away from the worker.
+ */
+struct xsk_worker_stats {
+    uint32_t seq;
+    struct stats_record stats;
+    struct ring_stats ring;
+
+    /* Not covered by seq, every bucket is a single-writer counter on its own */
+    struct latency_hists lat __attribute__((aligned(CACHE_LINE_SIZE)));
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 struct xsk_socket_info {
     struct xsk_ring_cons rx;
     struct xsk_ring_prod tx;
     struct xsk_umem_info* umem;
-    struct xsk_socket* xsk;
+    struct xsk_socket* xsk; /* NULL for a socket handed over by the daemon */
+    int fd;
+    int kick_fd; /* Switch ports: wakes the daemon's worker for tx, -1 for a real XSK */
+    struct xsk_switch_doorbell* doorbell; /* Switch ports: the queue's doorbell, slot is the port's bit in it */
+    int slot;
+    bool doorbell_due; /* Switch ports: tx or fill queued since the doorbell last rang */
+    uint32_t queue_id;
 
     uint64_t umem_frame_addr[NUM_FRAMES];
     uint32_t umem_frame_free;
 
     uint32_t outstanding_tx;
 
+    /* Worker private, see struct xsk_worker_stats */
     struct stats_record stats;
-    struct stats_record prev_stats;
+    struct ring_stats ring;
+
+    struct xsk_worker_stats shared;
+};
+
+static inline unsigned int batch_hist_bucket(const unsigned int n) {
+    if (n == 0)
+        return 0;
+
+    const unsigned int bucket = 32 - __builtin_clz(n);
+    return bucket < BATCH_HIST_BUCKETS ? bucket : BATCH_HIST_BUCKETS - 1;
+}
+
+struct xsk_socket_info* init_xsk_socket(const char* prefix, uint32_t queue_id);
+/* Direct mode, binds to one PHY RX queue the daemon handed to this port */
+struct xsk_socket_info* init_xsk_socket_direct(const char* phy_ifname, uint32_t queue_id);
+void set_memory_limit();
+
+/* mmap layout of the XSKs the daemon binds for a port, sent along with them */
+struct xsk_layout {
+    uint32_t frames;
+    uint32_t frame_size;
+    uint32_t rx;
+    uint32_t tx;
+    uint32_t fill;
+    uint32_t comp;
+    int32_t slot; /* Switch ports only, -1 otherwise */
 };
 
-struct xsk_socket_info* init_xsk_socket(const char* ifname);
-void set_memory_limit();
\ No newline at end of file
+/* "xsk frames=.. frame_size=.. rx=.. tx=.. fill=.. comp=..", switch ports add " slot=.." */
+int xsk_layout_parse(const char* line, struct xsk_layout* layout);
+/* Maps an XSK and its UMEM memfd received from the daemon, no privileges needed */
+struct xsk_socket_info* xsk_socket_adopt(int xsk_fd, int umem_fd, uint32_t queue_id, const struct xsk_layout* layout);
+/*
+ * Switch mode: maps the port's rings and the UMEM of every queue listed in queues out of the fds the daemon handed over
+ * (ring region, wake eventfd, then a kick eventfd and UMEM memfd per queue). Fills xsks, returns how many or -1
+ */
+int xsk_switch_attach(const struct ctl_fds* fds, char* queues, const struct xsk_layout* layout, struct xsk_socket_info** xsks, int max);